@@ -22,105 +22,212 @@ constexpr uint16_t ROCK_TYPE = EXP_TYPE - 1;
 constexpr uint16_t FADE_IN = 0x1;
 constexpr uint16_t EATEN = 0x2;
 
-struct RenderCell {
-    uint16_t type;
-    uint16_t flags;
+// Cells are split into groups by type so every group's per frame loops
+// run without branching on type
+enum CellGroupType : uint32_t {
+    GROUP_PELLET,
+    GROUP_EJECT,
+    GROUP_PLAYER,  // Dead cells too
+    GROUP_OTHER,   // Viruses, rocks & perks
+    GROUP_COUNT
+};
+
+static inline uint32_t groupOf(uint16_t type) {
+    if (type == PELLET_TYPE) return GROUP_PELLET;
+    if (type & EJECT_BIT) return GROUP_EJECT;
+    if (type <= DEAD_TYPE) return GROUP_PLAYER;
+    return GROUP_OTHER;
+}
+
+// A cell is referred to by a handle, its group and index in the group
+constexpr uint32_t GROUP_SHIFT = 24;
+constexpr uint32_t INDEX_MASK = (1 << GROUP_SHIFT) - 1;
+constexpr uint32_t REMOVED = ~0u;
+
+#define CELL_FIELDS(X)                                                       \
+    X(uint16_t, type)                                                        \
+    X(uint16_t, flags) X(float, alpha) X(float, rotation) X(float, animation) \
+    X(float, oX) X(float, oY) X(float, oR)                                   \
+    X(float, cX) X(float, cY) X(float, cR)                                   \
+    X(int32_t, nX) X(int32_t, nY) X(int32_t, nR)                             \
+    X(int32_t, dX) X(int32_t, dY) X(int32_t, dR)                             \
+    X(Color, color) X(uint32_t, pos)
+
+// Render cells of one group as a struct of arrays. Live cells come first,
+// cells fading out after being removed follow them.
+struct CellGroup {
+#define X(T, name) vector<T> name;
+    CELL_FIELDS(X)
+#undef X
+    // dX/dY/dR: last change of nX/nY/nR (halved), what the next frame
+    // predicts. pos: index in the client's cell list, REMOVED once the
+    // server drops the cell.
+
+    uint32_t kind = GROUP_OTHER;
+    uint32_t live = 0;
+    uint32_t size = 0;
+
+    // Fade in (0 for none) and fade out durations
+    float fadeIn = 0;
+    float fadeOut = 175;
+
+    void reset(uint32_t kind, uint32_t capacity) {
+        this->kind = kind;
+        live = size = 0;
+        fadeIn = kind == GROUP_PELLET ? 1500 : kind == GROUP_EJECT ? 500 : 0;
+        fadeOut = kind == GROUP_PELLET ? 1500 : 175;
+#define X(T, name)        \
+    name.clear();         \
+    name.shrink_to_fit(); \
+    name.resize(capacity);
+        CELL_FIELDS(X)
+#undef X
+    }
 
-    float alpha;
-    float rotation;
-    float animation;
+    inline void copy(uint32_t from, uint32_t to) {
+#define X(T, name) name[to] = name[from];
+        CELL_FIELDS(X)
+#undef X
+    }
 
-    float oX, oY, oR, cX, cY, cR;
-    int32_t nX, nY, nR;
+    inline void swap(uint32_t a, uint32_t b) {
+#define X(T, name) std::swap(name[a], name[b]);
+        CELL_FIELDS(X)
+#undef X
+    }
 
-    Color color;
+    uint32_t add(uint16_t type, int32_t x, int32_t y, int32_t r,
+                 int color_offset) {
+        if (size == this->type.size()) {
+#define X(T, name) this->name.resize(size * 2 + 64);
+            CELL_FIELDS(X)
+#undef X
+        }
 
-    RenderCell(){};
+        // First fading cell goes to the end to make room
+        if (size > live) copy(live, size);
+        size++;
+        const uint32_t i = live++;
 
-    void init(uint16_t type, int32_t x, int32_t y, int32_t r,
-              int color_offset) {
-        this->type = type;
-        oX = cX = nX = x;
-        oY = cY = nY = y;
-        oR = cR = nR = r;
+        this->type[i] = type;
+        oX[i] = cX[i] = nX[i] = x;
+        oY[i] = cY[i] = nY[i] = y;
+        oR[i] = cR[i] = nR[i] = r;
+        dX[i] = dY[i] = dR[i] = 0;
 
-        flags = FADE_IN;
-        alpha = 1;
-        rotation = 0;
+        flags[i] = FADE_IN;
+        alpha[i] = 1;
+        rotation[i] = 0;
+        animation[i] = 0;
 
         if (type == PELLET_TYPE) {
-            alpha = 0;
-            flags = FADE_IN;
-            animation = randomZeroToOne * 1000;
-            color = {1, 1, 1};
+            alpha[i] = 0;
+            animation[i] = randomZeroToOne * 1000;
+            color[i] = {1, 1, 1};
         } else if (type == VIRUS_TYPE) {
-            color = VIRUS_COLOR;
-            color.vibrate();
+            color[i] = VIRUS_COLOR;
+            color[i].vibrate();
         } else if (type == ROCK_TYPE) {
-            color = (randomZeroToOne > 0.5) ? ROCK_COLOR1 : ROCK_COLOR2;
-            color.vibrate();
+            color[i] = (randomZeroToOne > 0.5) ? ROCK_COLOR1 : ROCK_COLOR2;
+            color[i].vibrate();
         } else if (type == DEAD_TYPE) {
-            color = DEAD_COLOR;
+            color[i] = DEAD_COLOR;
         } else if (type & EJECT_BIT) {
             auto pid = type & PELLET_TYPE;
-            color = EJECTS_COLORS[(pid + color_offset) % COLOR_COUNT];
-
-            alpha = 0;
-            flags = FADE_IN;
+            color[i] = EJECTS_COLORS[(pid + color_offset) % COLOR_COUNT];
+            alpha[i] = 0;
         } else if (type < ROCK_TYPE) {
-            color = CELL_COLORS[(type + color_offset) % COLOR_COUNT];
+            color[i] = CELL_COLORS[(type + color_offset) % COLOR_COUNT];
         } else {
-            color = {1, 1, 1};
+            color[i] = {1, 1, 1};
         }
+
+        return i;
     }
 
-    inline void update(float lerp, float dt, bool animatePellet) {
-        if ((type != DEAD_TYPE) && (flags & FADE_IN)) {
-            auto duration = (type == PELLET_TYPE) ? 1500 : 500;
-            alpha += dt / duration;
-            if (alpha >= 1) {
-                alpha = 1;
-                flags ^= FADE_IN;
+    // Moves the cells marked REMOVED behind the live ones, cells (the
+    // client's cell list) is pointed at the live cells that moved
+    void partition(vector<uint32_t>& cells) {
+        for (uint32_t i = 0; i < live;) {
+            if (pos[i] != REMOVED) {
+                i++;
+                continue;
             }
+            swap(i, --live);
+            if (pos[i] != REMOVED) cells[pos[i]] = (kind << GROUP_SHIFT) | i;
         }
+    }
 
-        if (type == ROCK_TYPE) {
-            auto dx = nX - oX;
-            auto dy = nY - oY;
-            rotation +=
-                (dx > 0 ? -1 : 1) * sqrtf(dx * dx + dy * dy) / cR * dt * 0.01;
-        } else if (type == PELLET_TYPE && !(flags & FADE_IN)) {
-            if (animatePellet) {
-                animation += dt * 0.001f;
-                alpha = 0.7f + sinf(animation) * 0.3f;
-            } else
-                alpha = 1;
+    inline void updateLive(float lerp, float dt, bool animatePellet) {
+        if (fadeIn) {
+            const float step = dt / fadeIn;
+            for (uint32_t i = 0; i < live; i++) {
+                if (!(flags[i] & FADE_IN)) continue;
+                alpha[i] += step;
+                if (alpha[i] >= 1) {
+                    alpha[i] = 1;
+                    flags[i] ^= FADE_IN;
+                }
+            }
         }
 
-        cX = oX + (nX - oX) * lerp;
-        cY = oY + (nY - oY) * lerp;
-        cR = oR + (nR - oR) * lerp;
+        if (kind == GROUP_PELLET) {
+            const float step = dt * 0.001f;
+            for (uint32_t i = 0; i < live; i++) {
+                if (flags[i] & FADE_IN) continue;
+                if (animatePellet) {
+                    animation[i] += step;
+                    alpha[i] = 0.7f + sinf(animation[i]) * 0.3f;
+                } else
+                    alpha[i] = 1;
+            }
+        }
+
+        for (uint32_t i = 0; kind == GROUP_OTHER && i < live; i++) {
+            if (type[i] != ROCK_TYPE) continue;
+            auto dx = nX[i] - oX[i];
+            auto dy = nY[i] - oY[i];
+            rotation[i] += (dx > 0 ? -1 : 1) * sqrtf(dx * dx + dy * dy) /
+                           cR[i] * dt * 0.01;
+        }
+
+        // Plain loops over the arrays so they vectorize
+        float* __restrict cx = cX.data();
+        float* __restrict cy = cY.data();
+        float* __restrict cr = cR.data();
+        const float* __restrict ox = oX.data();
+        const float* __restrict oy = oY.data();
+        const float* __restrict orr = oR.data();
+        const int32_t* __restrict nx = nX.data();
+        const int32_t* __restrict ny = nY.data();
+        const int32_t* __restrict nr = nR.data();
+
+        for (uint32_t i = 0; i < live; i++) {
+            cx[i] = ox[i] + (float(nx[i]) - ox[i]) * lerp;
+            cy[i] = oy[i] + (float(ny[i]) - oy[i]) * lerp;
+            cr[i] = orr[i] + (float(nr[i]) - orr[i]) * lerp;
+        }
     }
 
-    // Return if this cell should be removed from the container
-    inline bool removeUpdate(float dt) {
-        animation += dt;
+    // Fades the removed cells out, the ones done are dropped
+    inline void updateRemoving(float dt) {
+        for (uint32_t i = live; i < size;) {
+            animation[i] += dt;
 
-        auto duration = (type == PELLET_TYPE) ? 1500 : 175;
-        if (animation > duration) {
-            return true;
-        } else {
-            auto factor = animation / duration;
-            alpha = 1 - factor;
+            if (animation[i] > fadeOut) {
+                if (i != --size) copy(size, i);
+                continue;
+            }
+
+            auto factor = animation[i] / fadeOut;
+            alpha[i] = 1 - factor;
 
-            if (flags & EATEN) {
-                cX = oX + (nX - oX) * factor;
-                cY = oY + (nY - oY) * factor;
-                cR = oR * (1 - factor);
+            if (flags[i] & EATEN) {
+                cX[i] = oX[i] + (nX[i] - oX[i]) * factor;
+                cY[i] = oY[i] + (nY[i] - oY[i]) * factor;
+                cR[i] = oR[i] * (1 - factor);
             }
-            return false;
+            i++;
         }
     }
-};
-
-constexpr size_t RENDER_CELL_T_SIZE = sizeof(RenderCell);
\ No newline at end of file
+};
\ No newline at end of file
@@ -5,10 +5,15 @@
 #include <v8.h>
 
 #include <algorithm>
+#include <bit>
 #include <execution>
+#include <memory>
 #include <sstream>
 
+#include "../misc/bits.hpp"
+#include "../misc/pool.hpp"
 #include "../misc/reader.hpp"
+#include "../misc/ring.hpp"
 #include "cell.hpp"
 
 using namespace v8;
@@ -37,6 +42,9 @@ constexpr uint16_t MAX_PLAYERS = ROCK_TYPE - 1;
 
 #define MAX_CELL_LIMIT 131072
 
+// Has to match the one in player.cc
+constexpr uint8_t PROTOCOL_VERSION = 2;
+
 static std::random_device rd;
 static std::mt19937 generator(rd());
 static std::uniform_int_distribution<int> color_offset_dist(0, COLOR_COUNT - 1);
@@ -45,19 +53,168 @@ struct Viewport {
     float l, r, t, b;
 };
 
+// What gets drawn, sorted by radius
+struct RenderItem {
+    float r;
+    uint32_t handle;
+};
+
+// 6 vertices of (x, y, u, v) floats and (r, g, b, a, unit) bytes
+constexpr size_t QUAD_FLOATS = 24;
+constexpr size_t QUAD_BYTES = 30;
+
+// One quad for instanced rendering, the shader makes the 6 vertices out of
+// it. Half extents w and h, rotated by angle (a full turn is 65536), uvs
+// and color are normalized.
+struct Instance {
+    float x, y, w, h;
+    uint16_t uv[4];
+    uint8_t color[4];
+    uint16_t angle;
+    uint8_t unit;
+    uint8_t pad;
+};
+
+static_assert(sizeof(Instance) == 32, "Instance layout is shared with the shader");
+
+// Sinks for the loops that draw the render list, writeVertices and
+// writeRotated are overloaded for each. The count pass only finds out how
+// many quads an item takes.
+struct QuadCounter {
+    size_t quads = 0;
+};
+
+struct VertexWriter {
+    float* buffer0;
+    size_t i0;
+    uint8_t* buffer1;
+    size_t i1;
+
+    inline VertexWriter at(size_t quads) const {
+        return { buffer0, quads * QUAD_FLOATS, buffer1, quads * QUAD_BYTES };
+    }
+    inline size_t quads() const { return i0 / QUAD_FLOATS; }
+    inline bool wrote(size_t quads) const {
+        return i0 == quads * QUAD_FLOATS && i1 == quads * QUAD_BYTES;
+    }
+};
+
+struct InstanceWriter {
+    Instance* buffer;
+    size_t i;
+
+    inline InstanceWriter at(size_t quads) const { return { buffer, quads }; }
+    inline size_t quads() const { return i; }
+    inline bool wrote(size_t quads) const { return i == quads; }
+};
+
+// Render items a vertex thread takes at a time
+constexpr size_t VERTEX_CHUNK = 1024;
+
+// How the render list gets ordered, settings.sortMode
+enum SortMode : uint32_t { SORT_COMPARE, SORT_RADIX };
+
+// LSD radix sort on quantized radii. Radii are positive, so the bits of the
+// float order the same way the floats do; the exponent and the top 14 bits
+// of the mantissa are kept (2 passes of 11 bits), cells closer than that in
+// size keep the order they were culled in. Big lists are cut into chunks
+// that count and scatter in parallel on the client's pool.
+class RadixSort {
+    static constexpr uint32_t BITS = 11;
+    static constexpr uint32_t BUCKETS = 1 << BITS;
+    static constexpr uint32_t PASSES = 2;
+    static constexpr size_t CHUNK = 16384;
+
+    vector<RenderItem> temp;
+    vector<uint32_t> counts;
+    size_t chunks = 0;
+
+    static inline uint32_t key(const RenderItem& item) {
+        return (std::bit_cast<uint32_t>(item.r) >> 9) & ((1u << (BITS * PASSES)) - 1);
+    }
+
+    template <typename F>
+    inline void forChunks(ThreadPool* pool, F&& f) {
+        if (chunks == 1) f(0);
+        else pool->parallel_for(chunks, f);
+    }
+
+public:
+    void sort(vector<RenderItem>& items, ThreadPool* pool) {
+        const size_t n = items.size();
+        if (n < 2) return;
+
+        temp.resize(n);
+        chunks = (n + CHUNK - 1) / CHUNK;
+        counts.resize(chunks * BUCKETS);
+
+        RenderItem* src = items.data();
+        RenderItem* dst = temp.data();
+
+        for (uint32_t pass = 0; pass < PASSES; pass++) {
+            const uint32_t shift = pass * BITS;
+
+            forChunks(pool, [&](size_t c) {
+                auto count = &counts[c * BUCKETS];
+                std::fill_n(count, BUCKETS, 0);
+                const size_t end = std::min(n, (c + 1) * CHUNK);
+                for (size_t i = c * CHUNK; i < end; i++)
+                    count[(key(src[i]) >> shift) & (BUCKETS - 1)]++;
+            });
+
+            // Offsets bucket by bucket, chunk by chunk so it stays stable
+            uint32_t offset = 0;
+            bool sorted = false;
+            for (uint32_t b = 0; b < BUCKETS; b++) {
+                const uint32_t before = offset;
+                for (size_t c = 0; c < chunks; c++) {
+                    const uint32_t k = counts[c * BUCKETS + b];
+                    counts[c * BUCKETS + b] = offset;
+                    offset += k;
+                }
+                // Every key has this digit, nothing to move
+                if (offset - before == n) sorted = true;
+            }
+            if (sorted) continue;
+
+            forChunks(pool, [&](size_t c) {
+                auto offsets = &counts[c * BUCKETS];
+                const size_t end = std::min(n, (c + 1) * CHUNK);
+                for (size_t i = c * CHUNK; i < end; i++)
+                    dst[offsets[(key(src[i]) >> shift) & (BUCKETS - 1)]++] = src[i];
+            });
+
+            std::swap(src, dst);
+        }
+
+        if (src != items.data()) items.swap(temp);
+    }
+};
+
 struct ClientState {
-    vector<RenderCell*> cells;
-    vector<RenderCell*> removing;
-    vector<RenderCell*> rendering;
-    vector<RenderCell*> freed;
+    // Handles of the cells in the order the server has them
+    vector<uint32_t> cells;
+    vector<RenderItem> rendering;
 
-    RenderCell pool[MAX_CELL_LIMIT];
+    CellGroup groups[GROUP_COUNT];
 
     PlayerData players[MAX_PLAYERS];
     BitmapTextData charText[256];
 
     int color_offset;
 
+    // Frames from the engine, when it shares a ring with us
+    std::shared_ptr<BackingStore> frameStore;
+    FrameRing frames;
+
+    uint32_t sortMode = SORT_RADIX;
+    RadixSort radix;
+
+    // Writes vertices along with the JS thread. Small, the engine worker
+    // needs the rest of the cpus
+    ThreadPool* pool;
+    vector<size_t> chunkQuads;
+
     struct {
         float prep;
         float update;
@@ -68,6 +225,9 @@ struct ClientState {
 
     ClientState() {
         memset(&charText, 0, sizeof(charText));
+        pool = new ThreadPool(
+            std::clamp(std::thread::hardware_concurrency() / 4, 1u, 3u),
+            Placement::NONE);
         init();
     }
 
@@ -75,95 +235,135 @@ struct ClientState {
         color_offset = color_offset_dist(generator);
 
         // Not neccesary but in case
-        memset(&pool, 0, sizeof(pool));
         memset(&players, 0, sizeof(players));
 
         cells.clear();
         cells.shrink_to_fit();
         cells.reserve(2048);
 
-        removing.clear();
-        removing.shrink_to_fit();
-        removing.reserve(2048);
-
-        freed.clear();
-        freed.shrink_to_fit();
-        freed.reserve(MAX_CELL_LIMIT);
-
         rendering.clear();
         rendering.shrink_to_fit();
         rendering.reserve(4096);
 
-        for (int i = MAX_CELL_LIMIT - 1; i >= 0; i--) {
-            freed.push_back(&this->pool[i]);
-        }
+        for (uint32_t g = 0; g < GROUP_COUNT; g++) groups[g].reset(g, 1024);
+    }
+
+    inline CellGroup& group(uint32_t handle) {
+        return groups[handle >> GROUP_SHIFT];
     }
 
-    RenderCell* newCell() {
-        if (freed.size()) {
-            auto ptr = freed.back();
-            freed.pop_back();
-            cells.push_back(ptr);
-            return ptr;
-        } else
-            return nullptr;
+    size_t count() {
+        size_t n = 0;
+        for (auto& g : groups) n += g.size;
+        return n;
+    }
+
+    // Adds a cell at the end of the cell list
+    uint32_t newCell(uint16_t type, int32_t x, int32_t y, int32_t r) {
+        auto kind = groupOf(type);
+        auto& g = groups[kind];
+        auto i = g.add(type, x, y, r, color_offset);
+        g.pos[i] = cells.size();
+        cells.push_back((kind << GROUP_SHIFT) | i);
+        return i;
     }
 
     bool update(float lerp, float dt, bool animateFood, bool renderFood,
                 Viewport v) {
         uint64_t t0 = hrtime(), t1, t2, t3;
 
-        if (cells.size() + removing.size() + freed.size() != MAX_CELL_LIMIT) {
+        size_t live = 0;
+        for (auto& g : groups) live += g.live;
+        if (live != cells.size() || count() > MAX_CELL_LIMIT) {
             return false;
         }
 
         // Filter render cells and sort them
         rendering.clear();
-        rendering.reserve(cells.size() + removing.size());
+        rendering.reserve(count());
 
         auto rMin = std::min(v.r - v.l, v.t - v.b) * 0.0003f;
 
-        for (auto& cell : cells) {
-            if (!renderFood && cell->type == PELLET_TYPE) continue;
-            cell->update(lerp, dt, animateFood);
-            if (cell->cR > rMin && cell->cX - cell->cR < v.r &&
-                cell->cX + cell->cR > v.l && cell->cY - cell->cR < v.t &&
-                cell->cY + cell->cR > v.b)
-                rendering.push_back(cell);
+        auto cull = [&](CellGroup& g, uint32_t from, uint32_t to) {
+            const uint32_t base = g.kind << GROUP_SHIFT;
+            for (uint32_t i = from; i < to; i++) {
+                const float x = g.cX[i], y = g.cY[i], r = g.cR[i];
+                if (r > rMin && x - r < v.r && x + r > v.l && y - r < v.t &&
+                    y + r > v.b)
+                    rendering.push_back({r, base | i});
+            }
+        };
+
+        for (auto& g : groups) {
+            if (!renderFood && g.kind == GROUP_PELLET) continue;
+            g.updateLive(lerp, dt, animateFood);
+            cull(g, 0, g.live);
         }
 
         timings.update = time_func(t0, t1);
 
-        removing.erase(
-            std::remove_if(
-                removing.begin(), removing.end(),
-                [&](RenderCell*& cell) {
-                    if (cell->removeUpdate(dt)) {
-                        freed.push_back(cell);  // "free" the cell
-                        return true;
-                    }
-                    if (!renderFood && cell->type == PELLET_TYPE) return false;
-                    if (cell->cR > rMin && cell->cX - cell->cR < v.r &&
-                        cell->cX + cell->cR > v.l &&
-                        cell->cY - cell->cR < v.t && cell->cY + cell->cR > v.b)
-                        rendering.push_back(cell);
-                    return false;  // Keep the cell in the array
-                }),
-            removing.end());
+        for (auto& g : groups) {
+            g.updateRemoving(dt);
+            if (!renderFood && g.kind == GROUP_PELLET) continue;
+            cull(g, g.live, g.size);
+        }
 
         timings.remove = time_func(t1, t2);
 
         // Ascend, draw smaller cells first since we are not doing Z-test
-        // std::sort(rendering.begin(), rendering.end(),
-        //           [](auto a, auto b) { return a->cR <= b->cR; });
-
-        std::sort(std::execution::par_unseq, rendering.begin(), rendering.end(),
-                  [](auto a, auto b) { return a->cR <= b->cR; });
+        if (sortMode == SORT_RADIX) {
+            radix.sort(rendering, pool);
+        } else {
+            std::sort(std::execution::par_unseq, rendering.begin(),
+                      rendering.end(),
+                      [](auto& a, auto& b) { return a.r < b.r; });
+        }
 
         timings.sort = time_func(t2, t3);
 
         return true;
     }
+
+    // Draws the render list through base (a VertexWriter or InstanceWriter),
+    // emit(item, out) writes the quads of one item. Chunks of the list are
+    // counted first so every thread knows where its quads start, then
+    // written in parallel. Returns the number of quads, or -1 if a chunk
+    // didn't write what it counted.
+    template <typename Writer, typename Emit>
+    int64_t writeAll(const Writer& base, const Emit& emit) {
+        const size_t chunks = (rendering.size() + VERTEX_CHUNK - 1) / VERTEX_CHUNK;
+
+        auto each = [&](size_t c, auto& out) {
+            const size_t end = std::min(rendering.size(), (c + 1) * VERTEX_CHUNK);
+            for (size_t k = c * VERTEX_CHUNK; k < end; k++) emit(rendering[k], out);
+        };
+
+        if (chunks <= 1) {
+            Writer out = base.at(0);
+            if (chunks) each(0, out);
+            if (!out.wrote(out.quads())) return -1;
+            return out.quads();
+        }
+
+        chunkQuads.resize(chunks + 1);
+        chunkQuads[0] = 0;
+        pool->parallel_for(chunks, [&](size_t c) {
+            QuadCounter out;
+            each(c, out);
+            chunkQuads[c + 1] = out.quads;
+        });
+
+        for (size_t c = 0; c < chunks; c++) chunkQuads[c + 1] += chunkQuads[c];
+
+        std::atomic<bool> mismatch = false;
+        pool->parallel_for(chunks, [&](size_t c) {
+            Writer out = base.at(chunkQuads[c]);
+            each(c, out);
+            if (!out.wrote(chunkQuads[c + 1])) mismatch = true;
+        });
+
+        return mismatch ? -1 : int64_t(chunkQuads[chunks]);
+    }
 };
 
 constexpr size_t state_size = sizeof(ClientState);
@@ -266,6 +466,80 @@ inline void writeQuadVertices(float* buffer0, size_t& i0, uint8_t* buffer1,
     }
 }
 
+template <typename... Args>
+inline void writeVertices(QuadCounter& out, Args&&...) {
+    out.quads++;
+}
+
+template <typename... Args>
+inline void writeRotated(QuadCounter& out, Args&&...) {
+    out.quads++;
+}
+
+template <typename... Args>
+inline void writeVertices(VertexWriter& out, Args&&... args) {
+    writeVertices(out.buffer0, out.i0, out.buffer1, out.i1, args...);
+}
+
+// Square of half size r around x, y rotated by angle (radians)
+inline void writeRotated(VertexWriter& out, float x, float y, float r,
+                         float angle, float uv_x0, float uv_y0, float uv_x1,
+                         float uv_y1, Color color, float alpha,
+                         uint8_t texUnit) {
+    const float s = sinf(angle) * r;
+    const float c = cosf(angle) * r;
+    const float x0 = -c + s;
+    const float y0 = -c - s;
+    writeQuadVertices(out.buffer0, out.i0, out.buffer1, out.i1, x + x0,
+                      y + y0, x + y0, y - x0, x - y0, y + x0, x - x0, y - y0,
+                      uv_x0, uv_y0, uv_x1, uv_y1, color, alpha, texUnit);
+}
+
+inline uint16_t unorm16(float v) {
+    return uint16_t(std::clamp(v, 0.f, 1.f) * 65535.f + 0.5f);
+}
+
+inline void writeInstance(InstanceWriter& out, float x, float y, float w,
+                          float h, uint16_t angle, float uv_x0, float uv_y0,
+                          float uv_x1, float uv_y1, Color color, float alpha,
+                          uint8_t texUnit) {
+    auto& inst = out.buffer[out.i++];
+    inst.x = x;
+    inst.y = y;
+    inst.w = w;
+    inst.h = h;
+    inst.uv[0] = unorm16(uv_x0);
+    inst.uv[1] = unorm16(uv_y0);
+    inst.uv[2] = unorm16(uv_x1);
+    inst.uv[3] = unorm16(uv_y1);
+    inst.color[0] = uint8_t(color.r * 255);
+    inst.color[1] = uint8_t(color.g * 255);
+    inst.color[2] = uint8_t(color.b * 255);
+    inst.color[3] = uint8_t(alpha * 255);
+    inst.angle = angle;
+    inst.unit = texUnit;
+    inst.pad = 0;
+}
+
+inline void writeVertices(InstanceWriter& out, float x0, float y0, float x1,
+                          float y1, float uv_x0, float uv_y0, float uv_x1,
+                          float uv_y1, Color color, float alpha,
+                          uint8_t texUnit) {
+    writeInstance(out, (x0 + x1) * 0.5f, (y0 + y1) * 0.5f, (x1 - x0) * 0.5f,
+                  (y1 - y0) * 0.5f, 0, uv_x0, uv_y0, uv_x1, uv_y1, color,
+                  alpha, texUnit);
+}
+
+inline void writeRotated(InstanceWriter& out, float x, float y, float r,
+                         float angle, float uv_x0, float uv_y0, float uv_x1,
+                         float uv_y1, Color color, float alpha,
+                         uint8_t texUnit) {
+    constexpr float TURN = 65536.f / (2 * M_PI);
+    writeInstance(out, x, y, r, r,
+                  uint16_t(int32_t(fmodf(angle, 2 * M_PI) * TURN)), uv_x0,
+                  uv_y0, uv_x1, uv_y1, color, alpha, texUnit);
+}
+
 // Welcome to macro HELL
 
 #define field(obj, str) \
@@ -337,6 +611,8 @@ void render(const FunctionCallbackInfo<Value>& args) {
     auto lerp = (float)args[1]->NumberValue(ctx).ToChecked();
     auto dt = (float)args[2]->NumberValue(ctx).ToChecked();
     auto debug = args[3]->BooleanValue(iso);
+    // Instances go into spriteBuffer as well, colorBuffer isn't used then
+    auto instanced = args[4]->BooleanValue(iso);
 
     auto timings = fieldTyped(clientObj, "r_timings", Object);
 
@@ -486,6 +762,9 @@ void render(const FunctionCallbackInfo<Value>& args) {
                               ->Int32Value(ctx)
                               .ToChecked();
     const bool longMass = massMode == 2;
+    state->sortMode = field(objField(settings, "sortMode"), "v")
+                          ->Uint32Value(ctx)
+                          .ToChecked();
 
     auto textMin =
         std::min(viewport.r - viewport.l, viewport.t - viewport.b) * 0.03f;
@@ -545,22 +824,19 @@ void render(const FunctionCallbackInfo<Value>& args) {
     constexpr float CIRCLE_PADDING = 6;
     constexpr float P = 1 + CIRCLE_PADDING / CIRCLE_RADIUS;
 
-    char mass_buffer[64];
-
     auto buffer_start = hrtime();
 
-    size_t v_index = 0;
-    size_t c_index = 0;
-
-    for (auto cell : state->rendering) {
-        const auto& type = cell->type;
-        const auto& x = cell->cX;
-        const auto& y = cell->cY;
-        const auto& rr = cell->cR;
-        const auto& color = cell->color;
-        const auto& alpha = cell->alpha;
-
-#define DATA buffer0, v_index, buffer1, c_index
+    auto emit = [&](const RenderItem& item, auto& out) {
+        auto& g = state->group(item.handle);
+        const auto i = item.handle & INDEX_MASK;
+        const auto& type = g.type[i];
+        const auto& x = g.cX[i];
+        const auto& y = g.cY[i];
+        const auto& rr = g.cR[i];
+        const auto& color = g.color[i];
+        const auto& alpha = g.alpha[i];
+
+#define DATA out
 #define X0Y0X1Y1 x - r, y - r, x + r, y + r
 
         if ((type & EJECT_BIT) || (type == PELLET_TYPE)) {
@@ -579,23 +855,17 @@ void render(const FunctionCallbackInfo<Value>& args) {
             auto r = rr * 1.2f;
             writeVertices(DATA, X0Y0X1Y1, UVs(VIRUS), color, alpha, 1);
         } else if (type == CYT_TYPE) {
-            if (!cytTexValid) continue;
+            if (!cytTexValid) return;
             auto r = rr * 1.1f;
             writeVertices(DATA, X0Y0X1Y1, UVs(CYT), color, alpha, 1);
         } else if (type == EXP_TYPE) {
-            if (!expTexValid) continue;
+            if (!expTexValid) return;
             auto r = rr * 1.2f;
             writeVertices(DATA, X0Y0X1Y1, UVs(CYT), color, alpha, 1);
         } else if (type == ROCK_TYPE) {
-            if (!rockTexValid) continue;
-            const float r = rr * 1.05f;
-            const float s = sinf(cell->rotation);
-            const float c = sinf(cell->rotation);
-            const float x0 = -c + s;
-            const float y0 = -c - s;
-            writeQuadVertices(DATA, x + x0, y + y0, x + y0, y - x0, x - y0,
-                              y + x0, x - x0, y - y0, UVs(ROCK), color, alpha,
-                              1);
+            if (!rockTexValid) return;
+            writeRotated(DATA, x, y, rr * 1.05f, g.rotation[i], UVs(ROCK),
+                         color, alpha, 1);
         } else {
             // Player cell
             auto r = rr * P;
@@ -658,7 +928,8 @@ void render(const FunctionCallbackInfo<Value>& args) {
 
             // Draw mass
             if (massMode && r > textMin) {
-                const float mass = cell->cR * cell->cR * 0.01f;
+                char mass_buffer[64];
+                const float mass = rr * rr * 0.01f;
                 int mass_len;
 
                 if (longMass || mass < 1000) {
@@ -674,16 +945,16 @@ void render(const FunctionCallbackInfo<Value>& args) {
                 }
 
                 float width = 0.f;
-                for (int i = 0; i < mass_len; i++) {
+                for (int k = 0; k < mass_len; k++) {
                     // Indexing with char, assume it's greater than 0...
                     width += MASS_GAP * MASS_SCALE_X *
-                             state->charText[mass_buffer[i]].width;
+                             state->charText[mass_buffer[k]].width;
                 }
 
                 // Center text
                 float currX = width * -0.5f;
-                for (int i = 0; i < mass_len; i++) {
-                    auto& data = state->charText[mass_buffer[i]];
+                for (int k = 0; k < mass_len; k++) {
+                    auto& data = state->charText[mass_buffer[k]];
                     auto& uvs = data.uvs;
 
                     float x0 = x + currX * r;
@@ -699,7 +970,14 @@ void render(const FunctionCallbackInfo<Value>& args) {
                 }
             }
         }
-    }
+    };
+
+    const auto quads =
+        instanced
+            ? state->writeAll(
+                  InstanceWriter{ reinterpret_cast<Instance*>(buffer0), 0 },
+                  emit)
+            : state->writeAll(VertexWriter{ buffer0, 0, buffer1, 0 }, emit);
 
     uint64_t buffer_end;
     state->timings.buffer = time_func(buffer_start, buffer_end);
@@ -719,29 +997,33 @@ void render(const FunctionCallbackInfo<Value>& args) {
     timings->Set(ctx, String::NewFromUtf8Literal(iso, "total"),
                  Number::New(iso, time_func(prep_start, total_end)));
 
-    if (v_index / 4 != c_index / 5) {
+    if (quads < 0) {
         iso->ThrowException(Exception::Error(
             String::NewFromUtf8Literal(iso, "v_index / 4 != c_index / 5")));
         return;
     }
 
-    args.GetReturnValue().Set(Number::New(iso, double(v_index)));
+    // Instance count, or the length of the vertex data
+    args.GetReturnValue().Set(
+        Number::New(iso, double(instanced ? quads : quads * QUAD_FLOATS)));
 }
 
-void parse(const FunctionCallbackInfo<Value>& args) {
-    auto state =
-        static_cast<ClientState*>(Local<External>::Cast(args.Data())->Value());
+// Applies one frame to the cells, args[0] is the client object
+void parseFrameData(const FunctionCallbackInfo<Value>& args,
+                    ClientState* state, string_view frame) {
     auto iso = args.GetIsolate();
     auto ctx = iso->GetCurrentContext();
 
     auto clientObj = args[0].As<Object>();
-    auto v8buf = args[1].As<ArrayBuffer>();
-    auto nodeBuffer =
-        node::Buffer::New(iso, v8buf, 0, v8buf->ByteLength()).ToLocalChecked();
-    auto buffer = node::Buffer::Data(nodeBuffer.As<Object>());
 
     bool error = false;
-    Reader r(string_view(buffer, v8buf->ByteLength()), error);
+    Reader r(frame, error);
+
+    if (r.read<uint8_t>() != PROTOCOL_VERSION) {
+        iso->ThrowException(Exception::RangeError(
+            String::NewFromUtf8Literal(iso, "Unsupported protocol version")));
+        return;
+    }
 
 #define str(arg) String::NewFromUtf8Literal(iso, arg)
 #define num(arg) Number::New(iso, arg)
@@ -777,9 +1059,8 @@ void parse(const FunctionCallbackInfo<Value>& args) {
     set(map, 1, num(r.read<float>()));
 
     auto curr_size = r.read<uint32_t>();
+    auto newCount = r.read<uint32_t>();
     auto& cells = state->cells;
-    auto& removing = state->removing;
-    auto& freed = state->freed;
 
 #undef str
 #undef bool
@@ -799,97 +1080,112 @@ void parse(const FunctionCallbackInfo<Value>& args) {
         return;
     }
 
+    // Eaters are indexed before cells get compacted. Handles don't change
+    // until the groups are partitioned after the loop.
     auto copy = cells;
 
-    int w_id = 0;
+    // Protocol v2, see Player::onTick
+    BitReader bits(r, error);
+    const uint32_t indexBits = std::bit_width(curr_size);
+
+    auto keep = [&](uint32_t h, uint32_t at) {
+        cells[at] = h;
+        state->group(h).pos[h & INDEX_MASK] = at;
+    };
+
+    auto predict = [&](uint32_t h) {
+        auto& g = state->group(h);
+        auto i = h & INDEX_MASK;
+        g.oX[i] = g.cX[i];
+        g.oY[i] = g.cY[i];
+        g.oR[i] = g.cR[i];
+        g.nX[i] += 2 * g.dX[i];
+        g.nY[i] += 2 * g.dY[i];
+        g.nR[i] += 2 * g.dR[i];
+    };
+
+    auto remove = [&](uint32_t h) {
+        auto& g = state->group(h);
+        auto i = h & INDEX_MASK;
+        g.oX[i] = g.cX[i];
+        g.oY[i] = g.cY[i];
+        g.oR[i] = g.cR[i];
+        g.animation[i] = 0;
+        g.pos[i] = REMOVED;
+    };
+
+    uint32_t w_id = 0;
     // Parse the buffer
-    for (uint32_t i = 0; i < curr_size; i++) {
-        if (w_id < i) cells[w_id] = cells[i];
-
-        auto cell = cells[w_id];
-
-        cell->oX = cell->cX;
-        cell->oY = cell->cY;
-        cell->oR = cell->cR;
-
-        uint32_t flags = r.read<uint8_t>();
-        uint32_t subop = flags >> 6;
-
-        if (!subop) {
-            cell->animation = 0;
-            removing.push_back(cell);
-        } else if (subop == 1) {
-            w_id++;
-
-            // Some delta decompression below
-            if (!(flags & 63)) continue;
-
-            uint32_t dx_op = (flags >> 4) & 3;
-            if (!dx_op) {
-                // Does nothing
-            } else if (dx_op == 1) {
-                uint16_t d = r.read<uint8_t>();
-                cell->nX += d * 2;
-            } else if (dx_op == 2) {
-                uint16_t d = r.read<uint8_t>();
-                cell->nX -= d * 2;
-            } else {
-                cell->nX = 2 * r.read<int16_t>();
+    for (uint32_t i = 0; i < curr_size && !error;) {
+        uint32_t op = bits.get(2);
+
+        if (op == 3) {
+            // Run of cells that moved as predicted
+            uint32_t run = bits.gamma();
+            if (run > curr_size - i) {
+                error = true;
+                break;
             }
-
-            uint32_t dy_op = (flags >> 2) & 3;
-            if (!dy_op) {
-                // Does nothing
-            } else if (dy_op == 1) {
-                uint16_t d = r.read<uint8_t>();
-                cell->nY += d * 2;
-            } else if (dy_op == 2) {
-                uint16_t d = r.read<uint8_t>();
-                cell->nY -= d * 2;
-            } else {
-                cell->nY = 2 * r.read<int16_t>();
+            for (uint32_t end = i + run; i < end; i++, w_id++) {
+                auto h = cells[i];
+                keep(h, w_id);
+                predict(h);
             }
+            continue;
+        }
 
-            uint32_t dr_op = flags & 3;
-            if (!dr_op) {
-                // Does nothing
-            } else if (dr_op == 1) {
-                uint16_t d = r.read<uint8_t>();
-                cell->nR += d * 2;
-            } else if (dr_op == 2) {
-                uint16_t d = r.read<uint8_t>();
-                cell->nR -= d * 2;
-            } else {
-                cell->nR = 2 * r.read<uint16_t>();
+        auto h = cells[i];
+        i++;
+
+        if (op == 0) {
+            remove(h);
+        } else if (op == 1) {
+            keep(h, w_id++);
+
+            auto& g = state->group(h);
+            auto c = h & INDEX_MASK;
+            uint32_t mask = bits.get(3);
+            if (mask & 4) g.dX[c] += BitReader::unzigzag(bits.gamma());
+            if (mask & 2) g.dY[c] += BitReader::unzigzag(bits.gamma());
+            if (mask & 1) g.dR[c] += BitReader::unzigzag(bits.gamma());
+            predict(h);
+        } else {
+            auto eatenBy = bits.get(indexBits);
+            if (eatenBy >= curr_size) {
+                error = true;
+                break;
             }
-        } else if (subop == 2) {
-            auto eatenBy = r.read<uint16_t>();
-            cell->animation = 0;
-            cell->flags |= EATEN;
-            cell->nX = int32_t(cells[eatenBy]->cX);
-            cell->nY = int32_t(cells[eatenBy]->cY);
-            removing.push_back(cell);
-        } else if (subop == 3) {
-            // :dead:
-            iso->ThrowException(Exception::Error(
-                String::NewFromUtf8Literal(iso, "Unexpected subop 3")));
+            remove(h);
+
+            auto& g = state->group(h);
+            auto c = h & INDEX_MASK;
+            auto eater = copy[eatenBy];
+            auto& e = state->group(eater);
+            g.flags[c] |= EATEN;
+            g.nX[c] = int32_t(e.cX[eater & INDEX_MASK]);
+            g.nY[c] = int32_t(e.cY[eater & INDEX_MASK]);
         }
     }
 
     cells.resize(w_id);
+    for (auto& g : state->groups) g.partition(cells);
 
-    auto newCount = r.read<uint32_t>();
+    if (state->count() + newCount > MAX_CELL_LIMIT) error = true;
+
+    uint16_t type = 0;
+    int32_t x = 0, y = 0, R = 0;
+    for (uint32_t i = 0; i < newCount && !error; i++) {
+        if (!bits.get(1)) type = bits.get(16);
+        x += BitReader::unzigzag(bits.gamma() - 1);
+        y += BitReader::unzigzag(bits.gamma() - 1);
+        R += BitReader::unzigzag(bits.gamma() - 1);
 
-    for (uint32_t i = 0; i < newCount; i++) {
-        auto cell = state->newCell();
         // Type, x, y, r
-        auto type = r.read<uint16_t>();
-        auto x = 2 * r.read<int16_t>();
-        auto y = 2 * r.read<int16_t>();
-        auto R = 2 * r.read<uint16_t>();
-        cell->init(type, x, y, R, state->color_offset);
+        state->newCell(type, 2 * x, 2 * y, 2 * R);
     }
 
+    bits.end();
+
     if (error) {
         iso->ThrowException(Exception::RangeError(
             String::NewFromUtf8Literal(iso, "Reader error")));
@@ -903,6 +1199,61 @@ void parse(const FunctionCallbackInfo<Value>& args) {
     args.GetReturnValue().Set(Number::New(iso, double(cells.size())));
 }
 
+void parse(const FunctionCallbackInfo<Value>& args) {
+    auto state =
+        static_cast<ClientState*>(Local<External>::Cast(args.Data())->Value());
+    auto iso = args.GetIsolate();
+
+    auto v8buf = args[1].As<ArrayBuffer>();
+    auto nodeBuffer =
+        node::Buffer::New(iso, v8buf, 0, v8buf->ByteLength()).ToLocalChecked();
+    auto buffer = node::Buffer::Data(nodeBuffer.As<Object>());
+
+    parseFrameData(args, state, string_view(buffer, v8buf->ByteLength()));
+}
+
+// Same ring the engine writes frames into, parsed in place by parseFrame
+void setFrameRing(const FunctionCallbackInfo<Value>& args) {
+    auto state =
+        static_cast<ClientState*>(Local<External>::Cast(args.Data())->Value());
+    auto iso = args.GetIsolate();
+
+    if (args.Length() < 1 || !args[0]->IsSharedArrayBuffer()) {
+        state->frames = FrameRing();
+        state->frameStore.reset();
+        return;
+    }
+
+    state->frameStore = args[0].As<SharedArrayBuffer>()->GetBackingStore();
+    state->frames = FrameRing(state->frameStore->Data(),
+                              state->frameStore->ByteLength(), 0, false);
+
+    args.GetReturnValue().Set(Boolean::New(iso, state->frames.valid()));
+}
+
+// parse, but args[1] is the seq of a frame in the ring
+void parseFrame(const FunctionCallbackInfo<Value>& args) {
+    auto state =
+        static_cast<ClientState*>(Local<External>::Cast(args.Data())->Value());
+    auto iso = args.GetIsolate();
+
+    uint32_t seq =
+        args[1]->Uint32Value(iso->GetCurrentContext()).FromMaybe(0u);
+    auto frame = state->frames.frame(seq);
+
+    if (!frame.data()) {
+        iso->ThrowException(Exception::RangeError(
+            String::NewFromUtf8Literal(iso, "Frame not in ring")));
+        return;
+    }
+
+    parseFrameData(args, state, frame);
+    // Slot goes back to the engine even if the frame was bad
+    state->frames.release(seq);
+
+    args.GetReturnValue().Set(Number::New(iso, double(frame.size())));
+}
+
 void renderV(const FunctionCallbackInfo<Value>& args) {
     auto state =
         static_cast<ClientState*>(Local<External>::Cast(args.Data())->Value());
@@ -950,28 +1301,30 @@ void renderV(const FunctionCallbackInfo<Value>& args) {
         return;
     }
 
-    size_t v_index = 0;
-    size_t c_index = 0;
-
-    for (auto cell : state->rendering) {
-        const auto& type = cell->type;
-        const auto& x = cell->cX;
-        const auto& y = cell->cY;
-        const auto& color = cell->color;
-        const auto& alpha = cell->alpha;
+    auto emit = [&](const RenderItem& item, auto& out) {
+        auto& g = state->group(item.handle);
+        const auto i = item.handle & INDEX_MASK;
+        const auto& type = g.type[i];
+        const auto& x = g.cX[i];
+        const auto& y = g.cY[i];
+        const auto& color = g.color[i];
+        const auto& alpha = g.alpha[i];
 
-        const float r = cell->cR * 1.052f * modifier;
+        const float r = g.cR[i] * 1.052f * modifier;
         writeVertices(DATA, X0Y0X1Y1, 0, 0, 1, 1, color,
                       alpha * (type == DEAD_TYPE ? 0.5f : 1.f), 0);
-    }
+    };
+
+    const auto quads =
+        state->writeAll(VertexWriter{ buffer0, 0, buffer1, 0 }, emit);
 
-    if (v_index / 4 != c_index / 5) {
+    if (quads < 0) {
         iso->ThrowException(Exception::Error(
             String::NewFromUtf8Literal(iso, "v_index / 4 != c_index / 5")));
         return;
     }
 
-    args.GetReturnValue().Set(Number::New(iso, double(v_index)));
+    args.GetReturnValue().Set(Number::New(iso, double(quads * QUAD_FLOATS)));
 }
 
 #undef fieldTyped
@@ -1029,15 +1382,17 @@ void getPID(const FunctionCallbackInfo<Value>& args) {
 
     float maxR = 0.f;
     uint16_t pid = 0;
-    for (auto& c : state->rendering) {
-        if (c->type > CYT_TYPE) continue;
-        if (c->cR < maxR) continue;
-        float dx = x - c->cX;
-        float dy = y - c->cY;
+    for (auto& item : state->rendering) {
+        auto& g = state->group(item.handle);
+        const auto i = item.handle & INDEX_MASK;
+        if (g.type[i] > CYT_TYPE) continue;
+        if (g.cR[i] < maxR) continue;
+        float dx = x - g.cX[i];
+        float dy = y - g.cY[i];
         float sqr = dx * dx + dy * dy;
-        if (sqr > c->cR * c->cR) continue;
-        maxR = c->cR;
-        pid = c->type;
+        if (sqr > g.cR[i] * g.cR[i]) continue;
+        maxR = g.cR[i];
+        pid = g.type[i];
     }
 
     args.GetReturnValue().Set(Number::New(iso, pid));
@@ -1068,6 +1423,8 @@ extern "C" NODE_MODULE_EXPORT void NODE_MODULE_INITIALIZER(
     exportFunc(isolate, exports, ctx, "postInit", postInit);
     exportFunc(isolate, exports, ctx, "render", render);
     exportFunc(isolate, exports, ctx, "parse", parse);
+    exportFunc(isolate, exports, ctx, "setFrameRing", setFrameRing);
+    exportFunc(isolate, exports, ctx, "parseFrame", parseFrame);
     exportFunc(isolate, exports, ctx, "getCellColor", getCellColor);
     exportFunc(isolate, exports, ctx, "clear", clear);
     exportFunc(isolate, exports, ctx, "getPID", getPID);
@@ -1,7 +1,9 @@
 #include "player.hpp"
 
 #include <bitset>
+#include <limits>
 
+#include "../misc/bits.hpp"
 #include "../misc/writer.hpp"
 #include "../physics/engine.hpp"
 #include "server.hpp"
@@ -10,10 +12,22 @@ using std::bitset;
 
 #define MAX_CELL_LIMIT 262144
 
-static bitset<MAX_CELL_LIMIT> LAST_VISIBLE;
-static bitset<MAX_CELL_LIMIT> CURR_VISIBLE;
-static cell_id_t ID_LOOKUP[MAX_CELL_LIMIT];
-static vector<CellCache> NEW_CELL_CACHE;
+// First byte of every frame, parse in the gfx addon checks it
+constexpr uint8_t PROTOCOL_VERSION = 2;
+
+// Scratch space of onTick, one per thread so players can build their views
+// in parallel. Both bitsets stay clear between ticks, only the bits that were
+// set get cleared.
+struct ViewScratch {
+    bitset<MAX_CELL_LIMIT> lastVisible;
+    bitset<MAX_CELL_LIMIT> currVisible;
+    vector<cell_id_t> currIds;
+    // Only read for ids in the cache, which are all written first
+    cell_id_t idLookup[MAX_CELL_LIMIT];
+    vector<CellCache> newCells;
+};
+
+static thread_local unique_ptr<ViewScratch> SCRATCH;
 
 Player::Player(Server* server) : GameHandle(server, "player") {
     dual = new DualHandle(this);
@@ -28,8 +42,11 @@ void Player::setEngine(Engine* engine) {
     pids[1] = 0;
 
     // Clear cell cache
-    cache.clear();
-    cache.shrink_to_fit();
+    view = View();
+
+    if (pending.data()) free((void*) pending.data());
+    pending = string_view();
+    pendingFrame = 0;
 
     dual->engine = nullptr;
     dual->spectate = nullptr;
@@ -159,37 +176,106 @@ void Player::syncInput() {
 
 inline uint8_t getFlags(Control*& c) { return c->alive | (c->lineLocked << 1); }
 
-void Player::onTick() {
-    if (engine->dualEnabled) {
-        if (!wasAlive && isAlive()) {
-            actualSpawnTick = engine->now();
-        }
-    } else {
-        if (wasAlive && !isAlive()) {
-            control->lastSpawnReq = engine->now();
+constexpr cell_cord_prec SKIP_PELLET_VIEW = 25000.;
+
+// Level of detail, radii relative to the short side of the viewport. The
+// client doesn't draw cells under 0.0003 of its view, so cells under a
+// quarter of that (room for zooming in) aren't sent at all, and small ones
+// only get an update every LOD_INTERVAL ticks, the client keeps them moving
+// with their last delta in between.
+constexpr cell_cord_prec LOD_OMIT = 0.0003 / 4;
+constexpr cell_cord_prec LOD_SLOW = 0.002;
+constexpr uint32_t LOD_INTERVAL = 4;
+// New cells per frame, the rest shows up over the next ticks
+constexpr uint32_t LOD_NEW_PELLETS = 4096;
+constexpr uint32_t LOD_NEW_EJECTS = 2048;
+
+// Protocol v2, a bit stream (see bits.hpp). Cached cells go in cache
+// order, each one is an op:
+//   0 REMOVE
+//   1 UPDATE, 3 bit mask of x/y/r then gamma(zigzag) of each residual
+//   2 EAT, index of the eater in the cache (pre compaction)
+//   3 KEEP, gamma of the run length of cells with nothing to send
+// Residuals are against the last delta of the cell (it keeps moving the
+// same way), so pellets and anything gliding cost nothing but a run.
+constexpr uint32_t OP_REMOVE = 0;
+constexpr uint32_t OP_UPDATE = 1;
+constexpr uint32_t OP_EAT = 2;
+constexpr uint32_t OP_KEEP = 3;
+
+// Everything up to the cell section
+static void writeHeader(Writer& w, bool spectating, Control* c1, Control* c2,
+                        Rect& map) {
+    w.write<uint8_t>(PROTOCOL_VERSION);
+    w.write<uint8_t>(spectating ? 1 : 0);
+    w.write<uint8_t>(getFlags(c1));
+    w.write<uint8_t>(getFlags(c2));
+    w.write<uint16_t>(c1->id);
+    w.write<uint16_t>(c2->id);
+    w.write<uint16_t>(c1->cells.size());
+    w.write<uint16_t>(c2->cells.size());
+    w.write<float>(c1->score);
+    w.write<float>(c2->score);
+    w.write<float>(c1->viewport.x);
+    w.write<float>(c1->viewport.y);
+    w.write<float>(c2->viewport.x);
+    w.write<float>(c2->viewport.y);
+    w.write<float>(map.hw);
+    w.write<float>(map.hh);
+}
+
+// New cells are in query order, so mostly next to each other: type is a bit
+// if it's the same as the last one, x/y/r are deltas from it
+static void writeNewCells(BitWriter& bits, vector<CellCache>& items) {
+    CellCache prev;
+    for (auto& item : items) {
+        if (item.type == prev.type) {
+            bits.put(1, 1);
+        } else {
+            bits.put(0, 1);
+            bits.put(item.type, 16);
         }
+        bits.gamma(BitWriter::zigzag(int32_t(item.x) - prev.x) + 1);
+        bits.gamma(BitWriter::zigzag(int32_t(item.y) - prev.y) + 1);
+        bits.gamma(BitWriter::zigzag(int32_t(item.r) - prev.r) + 1);
+        prev = item;
     }
+}
 
-    wasAlive = isAlive();
-    if (dual) dual->wasAlive = wasAlive;
-
-    // Viewport calculation
-    vector<AABB> viewports;
-    viewports.reserve(2);
-
-    Control* c1 = control;
-    Control* c2 = dual ? dual->control : nullptr;
-
-    cell_cord_prec factor = 1.f;
+// Worst case frame size: 14 bytes per cached cell, 16 per new one
+static inline size_t frameBound(size_t cached, size_t added) {
+    return 64 + cached * 14 + added * 16;
+}
 
-    if (spectate) {
-        c1 = spectate->control;
-        if (spectate->dual) c2 = spectate->dual->control;
+// Straight into the renderer's shared ring if there is one and the frame
+// fits, otherwise into the thread's arena
+static inline Writer frameWriter(FrameRing* ring, size_t bound, char*& slot) {
+    slot = ring ? ring->acquire(bound) : nullptr;
+    return slot ? Writer(slot) : Writer();
+}
 
-        factor = 1.5f;
+// Either publishes the frame in the ring (seq) or copies it out
+static inline string_view finishFrame(Writer& w, FrameRing* ring, char* slot,
+                                      uint32_t& seq) {
+    if (slot) {
+        seq = ring->publish(w.size());
+        return string_view();
     }
+    return w.finalize();
+}
 
-    if (!c2) c2 = c1;
+// Queries the viewports and writes a frame that brings the client from the
+// cells in view.cache to what's visible now
+static string_view buildView(GameHandle* h, View& view, Control* c1,
+                             Control* c2, cell_cord_prec factor,
+                             FrameRing* ring, uint32_t& seq) {
+    auto engine = h->engine;
+    auto& cache = view.cache;
+    auto& pelletView = view.pelletView;
+
+    // Viewport calculation
+    vector<AABB> viewports;
+    viewports.reserve(2);
 
     auto map = engine->getMap();
     AABB boxM = map.toAABB();
@@ -199,7 +285,7 @@ void Player::onTick() {
     bool a1 = c1->alive, a2 = c2->alive;
 
     if (!a1 && !a2) {
-        viewports.push_back(control->viewport.toAABB());
+        viewports.push_back(h->control->viewport.toAABB());
     }
     if (a1 && !a2) {
         viewports.push_back(box1);
@@ -218,109 +304,149 @@ void Player::onTick() {
         }
     }
 
-    // Crazy delta compression protocol I wrote
-    LAST_VISIBLE.reset();
-    CURR_VISIBLE.reset();
-
-    for (auto& item : cache) LAST_VISIBLE[item.id] = true;
+    if (!SCRATCH) SCRATCH.reset(new ViewScratch());
+    auto& lastVisible = SCRATCH->lastVisible;
+    auto& currVisible = SCRATCH->currVisible;
+    auto& currIds = SCRATCH->currIds;
+    auto& idLookup = SCRATCH->idLookup;
+    auto& newCells = SCRATCH->newCells;
 
-    constexpr cell_cord_prec SKIP_PELLET_VIEW = 25000.;
+    // Crazy delta compression protocol I wrote
+    for (auto& item : cache) lastVisible[item.id] = true;
+
+    cell_cord_prec size = std::numeric_limits<cell_cord_prec>::max();
+    for (auto& aabb : viewports)
+        size = std::min(size, std::min(aabb.r - aabb.l, aabb.t - aabb.b));
+    const cell_cord_prec omitR = size * LOD_OMIT;
+    const cell_cord_prec slowR = size * LOD_SLOW;
+    const uint32_t tick = view.ticks++;
+
+    // Pellets don't move: with the same single viewport as last tick only
+    // the buckets that entered it or had pellets added/removed are queried,
+    // cached pellets are visible as long as their buckets are in view.
+    // Pellets left out last tick (too small or over budget) need a full
+    // query once they can be sent.
+    vector<GridRange> lastPelletView;
+    lastPelletView.swap(pelletView);
+    GridRange none = {0, -1, 0, -1};
+    const bool incremental = viewports.size() == 1 &&
+                             lastPelletView.size() == 1 &&
+                             omitR >= view.omitR;
+    view.omitR = omitR;
+
+    uint32_t newPellets = 0, newEjects = 0;
+    bool pelletsCut = false;
+
+    auto addNew = [&](cell_id_t id, Cell* c) {
+        if (c->type == PELLET_TYPE) {
+            if (newPellets == LOD_NEW_PELLETS) {
+                pelletsCut = true;
+                return false;
+            }
+            newPellets++;
+        } else if (c->type & EJECT_BIT) {
+            if (newEjects == LOD_NEW_EJECTS) return false;
+            newEjects++;
+        }
+        newCells.push_back(CellCache(id, c));
+        return true;
+    };
 
     for (auto& aabb : viewports) {
         bool skipPellet =
             aabb.getArea() > (SKIP_PELLET_VIEW * SKIP_PELLET_VIEW);
 
         engine->queryGridEV(aabb, [&](Cell* c) {
-            if (!c || !c->age) return;
+            if (!c || !c->age || c->r < omitR) return;
             cell_id_t id = engine->cell_id(c);
-            if (CURR_VISIBLE[id]) return;  // Bit already set
-            CURR_VISIBLE[id] = true;
-            if (LAST_VISIBLE[id]) return;  // Not seen already
-            NEW_CELL_CACHE.push_back(CellCache(id, c));
+            if (currVisible[id]) return;  // Bit already set
+            if (!lastVisible[id] && !addNew(id, c)) return;
+            currVisible[id] = true;
+            currIds.push_back(id);
         });
 
         if (!skipPellet) {
-            engine->queryGridPL(aabb, [&](Cell* c) {
-                if (!c) return;
-                cell_id_t id = engine->cell_id(c);
-                if (CURR_VISIBLE[id]) return;  // Bit already set
-                CURR_VISIBLE[id] = true;
-                if (LAST_VISIBLE[id]) return;  // Not seen already
-                NEW_CELL_CACHE.push_back(CellCache(id, c));
-            });
+            auto range = engine->queryGridPLChanged(
+                aabb, incremental ? lastPelletView[0] : none, view.pelletSince,
+                [&](Cell* c) {
+                    if (!c) return;
+                    cell_id_t id = engine->cell_id(c);
+                    if (currVisible[id]) return;  // Bit already set
+                    if (!lastVisible[id] && !addNew(id, c)) return;
+                    currVisible[id] = true;
+                    currIds.push_back(id);
+                });
+            pelletView.push_back(range);
         }
 
-        if (canEatPerk()) {
+        if (h->canEatPerk()) {
             engine->queryTree(aabb, [&](auto c) {
+                if (c->r < omitR) return;
                 cell_id_t id = engine->cell_id(c);
-                if (CURR_VISIBLE[id]) return;  // Bit already set
-                CURR_VISIBLE[id] = true;
-                if (LAST_VISIBLE[id]) return;  // Not seen already
-                NEW_CELL_CACHE.push_back(CellCache(id, c));
+                if (currVisible[id]) return;  // Bit already set
+                if (!lastVisible[id] && !addNew(id, c)) return;
+                currVisible[id] = true;
+                currIds.push_back(id);
             });
         } else {
             engine->queryTree(aabb, [&](auto c) {
+                if (c->r < omitR) return;
                 cell_id_t id = engine->cell_id(c);
-                if (CURR_VISIBLE[id]) return;  // Bit already set
+                if (currVisible[id]) return;  // Bit already set
                 if ((c->type == EXP_TYPE || c->type == CYT_TYPE)) return;
-                CURR_VISIBLE[id] = true;
-                if (LAST_VISIBLE[id]) return;  // Not seen already
-                NEW_CELL_CACHE.push_back(CellCache(id, c));
+                if (!lastVisible[id] && !addNew(id, c)) return;
+                currVisible[id] = true;
+                currIds.push_back(id);
             });
         }
     }
 
-    auto cells = engine->pool;
+    view.pelletSince = engine->markGridPL();
 
-    Writer w;
-    w.write<uint8_t>(spectate ? 1 : 0);
-    w.write<uint8_t>(getFlags(c1));
-    w.write<uint8_t>(getFlags(c2));
-    w.write<uint16_t>(c1->id);
-    w.write<uint16_t>(c2->id);
-    w.write<uint16_t>(c1->cells.size());
-    w.write<uint16_t>(c2->cells.size());
-    w.write<float>(c1->score);
-    w.write<float>(c2->score);
-    w.write<float>(c1->viewport.x);
-    w.write<float>(c1->viewport.y);
-    w.write<float>(c2->viewport.x);
-    w.write<float>(c2->viewport.y);
-    w.write<float>(map.hw);
-    w.write<float>(map.hh);
-
-    constexpr uint8_t UPD = 0x01 << 6;
-    constexpr uint8_t EAT = 0x02 << 6;
-    constexpr uint8_t ADD = 0x03 << 6;
-
-    constexpr uint8_t DX_P = 0x01 << 4;
-    constexpr uint8_t DX_N = 0x02 << 4;
-    constexpr uint8_t XXXX = 0x03 << 4;
+    auto pelletInView = [&](Cell& cell) {
+        if (cell.r < omitR) return false;
+        auto& rg = cell.shared.range;
+        for (auto& v : pelletView) {
+            if (rg.l <= v.r && rg.r >= v.l && rg.t <= v.b && rg.b >= v.t)
+                return true;
+        }
+        return false;
+    };
 
-    constexpr uint8_t DY_P = 0x01 << 2;
-    constexpr uint8_t DY_N = 0x02 << 2;
-    constexpr uint8_t YYYY = 0x03 << 2;
+    auto cells = engine->pool;
 
-    constexpr uint8_t DR_P = 0x01;
-    constexpr uint8_t DR_N = 0x02;
-    constexpr uint8_t RRRR = 0x03;
+    char* slot;
+    Writer w = frameWriter(
+        ring, frameBound(cache.size(), newCells.size()), slot);
+    writeHeader(w, h->spectate, c1, c2, map);
 
     constexpr cell_cord_prec int16range = (1 << 15) - 1;
     constexpr cell_cord_prec uint16range = (1 << 16) - 1;
 
-    memset(ID_LOOKUP, 0, sizeof(ID_LOOKUP));
-
     auto cache_size = cache.size();
-    for (uint32_t i = 0; i < cache_size; i++) ID_LOOKUP[cache[i].id] = i;
+    for (uint32_t i = 0; i < cache_size; i++) idLookup[cache[i].id] = i;
 
     w.write<uint32_t>(cache_size);
+    w.write<uint32_t>(newCells.size());
+
+    const uint32_t indexBits = std::bit_width(cache_size);
+
+    BitWriter bits(w);
+    uint32_t run = 0;
+
+    auto flushRun = [&]() {
+        if (!run) return;
+        bits.put(OP_KEEP, 2);
+        bits.gamma(run);
+        run = 0;
+    };
 
     uint32_t w_id = 0;
     // Write
     for (uint32_t i = 0; i < cache_size; i++) {
         auto& item = cache[i];
         auto out = &cache[i];
-        uint8_t& flags = w.ref<uint8_t>(0);
+        auto& cell = cells[out->id];
 
         // Move the item
         if (w_id < i) {
@@ -328,97 +454,130 @@ void Player::onTick() {
             out = &cache[w_id];
         }
 
-        // Cell is eaten
-        if (cells[out->id].flag & REMOVE_BIT && cells[out->id].eatenByID &&
-            ID_LOOKUP[out->id]) {
-            flags |= EAT;
-            w.write<uint16_t>(ID_LOOKUP[out->id]);
-        } else if (cells[out->id].flag & EXIST_BIT &&
-                   cells[out->id].type == out->type && CURR_VISIBLE[out->id]) {
+        if (cell.flag & REMOVE_BIT && cell.eatenByID &&
+            lastVisible[cell.eatenByID]) {
+            // Cell is eaten by a cell the client has
+            flushRun();
+            bits.put(OP_EAT, 2);
+            bits.put(idLookup[cell.eatenByID], indexBits);
+            lastVisible[out->id] = false;
+        } else if (cell.flag & EXIST_BIT && cell.type == out->type &&
+                   (currVisible[out->id] ||
+                    (out->type == PELLET_TYPE && pelletInView(cell)))) {
             w_id++;
-            flags |= UPD;
-
-            // Delta compression
-            const int16_t cx =
-                std::clamp(cells[out->id].x * cell_cord_prec(0.5), -int16range,
-                           int16range);
-            const int16_t cy =
-                std::clamp(cells[out->id].y * cell_cord_prec(0.5), -int16range,
-                           int16range);
-            const uint16_t cr =
-                std::clamp(cells[out->id].r * cell_cord_prec(0.5),
-                           cell_cord_prec(0), uint16range);
-
-            int16_t dx = cx - out->x;
-            out->x = cx;
-            if (!dx) {
-                // Does nothing
-            } else if (dx <= 255 && dx >= -255) {
-                if (dx > 0) {
-                    flags |= DX_P;
-                    w.write<uint8_t>(dx);
-                } else {
-                    flags |= DX_N;
-                    w.write<uint8_t>(-dx);
-                }
-            } else {
-                flags |= XXXX;
-                w.write<int16_t>(out->x);
-            }
 
-            int16_t dy = cy - out->y;
-            out->y = cy;
-            if (!dy) {
-                // Does nothing
-            } else if (dy <= 255 && dy >= -255) {
-                if (dy > 0) {
-                    flags |= DY_P;
-                    w.write<uint8_t>(dy);
-                } else {
-                    flags |= DY_N;
-                    w.write<uint8_t>(-dy);
-                }
-            } else {
-                flags |= YYYY;
-                w.write<int16_t>(out->y);
+            const int16_t cx = std::clamp(cell.x * cell_cord_prec(0.5),
+                                          -int16range, int16range);
+            const int16_t cy = std::clamp(cell.y * cell_cord_prec(0.5),
+                                          -int16range, int16range);
+            const uint16_t cr = std::clamp(cell.r * cell_cord_prec(0.5),
+                                           cell_cord_prec(0), uint16range);
+
+            const int32_t dx = int32_t(cx) - out->x;
+            const int32_t dy = int32_t(cy) - out->y;
+            const int32_t dr = int32_t(cr) - out->r;
+            const int32_t ex = dx - out->dx;
+            const int32_t ey = dy - out->dy;
+            const int32_t er = dr - out->dr;
+
+            // Small cells skip most updates, the client predicts them
+            // meanwhile and the cache follows the prediction
+            const int32_t px = int32_t(out->x) + out->dx;
+            const int32_t py = int32_t(out->y) + out->dy;
+            const int32_t pr = int32_t(out->r) + out->dr;
+            if (cell.r < slowR && (out->id + tick) % LOD_INTERVAL &&
+                std::abs(px) <= int16range && std::abs(py) <= int16range &&
+                pr >= 0 && pr <= uint16range) {
+                out->x = px;
+                out->y = py;
+                out->r = pr;
+                run++;
+                continue;
             }
 
-            int16_t dr = cr - out->r;
+            out->x = cx;
+            out->y = cy;
             out->r = cr;
-            if (!dr) {
-                // Does nothing
-            } else if (dr <= 255 && dr >= -255) {
-                if (dr > 0) {
-                    flags |= DR_P;
-                    w.write<uint8_t>(dr);
-                } else {
-                    flags |= DR_N;
-                    w.write<uint8_t>(-dr);
-                }
+            out->dx = dx;
+            out->dy = dy;
+            out->dr = dr;
+
+            if (!ex && !ey && !er) {
+                run++;
             } else {
-                flags |= RRRR;
-                w.write<uint16_t>(out->r);
+                flushRun();
+                bits.put(OP_UPDATE, 2);
+                bits.put((ex ? 4 : 0) | (ey ? 2 : 0) | (er ? 1 : 0), 3);
+                if (ex) bits.gamma(BitWriter::zigzag(ex));
+                if (ey) bits.gamma(BitWriter::zigzag(ey));
+                if (er) bits.gamma(BitWriter::zigzag(er));
             }
         } else {
-            // Remove but nothing is written
+            flushRun();
+            bits.put(OP_REMOVE, 2);
+            lastVisible[out->id] = false;
         }
     }
+    flushRun();
+
+    writeNewCells(bits, newCells);
+    bits.end();
+
+    for (uint32_t i = 0; i < w_id; i++) lastVisible[cache[i].id] = false;
+    cache.resize(w_id);
+    cache.reserve(cache.size() + newCells.size());
+    cache.insert(cache.end(), newCells.begin(), newCells.end());
+    newCells.clear();
 
-    auto new_cache_size = NEW_CELL_CACHE.size();
-    w.write<uint32_t>(new_cache_size);
+    for (auto id : currIds) currVisible[id] = false;
+    currIds.clear();
 
-    for (uint32_t i = 0; i < new_cache_size; i++) {
-        auto& item = NEW_CELL_CACHE[i];
-        w.write<uint16_t>(item.type);
-        w.write<int16_t>(item.x);
-        w.write<int16_t>(item.y);
-        w.write<uint16_t>(item.r);
+    if (pelletsCut) pelletView.clear();
+
+    return finishFrame(w, ring, slot, seq);
+}
+
+void Player::onTick() {
+    if (engine->dualEnabled) {
+        if (!wasAlive && isAlive()) {
+            actualSpawnTick = engine->now();
+        }
+    } else {
+        if (wasAlive && !isAlive()) {
+            control->lastSpawnReq = engine->now();
+        }
     }
 
-    cache.resize(w_id);
-    cache.reserve(cache.size() + NEW_CELL_CACHE.size());
-    cache.insert(cache.end(), NEW_CELL_CACHE.begin(), NEW_CELL_CACHE.end());
-    NEW_CELL_CACHE.clear();
+    wasAlive = isAlive();
+    if (dual) dual->wasAlive = wasAlive;
+
+    Control* c1 = control;
+    Control* c2 = dual ? dual->control : nullptr;
+
+    cell_cord_prec factor = 1.f;
+
+    if (spectate) {
+        c1 = spectate->control;
+        if (spectate->dual) c2 = spectate->dual->control;
 
-    send(w.finalize());
+        factor = 1.5f;
+    }
+
+    if (!c2) c2 = c1;
+
+    // Sent from flush, on the engine thread
+    if (pending.data()) free((void*) pending.data());
+    pendingFrame = 0;
+    pending = buildView(this, view, c1, c2, factor, &server->frames,
+                        pendingFrame);
+}
+
+void Player::flush() {
+    if (pendingFrame) {
+        sendFrame(pendingFrame);
+        pendingFrame = 0;
+    }
+    if (!pending.data()) return;
+    send(pending);
+    pending = string_view();
 }
\ No newline at end of file
@@ -16,6 +16,18 @@ struct Input {
     int32_t mouseY = 0;
 };
 
+// Cells a client holds, frames bring it from these to what's in view
+struct View {
+    vector<CellCache> cache;
+    // Pellet grid ranges in view last tick and the grid mark taken after
+    // querying them, only buckets that changed since get queried again
+    vector<GridRange> pelletView;
+    uint32_t pelletSince = 0;
+    // Radius under which cells were left out last tick, and frames built
+    cell_cord_prec omitR = 0;
+    uint32_t ticks = 0;
+};
+
 struct Player : GameHandle {
     
     Input inputs[2];
@@ -23,7 +35,12 @@ struct Player : GameHandle {
 
     uint8_t activeTab;
 
-    vector<CellCache> cache;
+    View view;
+
+    // Built by onTick, sent by flush. pendingFrame is the seq of the frame
+    // in the shared ring instead, when it's set up
+    string_view pending;
+    uint32_t pendingFrame = 0;
 
     Player(Server* server);
 
@@ -61,6 +78,8 @@ struct Player : GameHandle {
     void syncInput() override;
     
     void onTick() override;
+    void flush() override;
 
     void send(string_view buffer);
+    void sendFrame(uint32_t seq);
 };
\ No newline at end of file
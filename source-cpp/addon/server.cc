@@ -3,6 +3,7 @@
 #include "../game/handle.hpp"
 #include "../misc/pool.hpp"
 #include "player.hpp"
+#include "state.hpp"
 // Headers
 #include "../extensions/rockslide/rock-engine.hpp"
 #include "../physics/engine.hpp"
@@ -62,6 +63,7 @@ void internal_tick(uv_timer_t* t) {
         constexpr float t = 1.f / (MS_TO_NANO_F * tick_time);
         engine->usage = busyTimeNano * t;
         engine->__ltick = engine->__now;
+        if (server->checkpoint) Checkpoint::tick(server, engine->__now);
     }
 
     auto totalTimeNano = hrtime() - start;
@@ -97,6 +99,20 @@ void Player::send(string_view buffer) {
     }
 }
 
+// Frame is already in the shared ring, only its seq goes to JS
+void Player::sendFrame(uint32_t seq) {
+    auto iso = server->isolate;
+    HandleScope hs(iso);
+
+    if (server->jsCellBufferCallback != Undefined(iso)) {
+        auto func = Local<Function>::New(iso, server->jsCellBufferCallback);
+        Local<Value> argv[1] = {Number::New(iso, seq)};
+
+        node::MakeCallback(iso, iso->GetCurrentContext()->Global(), func, 1,
+                           argv);
+    }
+}
+
 void Engine::infoEvent(GameHandle* handle, EventType event) {
     if (!handle || !handle->control) return;
 
@@ -152,6 +168,9 @@ CYTOS_IMPL(setThreads) {
     auto iso = args.GetIsolate();
 
     int32_t threads = 1;
+    Placement placement = server->threadPool
+                              ? server->threadPool->getPlacement()
+                              : Placement::CORES;
 
     if (args.Length() > 0) {
         threads = args[0]
@@ -161,15 +180,22 @@ CYTOS_IMPL(setThreads) {
         printf("threads = %i\n", threads);
     }
 
+    if (args.Length() > 1 && args[1]->IsString()) {
+        String::Utf8Value v8Str(iso, args[1]);
+        placement = parsePlacement(*v8Str);
+    }
+
     if (threads <= 0) threads = 1;
     if (threads > std::thread::hardware_concurrency())
         threads = std::thread::hardware_concurrency();
 
     if (server->threadPool) {
-        if (server->threadPool->size() == threads) return;
+        if (server->threadPool->size() == threads &&
+            server->threadPool->getPlacement() == placement)
+            return;
         delete server->threadPool;
     }
-    server->threadPool = new ThreadPool(threads);
+    server->threadPool = new ThreadPool(threads, placement);
 }
 
 CYTOS_IMPL(setGameMode) {
@@ -243,6 +269,32 @@ CYTOS_IMPL(setInfoCallback) {
     }
 }
 
+CYTOS_IMPL(setFrameRing) {
+    auto iso = args.GetIsolate();
+    auto server =
+        static_cast<Server*>(Local<External>::Cast(args.Data())->Value());
+
+    // Frames in flight point into the old ring
+    if (server->player) server->player->pendingFrame = 0;
+
+    if (args.Length() < 1 || !args[0]->IsSharedArrayBuffer()) {
+        server->frames = FrameRing();
+        server->frameStore.reset();
+        return;
+    }
+
+    auto sab = Local<SharedArrayBuffer>::Cast(args[0]);
+    uint32_t slots = 2;
+    if (args.Length() > 1 && args[1]->IsNumber())
+        slots = std::clamp(args[1]->Uint32Value(iso->GetCurrentContext()).FromMaybe(2u), 2u, 16u);
+
+    server->frameStore = sab->GetBackingStore();
+    server->frames = FrameRing(server->frameStore->Data(),
+                               server->frameStore->ByteLength(), slots, true);
+
+    args.GetReturnValue().Set(Boolean::New(iso, server->frames.valid()));
+}
+
 CYTOS_IMPL(getTimings) {
     auto iso = args.GetIsolate();
     auto server =
@@ -273,6 +325,8 @@ CYTOS_IMPL(getTimings) {
     set(obj, lit("resolve_physics"), num(t.resolve_physics));
 
     set(obj, lit("threads"), num(server->threadPool->size()));
+    set(obj, lit("placement"),
+        str(placementName(server->threadPool->getPlacement())));
     set(obj, lit("usage"), num(e->usage.load()));
 
     uint32_t counters[QUERY_LEVEL];
@@ -449,6 +503,8 @@ Server* CytosAddon::Main(Local<Object> exports) {
     exportFunc(iso, exports, serverCtx, "onBuffer",
                CytosAddon::setBufferCallback);
     exportFunc(iso, exports, serverCtx, "onInfo", CytosAddon::setInfoCallback);
+    exportFunc(iso, exports, serverCtx, "setFrameRing",
+               CytosAddon::setFrameRing);
 
     exportFunc(iso, exports, serverCtx, "getTimings", CytosAddon::getTimings);
     exportFunc(iso, exports, serverCtx, "getVersion", CytosAddon::getVersion);
@@ -457,6 +513,7 @@ Server* CytosAddon::Main(Local<Object> exports) {
 
     exportFunc(iso, exports, serverCtx, "save", CytosAddon::save);
     exportFunc(iso, exports, serverCtx, "restore", CytosAddon::restore);
+    exportFunc(iso, exports, serverCtx, "checkpoint", CytosAddon::checkpoint);
     exportFunc(iso, exports, serverCtx, "restart", CytosAddon::restart);
 
     return server;
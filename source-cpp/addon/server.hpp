@@ -6,10 +6,15 @@
 
 #include <iostream>
 #include <chrono>
+#include <memory>
+
+#include "../misc/ring.hpp"
 
 using namespace v8;
 using namespace std::chrono;
 
+struct Checkpoint;
+
 // Define Server before including engine templates
 struct Server {
     uv_timer_t tick_timer;
@@ -23,6 +28,13 @@ struct Server {
 
     UniquePersistent<Function> jsCellBufferCallback;
     UniquePersistent<Function> jsInfoCallback;
+
+    // Shared with the renderer, frames of player go here when it's set
+    std::shared_ptr<BackingStore> frameStore;
+    FrameRing frames;
+
+    // Background snapshots, see CytosAddon::checkpoint
+    Checkpoint* checkpoint = nullptr;
 };
 
 #define DECL_V8_EXPORT(func) void func(const FunctionCallbackInfo<Value>& args)
@@ -36,11 +48,13 @@ namespace CytosAddon {
     DECL_V8_EXPORT(setGameMode);
     DECL_V8_EXPORT(setBufferCallback);
     DECL_V8_EXPORT(setInfoCallback);
+    DECL_V8_EXPORT(setFrameRing);
     DECL_V8_EXPORT(getTimings);
     
     DECL_V8_EXPORT(restart);
     DECL_V8_EXPORT(restore);
     DECL_V8_EXPORT(save);
+    DECL_V8_EXPORT(checkpoint);
 
     // Export API
     Server* Main(Local<Object> exports);
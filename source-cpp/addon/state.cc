@@ -1,8 +1,12 @@
 #include <node_buffer.h>
+#include <filesystem>
 #include "server.hpp"
 
+#include "../misc/pool.hpp"
 #include "../misc/reader.hpp"
 #include "../misc/writer.hpp"
+#include "../misc/snapshot.hpp"
+#include "state.hpp"
 
 #include "../game/control.hpp"
 #include "../game/handle.hpp"
@@ -11,6 +15,257 @@
 
 #include "../physics/engine.hpp"
 
+constexpr cell_cord_prec POS_SCALE = 16;
+constexpr cell_cord_prec RADIUS_SCALE = 256;
+
+constexpr uint32_t CELL_HAS_BOOST = 0x1;
+constexpr uint32_t CELL_HAS_AGE = 0x2;
+
+static inline Section sectionOf(uint16_t type) {
+    if (type == PELLET_TYPE) return SECTION_PELLETS;
+    if (type == VIRUS_TYPE) return SECTION_VIRUSES;
+    if (type & EJECT_BIT) return SECTION_EJECTS;
+    // Dead cells, cytoplasm, exp and rocks
+    if (type >= ROCK_TYPE) return SECTION_OTHERS;
+    return SECTION_PLAYERS;
+}
+
+// Pellets and viruses don't need their type written
+static inline bool typed(Section section) {
+    return section != SECTION_PELLETS && section != SECTION_VIRUSES;
+}
+
+// [id - expected] [flag << 2 | bits] [type] [x] [y] [r] [data] [age] [boost]
+static void writeCell(snapshot::Out& out, Section section, uint32_t expected,
+                      const FrozenCell& cell) {
+    uint32_t bits = 0;
+    if (cell.boost[2]) bits |= CELL_HAS_BOOST;
+    if (cell.age) bits |= CELL_HAS_AGE;
+
+    out.varint(cell.id - expected);
+    out.varint((uint32_t(cell.flag) << 2) | bits);
+    if (typed(section)) out.varint(cell.type);
+    out.varint(snapshot::zigzag(int32_t(llround(cell.x * POS_SCALE))));
+    out.varint(snapshot::zigzag(int32_t(llround(cell.y * POS_SCALE))));
+    out.varint(uint64_t(llround(cell.r * RADIUS_SCALE)));
+    out.varint(snapshot::zigzag(cell.data));
+    if (bits & CELL_HAS_AGE) out.write<float>(cell.age);
+    if (bits & CELL_HAS_BOOST) out.write(cell.boost, sizeof(cell.boost));
+    out.room();
+}
+
+static bool readCell(snapshot::In& in, Section section, uint32_t& expected, uint32_t limit,
+                     Cell* pool, Boost* boosts) {
+    const uint64_t id = expected + in.varint();
+    const uint32_t bits = in.varint();
+    const uint16_t type = typed(section) ? in.varint()
+                                         : section == SECTION_PELLETS ? PELLET_TYPE : VIRUS_TYPE;
+
+    if (id >= limit || !type || sectionOf(type) != section) return false;
+
+    auto& cell = pool[id];
+    cell.flag = uint16_t(bits >> 2);
+    cell.type = type;
+    cell.x = snapshot::unzigzag(in.varint()) / POS_SCALE;
+    cell.y = snapshot::unzigzag(in.varint()) / POS_SCALE;
+    cell.r = in.varint() / RADIUS_SCALE;
+    cell.data = snapshot::unzigzag(in.varint());
+    if (bits & CELL_HAS_AGE) cell.age = in.read<float>();
+    if (bits & CELL_HAS_BOOST) {
+        auto& boost = boosts[id];
+        boost.x = in.read<float>();
+        boost.y = in.read<float>();
+        boost.d = in.read<float>();
+    }
+
+    expected = id + 1;
+    return true;
+}
+
+bool Capture::take(Server* server) {
+    auto engine = server->engine;
+    if (!engine) return false;
+
+    mode = engine->mode();
+    limit = engine->poolSize() / sizeof(Cell);
+    ext = engine->getExtState();
+
+    bots.clear();
+    for (auto bot : engine->bots) bots.push_back(bot->control->id);
+
+    // Only reads the pool, cells waiting in removedCells already have
+    // REMOVE_BIT so removeCells doesn't have to run first
+    // Nothing lives above the allocator's high water mark
+    const uint32_t used = std::min<uint32_t>(limit, engine->allocator.highWater());
+    const uint32_t count = (used + CHUNK - 1) / CHUNK;
+    chunks.resize(count * SECTION_EXT);
+
+    server->threadPool->parallel_for(count, [&](size_t c) {
+        auto sections = &chunks[c * SECTION_EXT];
+        for (uint32_t s = 0; s < SECTION_EXT; s++) sections[s].clear();
+
+        const uint32_t end = std::min<uint32_t>(used, (c + 1) * CHUNK);
+        for (uint32_t id = c * CHUNK; id < end; id++) {
+            auto& cell = engine->pool[id];
+            const uint16_t flag = cell.flag.load(std::memory_order_relaxed);
+            if (!(flag & EXIST_BIT) || flag & REMOVE_BIT || !cell.type) continue;
+
+            auto& boost = engine->boosts[id];
+            sections[sectionOf(cell.type)].push_back({
+                .id = id,
+                .flag = flag,
+                .type = cell.type,
+                .age = cell.age,
+                .data = cell.data,
+                .x = cell.x,
+                .y = cell.y,
+                .r = cell.r,
+                .boost = {float(boost.x), float(boost.y), float(boost.d)},
+            });
+        }
+    });
+
+    return true;
+}
+
+void Capture::write(snapshot::Out& out) {
+    out.bytes(mode);
+    out.varint(limit);
+
+    out.write<uint8_t>(SECTION_BOTS);
+    out.varint(bots.size());
+    for (auto id : bots) {
+        out.write<uint16_t>(id);
+        out.room();
+    }
+
+    const size_t count = chunks.size() / SECTION_EXT;
+    for (uint8_t s = SECTION_PELLETS; s < SECTION_EXT; s++) {
+        auto section = Section(s);
+
+        size_t cells = 0;
+        for (size_t c = 0; c < count; c++) cells += chunks[c * SECTION_EXT + s].size();
+        if (!cells) continue;
+
+        out.write<uint8_t>(section);
+        out.varint(cells);
+        uint32_t expected = 0;
+        for (size_t c = 0; c < count; c++) {
+            for (auto& cell : chunks[c * SECTION_EXT + s]) {
+                writeCell(out, section, expected, cell);
+                expected = cell.id + 1;
+            }
+        }
+    }
+
+    // Ext buffer
+    if (ext.size()) {
+        out.write<uint8_t>(SECTION_EXT);
+        out.bytes(ext);
+    }
+
+    out.write<uint8_t>(SECTION_END);
+    out.end();
+}
+
+bool Checkpoint::start() {
+    if (busy) return false;
+
+    const auto t0 = hrtime();
+    if (!capture.take(server)) return false;
+    captureTime = (hrtime() - t0) / MS_TO_NANO_F;
+
+    busy = true;
+    uv_queue_work(
+        server->tick_timer.loop, &work,
+        [](uv_work_t* req) {
+            auto self = static_cast<Checkpoint*>(req->data);
+            const auto t0 = hrtime();
+
+            int fd = -1;
+            const string temp = self->path + ".tmp";
+            if (self->path.size()) {
+                fd = snapshot::create(temp.c_str());
+                if (fd < 0) {
+                    self->failed = true;
+                    return;
+                }
+            }
+
+            snapshot::Out out(fd, self->compress);
+            self->capture.write(out);
+            self->bytes = out.written;
+            self->failed = out.failed;
+            self->memory.swap(out.memory);
+
+            if (fd >= 0) {
+                snapshot::close(fd);
+                std::error_code error;
+                if (!self->failed) std::filesystem::rename(temp, self->path, error);
+                if (self->failed || error) {
+                    std::filesystem::remove(temp, error);
+                    self->failed = true;
+                }
+            }
+
+            self->encodeTime = (hrtime() - t0) / MS_TO_NANO_F;
+        },
+        [](uv_work_t* req, int status) {
+            auto self = static_cast<Checkpoint*>(req->data);
+            auto iso = self->server->isolate;
+            self->busy = false;
+
+            HandleScope scope(iso);
+            auto ctx = iso->GetCurrentContext();
+
+            if (self->failed) logger::error("Checkpoint failed\n");
+            if (self->callback.IsEmpty()) return;
+
+#define lit(arg) String::NewFromUtf8Literal(iso, arg)
+#define str(arg) String::NewFromUtf8(iso, arg).ToLocalChecked()
+#define num(arg) Number::New(iso, arg)
+#define set(obj, i, v) obj->Set(ctx, i, v)
+            Local<Value> result = Null(iso);
+            if (!self->failed) {
+                auto obj = Object::New(iso);
+                set(obj, lit("mode"), str(self->capture.mode.c_str()));
+                set(obj, lit("bytes"), num(self->bytes));
+                set(obj, lit("capture"), num(self->captureTime));
+                set(obj, lit("encode"), num(self->encodeTime));
+                if (self->path.size()) {
+                    set(obj, lit("path"), str(self->path.c_str()));
+                } else {
+                    auto nbuf = node::Buffer::Copy(iso, self->memory.data(),
+                                                   self->memory.size())
+                                    .ToLocalChecked();
+                    set(obj, lit("buffer"), nbuf);
+                }
+                result = obj;
+            }
+#undef lit
+#undef str
+#undef num
+#undef set
+            self->memory = vector<char>();
+
+            auto func = Local<Function>::New(iso, self->callback);
+            Local<Value> argv[1] = {result};
+            node::MakeCallback(iso, ctx->Global(), func, 1, argv);
+        });
+
+    return true;
+}
+
+void Checkpoint::tick(Server* server, uint64_t now) {
+    auto self = server->checkpoint;
+    if (!self || !self->every) return;
+
+    if (!self->next) self->next = now + self->every;
+    // Late ones go on the next tick instead of piling up
+    if (now < self->next || !self->start()) return;
+    self->next = now + self->every;
+}
+
 CYTOS_IMPL(save) {
     auto server = static_cast<Server*>(Local<External>::Cast(args.Data())->Value());
     auto iso = args.GetIsolate();
@@ -23,33 +278,31 @@ CYTOS_IMPL(save) {
 
     if (!engine || !player) return;
 
-    Writer w;
+#define field(obj, str) \
+    (obj)->Get(ctx, String::NewFromUtf8Literal(iso, str)).ToLocalChecked()
 
-    // Serialize engine
-    engine->removeCells();
-    
-    // Write bot ID's
-    w.write<uint16_t>(engine->bots.size());
-    for (auto bot : engine->bots) {
-        w.write<uint16_t>(bot->control->id);
+    // { fd?: number, compress?: boolean }, without fd it comes back as a buffer
+    int fd = -1;
+    bool compress = true;
+    if (args.Length() > 0 && args[0]->IsObject()) {
+        auto options = args[0].As<Object>();
+        auto fdValue = field(options, "fd");
+        auto compressValue = field(options, "compress");
+        if (fdValue->IsNumber()) fd = fdValue->Int32Value(ctx).FromMaybe(-1);
+        if (!compressValue->IsUndefined()) compress = compressValue->BooleanValue(iso);
     }
+#undef field
 
-    // Write the entire buffer pool
-    auto pool_size = engine->poolSize();
-    w.write<size_t>(pool_size);
-    w.write(string_view((char*) engine->pool, pool_size), false);
+    Capture capture;
+    capture.take(server);
 
-    // Ext buffer
-    auto ext_buf = engine->getExtState();
-    w.write<size_t>(ext_buf.size());
-    w.write(ext_buf, false);
+    snapshot::Out out(fd, compress);
+    capture.write(out);
 
-    auto buffer = w.finalize();
-    
-    auto nbuf = node::Buffer::New(iso, (char*) buffer.data(), buffer.size(), [](auto data, auto) {
-        free(data);
-        // fprintf(stderr, "free buf ptr = %p\n", data);
-    }, nullptr).ToLocalChecked();
+    if (out.failed) {
+        logger::error("Failed to write snapshot to fd %i\n", fd);
+        return;
+    }
 
     auto result = Object::New(iso);
 
@@ -57,7 +310,12 @@ CYTOS_IMPL(save) {
 #define str(arg) String::NewFromUtf8(iso, arg).ToLocalChecked()
 #define set(obj, i, v) obj->Set(ctx, i, v)
     set(result, lit("mode"), str(engine->mode()));
-    set(result, lit("buffer"), nbuf);
+    set(result, lit("bytes"), Number::New(iso, out.written));
+    if (fd < 0) {
+        auto nbuf = node::Buffer::Copy(iso, out.memory.data(), out.memory.size())
+                        .ToLocalChecked();
+        set(result, lit("buffer"), nbuf);
+    }
 #undef lit
 #undef str
 #undef set
@@ -65,6 +323,100 @@ CYTOS_IMPL(save) {
     args.GetReturnValue().Set(result);
 }
 
+// checkpoint({ path?, compress?, every? }, callback): every (seconds) makes
+// it periodic, 0 stops that, without it a checkpoint starts right away.
+// Without path the callback gets the snapshot as a buffer.
+CYTOS_IMPL(checkpoint) {
+    auto server = static_cast<Server*>(Local<External>::Cast(args.Data())->Value());
+    auto iso = args.GetIsolate();
+
+    HandleScope scope(iso);
+    auto ctx = iso->GetCurrentContext();
+
+    if (!server->checkpoint) server->checkpoint = new Checkpoint(server);
+    auto self = server->checkpoint;
+
+    // Settings of the one in flight stay put until it's done
+    if (self->busy) {
+        args.GetReturnValue().Set(Boolean::New(iso, false));
+        return;
+    }
+
+#define field(obj, str) \
+    (obj)->Get(ctx, String::NewFromUtf8Literal(iso, str)).ToLocalChecked()
+
+    bool periodic = false;
+    self->path.clear();
+    self->compress = true;
+    self->every = 0;
+    self->next = 0;
+
+    if (args.Length() > 0 && args[0]->IsObject()) {
+        auto options = args[0].As<Object>();
+        auto pathValue = field(options, "path");
+        auto compressValue = field(options, "compress");
+        auto everyValue = field(options, "every");
+        if (pathValue->IsString()) self->path = *String::Utf8Value(iso, pathValue);
+        if (!compressValue->IsUndefined()) self->compress = compressValue->BooleanValue(iso);
+        if (everyValue->IsNumber()) {
+            periodic = true;
+            const double seconds = everyValue->NumberValue(ctx).FromMaybe(0);
+            self->every = seconds > 0 ? uint64_t(seconds * 1000 * MS_TO_NANO) : 0;
+        }
+    }
+#undef field
+
+    if (args.Length() > 1 && args[1]->IsFunction())
+        self->callback.Reset(iso, args[1].As<Function>());
+    else
+        self->callback.Reset();
+
+    args.GetReturnValue().Set(Boolean::New(iso, periodic || self->start()));
+}
+
+// Rebuilds the pool from a snapshot, the spatial structures come from
+// syncState after
+static bool restoreSnapshot(Engine* engine, snapshot::In& in, bool& error) {
+    const uint32_t limit = engine->poolSize() / sizeof(Cell);
+
+    vector<char> text;
+    in.bytes(text);
+    if (string_view(text.data(), text.size()) != engine->mode()) return false;
+
+    const uint64_t savedLimit = in.varint();
+    if (savedLimit != limit) logger::debug("Pool size changed (%u -> %u)\n", uint32_t(savedLimit), limit);
+
+    uint8_t seen = 0;
+    while (!error) {
+        auto section = Section(in.read<uint8_t>());
+        if (section == SECTION_END) break;
+        if (section > SECTION_EXT || seen >= section) return false;
+        seen = section;
+
+        if (section == SECTION_EXT) {
+            in.bytes(text);
+            if (!error) engine->setExtState(string_view(text.data(), text.size()));
+            continue;
+        }
+
+        const uint64_t count = in.varint();
+        if (count > limit) return false;
+
+        if (section == SECTION_BOTS) {
+            for (uint64_t j = 0; j < count && !error; j++)
+                engine->addBot(in.read<uint16_t>());
+            continue;
+        }
+
+        uint32_t expected = 0;
+        for (uint64_t j = 0; j < count && !error; j++)
+            if (!readCell(in, section, expected, limit, engine->pool, engine->boosts))
+                return false;
+    }
+
+    return in.end();
+}
+
 CYTOS_IMPL(restore) {
     auto server = static_cast<Server*>(Local<External>::Cast(args.Data())->Value());
     auto iso = args.GetIsolate();
@@ -82,51 +434,65 @@ CYTOS_IMPL(restore) {
 
     auto jsMode = String::Utf8Value(iso, args[0]);
     auto mode = string(*jsMode);
-    
+
     if (mode != engine->mode()) {
         logger::error("mode mismatch: requested \"%s\" != current \"%s\"\n", mode.c_str(), engine->mode());
         return;
     }
 
+    // restore(mode, buffer) or restore(mode, fd)
+    int fd = -1;
+    string_view data;
+    if (args[1]->IsNumber()) {
+        fd = args[1]->Int32Value(ctx).FromMaybe(-1);
+    } else if (args[1]->IsUint8Array()) {
+        // Just the bytes of the view, it can be part of a larger buffer
+        data = string_view(node::Buffer::Data(args[1]), node::Buffer::Length(args[1]));
+    } else {
+        logger::error("restore needs a buffer or a file descriptor\n");
+        return;
+    }
+
     // Dumb way to reset states
     player->setEngine(nullptr);
     engine->reset();
     player->setEngine(engine);
 
-    auto floatArr = args[1].As<Uint8Array>();
-    auto v8buf = floatArr->Buffer();
-    auto nodeBuffer = node::Buffer::New(iso, v8buf, 0, v8buf->ByteLength()).ToLocalChecked();
-    auto buffer = reinterpret_cast<char*>(node::Buffer::Data(nodeBuffer.As<Object>()));
+    bool error = false;
 
-    logger::debug("Processing %u bytes\n", v8buf->ByteLength());
+    if (fd >= 0 || snapshot::In::is(data)) {
+        snapshot::In in(fd, data, error);
+        if (!restoreSnapshot(engine, in, error)) error = true;
+    } else {
+        logger::debug("Processing %u bytes\n", data.size());
 
-    bool error;
-    Reader r(string_view(buffer, v8buf->ByteLength()), error);
+        // Blob saved before snapshots: bot ids then the raw pool
+        Reader r(data, error);
 
-    // Sync bots
-    auto botCount = r.read<uint16_t>();
-    for (uint16_t j = 0; j < botCount; j++) {
-        auto botID = r.read<uint16_t>();
-        engine->addBot(botID);
-    }
+        // Sync bots
+        auto botCount = r.read<uint16_t>();
+        for (uint16_t j = 0; j < botCount; j++) {
+            auto botID = r.read<uint16_t>();
+            engine->addBot(botID);
+        }
 
-    // Sync pool
-    auto pool_size = r.read<size_t>();
-    const size_t POOL_BUF_SIZE = engine->poolSize();
-    if (pool_size != POOL_BUF_SIZE) logger::debug("Pool size changed (%u -> %u)\n", pool_size, POOL_BUF_SIZE);
-    
-    // Memory unsafe, need to skip extra bytes
-    if (pool_size > POOL_BUF_SIZE) {
-        r.read(engine->pool, POOL_BUF_SIZE);
-        r.skip(pool_size - POOL_BUF_SIZE);
-    // Memory safe
-    } else {
-        r.read(engine->pool, pool_size);
-    }
+        // Sync pool
+        auto pool_size = r.read<size_t>();
+        const size_t POOL_BUF_SIZE = engine->poolSize();
+        if (pool_size != POOL_BUF_SIZE) logger::debug("Pool size changed (%u -> %u)\n", pool_size, POOL_BUF_SIZE);
 
-    engine->syncState();
+        // Memory unsafe, need to skip extra bytes
+        if (pool_size > POOL_BUF_SIZE) {
+            r.read(engine->pool, POOL_BUF_SIZE);
+            r.skip(pool_size - POOL_BUF_SIZE);
+        // Memory safe
+        } else {
+            r.read(engine->pool, pool_size);
+        }
+    }
 
     if (!error) {
+        engine->syncState();
         args.GetReturnValue().Set(Boolean::New(iso, true));
         return;
     }
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <uv.h>
+
+#include <string>
+#include <vector>
+
+#include "server.hpp"
+#include "../misc/snapshot.hpp"
+
+using std::string;
+using std::vector;
+
+// Snapshot stream: mode, pool limit, then sections until SECTION_END. Cell
+// sections are a count and records sorted by id, see writeCell. Positions
+// are kept in 1/16 and radii in 1/256 of a unit.
+enum Section : uint8_t {
+    SECTION_END,
+    SECTION_BOTS,
+    SECTION_PELLETS,
+    SECTION_VIRUSES,
+    SECTION_EJECTS,
+    SECTION_PLAYERS,
+    SECTION_OTHERS,
+    SECTION_EXT,
+};
+
+// What a snapshot keeps of a cell and its boost
+struct FrozenCell {
+    uint32_t id;
+    uint16_t flag;
+    uint16_t type;
+    float age;
+    int data;
+    double x, y, r;
+    float boost[3];
+};
+
+// Engine state copied out at a tick boundary, encoding it doesn't touch the
+// engine again
+struct Capture {
+    // Cells per chunk of the pool that's scanned as one piece
+    static constexpr uint32_t CHUNK = 4096;
+
+    string mode;
+    uint32_t limit = 0;
+    vector<uint16_t> bots;
+    string ext;
+    // Live cells of chunk c and section s at [c * SECTION_EXT + s], each in
+    // id order. Kept around so the next capture doesn't allocate.
+    vector<vector<FrozenCell>> chunks;
+
+    // Has to be called between ticks, false without an engine
+    bool take(Server* server);
+    void write(snapshot::Out& out);
+};
+
+// Snapshots without stopping the ticks: the state is captured on the loop
+// thread, then encoded and written on the libuv pool, and callback gets
+// the result back on the loop. With every set it repeats on its own.
+struct Checkpoint {
+    Server* server;
+    uv_work_t work;
+    bool busy = false;
+
+    Capture capture;
+
+    // Written to path (through path.tmp, then renamed over it) or kept in
+    // memory for the callback
+    string path;
+    bool compress = true;
+    // Nanoseconds between checkpoints, 0 for one
+    uint64_t every = 0;
+    uint64_t next = 0;
+    UniquePersistent<Function> callback;
+
+    // Result
+    vector<char> memory;
+    size_t bytes = 0;
+    bool failed = false;
+    float captureTime = 0;
+    float encodeTime = 0;
+
+    Checkpoint(Server* server) : server(server) { work.data = this; }
+
+    // Captures and queues the encoding, false if one is still running or
+    // there's nothing to capture
+    bool start();
+
+    // From the tick timer, after the engine ticked
+    static void tick(Server* server, uint64_t now);
+};
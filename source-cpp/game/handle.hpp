@@ -85,7 +85,11 @@ struct GameHandle {
     void remove();
 
     virtual void syncInput() {};
+    // Runs on any thread, in parallel with the other handles
     virtual void onTick();
+    // Runs on the engine thread after every onTick of the tick, for what
+    // can't be done in parallel (calling into JS)
+    virtual void flush() {};
 
     virtual void onLog(string_view message) {};
     virtual void onError(string_view error, int32_t code = 0) {};
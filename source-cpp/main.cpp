@@ -0,0 +1,304 @@
+#include <stdlib.h>
+
+#include <string>
+#include <thread>
+
+#include "misc/logger.hpp"
+#include "misc/pool.hpp"
+
+// Headless server, no V8 isolate or libuv loop is needed to drive the engine.
+// Define Server before including engine templates
+struct Server {
+    class Engine* engine = nullptr;
+    class ThreadPool* threadPool = nullptr;
+};
+
+// Headers
+#include "extensions/rockslide/rock-engine.hpp"
+#include "physics/engine.hpp"
+
+// Implementations headers
+#include "extensions/rockslide/rock-engine-impl.hpp"
+#include "physics/engine-impl.hpp"
+
+constexpr OPT make_rock_opt() {
+    OPT temp = instant_opt;
+    temp.EJECT_MAX_AGE = 1000;
+    return temp;
+};
+
+constexpr OPT rock_opt = make_rock_opt();
+
+typedef TemplateEngine<default_opt> DefaultEngine;
+typedef TemplateEngine<ffa_opt> FFAEngine;
+typedef TemplateEngine<instant_opt> InstantEngine;
+typedef TemplateEngine<mega_opt> MegaEngine;
+typedef TemplateEngine<omega_opt> OmegaEngine;
+typedef TemplateEngine<sf_opt> SfEngine;
+typedef TemplateEngine<ultra_opt> UltraEngine;
+typedef RockEngine<rock_opt> RockslideEngine;
+
+typedef TemplateEngine<omega_bench_opt> BenchOmegaEngine;
+
+#define PHYSICS_TPS 25
+
+constexpr uint32_t tick_time = 1000 / PHYSICS_TPS;
+constexpr uint64_t tickNano = tick_time * MS_TO_NANO;
+
+// No JS side to notify
+void Engine::infoEvent(GameHandle* handle, EventType event) {}
+
+Engine* createEngine(Server* server, string& mode) {
+    Engine* engine = nullptr;
+
+    if (mode == "ffa") {
+        engine = new FFAEngine(server);
+    } else if (mode == "instant") {
+        engine = new InstantEngine(server);
+    } else if (mode == "mega") {
+        engine = new MegaEngine(server);
+    } else if (mode == "omega") {
+        engine = new OmegaEngine(server);
+    } else if (mode == "selffeed") {
+        engine = new SfEngine(server);
+    } else if (mode == "ultra") {
+        engine = new UltraEngine(server);
+    } else if (mode == "rockslide") {
+        engine = new RockslideEngine(server);
+    } else if (mode == "bench-omega") {
+        engine = new BenchOmegaEngine(server);
+        engine->alwaysSpawnBot = true;
+    } else if (mode == "debug") {
+        engine = new DefaultEngine(server);
+    } else {
+        logger::error("Unknown Game Mode: %s\n", mode.c_str());
+    }
+
+    return engine;
+}
+
+// Per tick samples of every Engine::timings field, in ms
+struct TimingStats {
+    static constexpr const char* PHASES[] = {
+        "tick",           "spawn_cells",    "handle_io",      "  io.phase0",
+        "  io.phase1",    "  io.phase2",    "spawn_handles",  "update_cells",
+        "resolve_physics", "  physics.phase0", "  physics.phase1",
+        "  physics.phase2", "  physics.phase3", "  physics.phase4",
+        "  physics.phase5", "  physics.phase6", "  physics.phase7"};
+    static constexpr size_t PHASE_COUNT = sizeof(PHASES) / sizeof(PHASES[0]);
+
+    vector<float> samples[PHASE_COUNT];
+
+    void reserve(size_t ticks) {
+        for (auto& s : samples) s.reserve(ticks);
+    }
+
+    void add(Engine* e, float busy) {
+        auto& t = e->timings;
+        const float values[PHASE_COUNT] = {
+            busy,
+            t.spawn_cells,
+            t.handle_io,
+            t.io.phase0,
+            t.io.phase1,
+            t.io.phase2,
+            t.spawn_handles,
+            t.update_cells,
+            t.resolve_physics,
+            t.physics.phase0,
+            t.physics.phase1,
+            t.physics.phase2,
+            t.physics.phase3,
+            t.physics.phase4,
+            t.physics.phase5,
+            t.physics.phase6,
+            t.physics.phase7,
+        };
+        for (size_t i = 0; i < PHASE_COUNT; i++) samples[i].push_back(values[i]);
+    }
+
+    void print() {
+        if (samples[0].empty()) return;
+
+        logger::print("%-20s %10s %10s %10s %10s\n", "phase", "avg ms",
+                      "median", "p99", "max");
+
+        for (size_t i = 0; i < PHASE_COUNT; i++) {
+            auto sorted = samples[i];
+            std::sort(sorted.begin(), sorted.end());
+
+            double sum = 0;
+            for (auto v : sorted) sum += v;
+
+            const size_t n = sorted.size();
+            logger::print("%-20s %10.3f %10.3f %10.3f %10.3f\n", PHASES[i],
+                          sum / n, sorted[n / 2], sorted[(n - 1) * 99 / 100],
+                          sorted.back());
+        }
+    }
+};
+
+// Seed the generator of every worker. Each task blocks until all of them are
+// picked up, so every worker runs exactly one of them. Don't sync before that,
+// this thread would help and take one itself.
+void seedWorkers(ThreadPool* pool, uint32_t seed) {
+    atomic<uint32_t> started = 0;
+    const uint32_t n = pool->size();
+
+    for (uint32_t i = 0; i < n; i++) {
+        pool->enqueue([&] {
+            generator.seed(seed + 1 + started++);
+            while (started.load() < n) std::this_thread::yield();
+        });
+    }
+    while (started.load() < n) std::this_thread::yield();
+    pool->sync();
+}
+
+int main(int argc, char** argv) {
+    vector<string> args;
+    int64_t seed = -1;
+    uint32_t botCount = 0;
+    uint32_t cellsPerBot = 0;
+    uint64_t warmup = 0;
+    Placement placement = Placement::CORES;
+    int64_t spinUs = -1;
+    int64_t hotTicks = -1;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.rfind("--", 0) || i + 1 >= argc) {
+            args.push_back(arg);
+            continue;
+        }
+
+        if (arg == "--placement") {
+            placement = parsePlacement(argv[++i]);
+            continue;
+        }
+
+        auto value = strtoll(argv[++i], nullptr, 10);
+        if (arg == "--seed") {
+            seed = value;
+        } else if (arg == "--bots") {
+            botCount = value;
+        } else if (arg == "--cells") {
+            cellsPerBot = value;
+        } else if (arg == "--warmup") {
+            warmup = value;
+        } else if (arg == "--spin") {
+            spinUs = value;
+        } else if (arg == "--hot") {
+            hotTicks = value;
+        } else {
+            logger::warn("Unknown option: %s\n", arg.c_str());
+        }
+    }
+
+    if (args.empty()) {
+        logger::print(
+            "Usage: %s <mode> [ticks = 1000] [threads = %u] [--seed N] "
+            "[--bots N --cells N] [--warmup N] [--placement P] [--spin US] "
+            "[--hot 0|1]\n",
+            argv[0], std::thread::hardware_concurrency());
+        logger::print(
+            "Modes: ffa, instant, mega, omega, selffeed, ultra, rockslide, "
+            "bench-omega, debug\n");
+        logger::print(
+            "  --seed    seed every RNG and ignore the measured load, runs "
+            "with 1 thread are fully reproducible\n"
+            "  --bots    populate the world with N bots before the first tick\n"
+            "  --cells   cells per populated bot\n"
+            "  --warmup  ticks to run before collecting timings\n"
+            "  --placement  worker cpu binding: none, spread, cores (default), "
+            "numa\n"
+            "  --spin    microseconds idle threads spin before parking\n"
+            "  --hot     keep idle workers spinning for the whole tick\n");
+        return 1;
+    }
+
+    string mode = args[0];
+    uint64_t ticks = args.size() > 1 ? strtoull(args[1].c_str(), nullptr, 10)
+                                     : 1000;
+    int32_t threads = args.size() > 2 ? atoi(args[2].c_str())
+                                      : std::thread::hardware_concurrency();
+
+    if (threads <= 0) threads = 1;
+
+    Server server;
+    server.threadPool = new ThreadPool(threads, placement);
+    server.threadPool->setSpin(
+        spinUs >= 0 ? spinUs : server.threadPool->getSpin(),
+        hotTicks >= 0 ? hotTicks : server.threadPool->getHotTicks());
+
+    if (seed >= 0) {
+        // The caller has its own RNG stream, bodies it picked up would draw
+        // from it depending on timing
+        server.threadPool->setCallerHelps(false);
+        srand(seed);
+        generator.seed(seed);
+        seedWorkers(server.threadPool, seed);
+    }
+
+    server.engine = createEngine(&server, mode);
+
+    auto engine = server.engine;
+    if (!engine) return 1;
+
+    logger::info("Running %s for %llu ticks with %i threads (%s)\n",
+                 engine->mode(), ticks, server.threadPool->size(),
+                 placementName(placement));
+
+    // Virtual clock starting at 0: every tick simulates a full tick_time
+    // regardless of how long it actually took, so the world evolves the same
+    // as in game
+    engine->start();
+    engine->__start = engine->__now = engine->__ltick = 0;
+
+    if (botCount) {
+        engine->populate(botCount, cellsPerBot ? cellsPerBot : 1);
+        logger::info("Populated %u cells with %u bots\n",
+                     engine->cellCount.load(), engine->bots.size());
+    }
+
+    TimingStats stats;
+    stats.reserve(ticks);
+    uint64_t start = hrtime();
+
+    for (uint64_t i = 1; i <= warmup + ticks; i++) {
+        engine->__now = i * tickNano;
+
+        uint64_t t0 = hrtime();
+
+        // MILLISECONDS
+        float m = engine->getTimeScale() / MS_TO_NANO_F;
+        engine->tick((engine->__now - engine->__ltick) * m);
+
+        auto busyTimeNano = hrtime() - t0;
+        constexpr float t = 1.f / (MS_TO_NANO_F * tick_time);
+        // Bots back off under load, which would make seeded runs depend on
+        // the machine
+        if (seed < 0) engine->usage = busyTimeNano * t;
+        engine->__ltick = engine->__now;
+
+        if (i == warmup) start = hrtime();
+        if (i > warmup) stats.add(engine, busyTimeNano / MS_TO_NANO_F);
+
+        if (!(i % 250)) {
+            logger::info("tick %llu: %u cells, %u bots, load %.1f%%\n", i,
+                         engine->cellCount.load(), engine->bots.size(),
+                         busyTimeNano * t * 100.f);
+        }
+    }
+
+    float elapsed = (hrtime() - start) / MS_TO_NANO_F;
+    logger::info("Finished %llu ticks in %.1f ms (%.1f TPS)\n", ticks, elapsed,
+                 ticks * 1000.f / elapsed);
+
+    stats.print();
+
+    delete engine;
+    delete server.threadPool;
+
+    return 0;
+}
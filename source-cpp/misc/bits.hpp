@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <bit>
+
+#include "reader.hpp"
+#include "writer.hpp"
+
+// Bit streams on top of Writer/Reader, least significant bit first. Numbers
+// that are usually small go through gamma (Elias gamma code): floor(log2 v)
+// zeros, a one, then the low bits of v.
+class BitWriter {
+    Writer& w;
+    uint64_t acc = 0;
+    uint32_t n = 0;
+
+public:
+    BitWriter(Writer& w) : w(w){};
+
+    // Signed to unsigned so small magnitudes stay small
+    static inline uint32_t zigzag(int32_t v) { return (uint32_t(v) << 1) ^ uint32_t(v >> 31); }
+
+    // bits <= 32
+    inline void put(uint32_t v, uint32_t bits) {
+        acc |= (uint64_t(v) & ((uint64_t(1) << bits) - 1)) << n;
+        n += bits;
+        if (n >= 32) {
+            w.write<uint32_t>(uint32_t(acc));
+            acc >>= 32;
+            n -= 32;
+        }
+    }
+
+    // v >= 1
+    inline void gamma(uint32_t v) {
+        uint32_t l = std::bit_width(v) - 1;
+        put(1u << l, l + 1);
+        put(v, l);
+    }
+
+    // Pads to a whole byte
+    inline void end() {
+        while (n) {
+            w.write<uint8_t>(uint8_t(acc));
+            acc >>= 8;
+            n = n > 8 ? n - 8 : 0;
+        }
+    }
+};
+
+class BitReader {
+    Reader& r;
+    string_view view;
+    size_t pos = 0;
+    uint64_t acc = 0;
+    uint32_t n = 0;
+    bool& error;
+
+    inline void refill() {
+        while (n <= 56 && pos < view.size()) {
+            acc |= uint64_t(uint8_t(view[pos++])) << n;
+            n += 8;
+        }
+    }
+
+public:
+    BitReader(Reader& r, bool& error) : r(r), view(r.rest()), error(error){};
+
+    static inline int32_t unzigzag(uint32_t v) { return int32_t(v >> 1) ^ -int32_t(v & 1); }
+
+    // bits <= 32
+    inline uint32_t get(uint32_t bits) {
+        if (n < bits) refill();
+        if (n < bits) {
+            error = true;
+            return 0;
+        }
+        uint32_t v = uint32_t(acc & ((uint64_t(1) << bits) - 1));
+        acc >>= bits;
+        n -= bits;
+        return v;
+    }
+
+    inline uint32_t gamma() {
+        refill();
+        uint32_t l = acc ? std::countr_zero(acc) : 64;
+        if (l > 31) {
+            error = true;
+            return 0;
+        }
+        acc >>= l + 1;
+        n -= l + 1;
+        return get(l) | (1u << l);
+    }
+
+    // Moves the Reader past the (padded) stream
+    inline void end() {
+        r.skip(pos - n / 8);
+        acc = 0;
+        n = 0;
+    }
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+// Byte oriented LZ77 in the LZ4 block layout: a token (literal count and
+// match length - 4 in 4 bits each, 15 means more bytes of up to 255 follow),
+// the literals, then a 2 byte offset back into the output. The last
+// sequence is literals only. Greedy single probe hash matching, it's there
+// to be fast, not small.
+class LZ {
+    static constexpr uint32_t HASH_BITS = 14;
+    static constexpr size_t MIN_MATCH = 4;
+    // A match can't start in the last 12 bytes or cover the last 5
+    static constexpr size_t END_LITERALS = 5;
+    static constexpr size_t MATCH_LIMIT = 12;
+    static constexpr size_t MAX_OFFSET = 65535;
+
+    std::vector<uint32_t> table;
+
+    static inline uint32_t read32(const uint8_t* p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static inline uint32_t hash(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+    static inline uint8_t* length(uint8_t* out, size_t n) {
+        for (; n >= 255; n -= 255) *out++ = 255;
+        *out++ = uint8_t(n);
+        return out;
+    }
+
+    static inline uint8_t* sequence(uint8_t* out, const uint8_t* literals, size_t count,
+                                    size_t offset, size_t match) {
+        uint8_t* token = out++;
+        *token = uint8_t(std::min<size_t>(count, 15) << 4);
+        if (count >= 15) out = length(out, count - 15);
+        if (count) memcpy(out, literals, count);
+        out += count;
+
+        if (!match) return out;
+
+        *out++ = uint8_t(offset);
+        *out++ = uint8_t(offset >> 8);
+        match -= MIN_MATCH;
+        *token |= uint8_t(std::min<size_t>(match, 15));
+        if (match >= 15) out = length(out, match - 15);
+        return out;
+    }
+
+public:
+    // Worst case compressed size of n bytes
+    static inline size_t bound(size_t n) { return n + n / 255 + 16; }
+
+    // dst has to hold bound(n) bytes, returns the compressed size
+    size_t compress(const char* input, size_t n, char* output) {
+        auto src = reinterpret_cast<const uint8_t*>(input);
+        auto out = reinterpret_cast<uint8_t*>(output);
+
+        table.assign(size_t(1) << HASH_BITS, 0);
+
+        size_t anchor = 0;
+        if (n > MATCH_LIMIT) {
+            const size_t limit = n - MATCH_LIMIT;
+            for (size_t i = 0; i < limit;) {
+                const uint32_t seq = read32(src + i);
+                auto& slot = table[hash(seq)];
+                const size_t candidate = slot;
+                slot = uint32_t(i);
+
+                if (candidate >= i || i - candidate > MAX_OFFSET ||
+                    read32(src + candidate) != seq) {
+                    i++;
+                    continue;
+                }
+
+                size_t match = MIN_MATCH;
+                const size_t max = n - END_LITERALS - i;
+                while (match < max && src[candidate + match] == src[i + match]) match++;
+
+                out = sequence(out, src + anchor, i - anchor, i - candidate, match);
+                i += match;
+                anchor = i;
+            }
+        }
+
+        out = sequence(out, src + anchor, n - anchor, 0, 0);
+        return out - reinterpret_cast<uint8_t*>(output);
+    }
+
+    // Decodes exactly raw bytes into output, false if the input is broken
+    static bool decompress(const char* input, size_t n, char* output, size_t raw) {
+        auto src = reinterpret_cast<const uint8_t*>(input);
+        auto dst = reinterpret_cast<uint8_t*>(output);
+        size_t ip = 0, op = 0;
+
+        auto extend = [&](size_t& len) {
+            uint8_t b;
+            do {
+                if (ip >= n) return false;
+                b = src[ip++];
+                len += b;
+            } while (b == 255);
+            return true;
+        };
+
+        while (ip < n) {
+            const uint8_t token = src[ip++];
+
+            size_t count = token >> 4;
+            if (count == 15 && !extend(count)) return false;
+            if (count > n - ip || count > raw - op) return false;
+            memcpy(dst + op, src + ip, count);
+            ip += count;
+            op += count;
+
+            if (ip == n) break;
+
+            if (n - ip < 2) return false;
+            const size_t offset = src[ip] | (size_t(src[ip + 1]) << 8);
+            ip += 2;
+            if (!offset || offset > op) return false;
+
+            size_t match = token & 15;
+            if (match == 15 && !extend(match)) return false;
+            match += MIN_MATCH;
+            if (match > raw - op) return false;
+
+            // Can overlap what it's copying
+            for (size_t k = 0; k < match; k++, op++) dst[op] = dst[op - offset];
+        }
+
+        return op == raw;
+    }
+};
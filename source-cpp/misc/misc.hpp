@@ -4,6 +4,7 @@
 
 #include <algorithm>
 #include <cctype>
+#include <chrono>
 #include <ctime>
 #include <fstream>
 #include <iomanip>
@@ -16,7 +17,6 @@
 #include <vector>
 
 #define NOMINMAX
-#include <uv.h>
 
 #define MS_TO_NANO 1000000
 #define MS_TO_NANO_F 1000000.f
@@ -3,38 +3,249 @@
 
 #ifdef WIN32
 #include <Windows.h>
-#else 
-// TODO: implement pthread cpu binding
-#include <pthread>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <chrono>
+#include <fstream>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define cpu_relax() _mm_pause()
+#else
+#define cpu_relax() std::this_thread::yield()
+#endif
+
+using std::memory_order_relaxed;
+using std::memory_order_acquire;
+using std::memory_order_release;
+using std::memory_order_seq_cst;
+
+bool TaskDeque::push(PoolTask* task) {
+    int64_t b = bottom.load(memory_order_relaxed);
+    int64_t t = top.load(memory_order_acquire);
+    if (b - t >= CAPACITY) return false;
+
+    buffer[b & MASK].store(task, memory_order_relaxed);
+    std::atomic_thread_fence(memory_order_release);
+    bottom.store(b + 1, memory_order_relaxed);
+    return true;
+}
+
+PoolTask* TaskDeque::pop() {
+    int64_t b = bottom.load(memory_order_relaxed) - 1;
+    bottom.store(b, memory_order_relaxed);
+    std::atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = top.load(memory_order_relaxed);
+
+    PoolTask* task = nullptr;
+    if (t <= b) {
+        task = buffer[b & MASK].load(memory_order_relaxed);
+        if (t == b) {
+            // Last one, race against the thieves
+            if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                             memory_order_relaxed))
+                task = nullptr;
+            bottom.store(b + 1, memory_order_relaxed);
+        }
+    } else {
+        bottom.store(b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+PoolTask* TaskDeque::steal() {
+    int64_t t = top.load(memory_order_acquire);
+    std::atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = bottom.load(memory_order_acquire);
+
+    if (t >= b) return nullptr;
+
+    PoolTask* task = buffer[t & MASK].load(memory_order_relaxed);
+    if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                     memory_order_relaxed))
+        return nullptr;
+    return task;
+}
+
+Placement parsePlacement(const std::string& name) {
+    if (name == "none") return Placement::NONE;
+    if (name == "spread") return Placement::SPREAD;
+    if (name == "cores") return Placement::CORES;
+    if (name == "numa") return Placement::NUMA;
+
+    logger::warn("Unknown placement: %s, using cores\n", name.c_str());
+    return Placement::CORES;
+}
+
+const char* placementName(Placement placement) {
+    switch (placement) {
+        case Placement::NONE: return "none";
+        case Placement::SPREAD: return "spread";
+        case Placement::CORES: return "cores";
+        case Placement::NUMA: return "numa";
+    }
+    return "";
+}
+
+struct LogicalCPU {
+    uint32_t id;
+    uint32_t core;
+    uint32_t package;
+    uint32_t node;
+    // Index among the SMT siblings of the same core
+    uint32_t smt;
+};
+
+#ifdef WIN32
+static std::vector<LogicalCPU> probeTopology() {
+    std::vector<LogicalCPU> cpus;
+    for (uint32_t i = 0; i < std::thread::hardware_concurrency(); i++)
+        cpus.push_back({i, i, 0, 0, 0});
+    return cpus;
+}
+
+static int32_t currentCPU() { return GetCurrentProcessorNumber(); }
+#else
+static uint32_t readSysValue(uint32_t cpu, const char* file, uint32_t fallback) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/%s",
+             cpu, file);
+
+    std::ifstream in(path);
+    int64_t value = -1;
+    if (!(in >> value) || value < 0) return fallback;
+    return value;
+}
+
+// cpuN/ has a nodeM link to the NUMA node it belongs to
+static uint32_t readNode(uint32_t cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+
+    uint32_t node = 0;
+    if (auto dir = opendir(path)) {
+        while (auto entry = readdir(dir)) {
+            if (sscanf(entry->d_name, "node%u", &node) == 1) break;
+        }
+        closedir(dir);
+    }
+    return node;
+}
+
+// Logical cpus this process is allowed to run on
+static std::vector<LogicalCPU> probeTopology() {
+    std::vector<LogicalCPU> cpus;
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        for (uint32_t i = 0; i < std::thread::hardware_concurrency(); i++)
+            CPU_SET(i, &allowed);
+    }
+
+    for (uint32_t i = 0; i < CPU_SETSIZE; i++) {
+        if (!CPU_ISSET(i, &allowed)) continue;
+        cpus.push_back({i, readSysValue(i, "core_id", i),
+                        readSysValue(i, "physical_package_id", 0), readNode(i),
+                        0});
+    }
+
+    // Sorted by id, so the first sibling of a core gets smt 0
+    for (size_t i = 0; i < cpus.size(); i++) {
+        for (size_t j = 0; j < i; j++) {
+            if (cpus[j].core == cpus[i].core &&
+                cpus[j].package == cpus[i].package)
+                cpus[i].smt++;
+        }
+    }
+
+    return cpus;
+}
+
+static int32_t currentCPU() { return sched_getcpu(); }
+#endif
+
+// Cpu for every worker, -1 to leave it unbound
+static std::vector<int32_t> placeWorkers(uint32_t n, Placement placement) {
+    std::vector<int32_t> result(n, -1);
+    if (placement == Placement::NONE) return result;
+
+#ifdef WIN32
+    // Topology isn't probed on windows, stride over the logical cpus
+    placement = Placement::SPREAD;
 #endif
 
-ThreadPool::ThreadPool(uint32_t n) : busy(0), processed(0), stop(0) {
+    auto cpus = probeTopology();
+    if (cpus.empty()) return result;
+
+    if (placement == Placement::SPREAD) {
+        // step = 1: cpu 0,1,2,3...
+        // step = 2: cpu 0,2,4,6... (good for hyperthreaded processor?)
+        // step = 4: cpu 0,4,8,12...
+        // etc
+        auto ratio = cpus.size() / n;
+        size_t step = 1;
+        while ((step << 1) <= ratio) step = step << 1;
+
+        for (uint32_t i = 0; i < n; i++)
+            result[i] = cpus[(i * step) % cpus.size()].id;
+        return result;
+    }
+
+    uint32_t home = 0;
+    if (placement == Placement::NUMA) {
+        auto self = currentCPU();
+        for (auto& cpu : cpus)
+            if (cpu.id == self) home = cpu.node;
+    }
+
+    // Home node first (NUMA only), then every first sibling before any
+    // second one, then keep cores of the same node & package together
+    std::stable_sort(cpus.begin(), cpus.end(), [&](auto& a, auto& b) {
+        if (placement == Placement::NUMA && (a.node == home) != (b.node == home))
+            return a.node == home;
+        if (a.smt != b.smt) return a.smt < b.smt;
+        if (a.node != b.node) return a.node < b.node;
+        if (a.package != b.package) return a.package < b.package;
+        return a.core < b.core;
+    });
+
+    for (uint32_t i = 0; i < n; i++) result[i] = cpus[i % cpus.size()].id;
+    return result;
+}
+
+ThreadPool::ThreadPool(uint32_t n, Placement placement)
+    : placement(placement),
+      pending(0),
+      processed(0),
+      sleepers(0),
+      waiters(0),
+      epoch(0),
+      stop(false),
+      spin_us(50),
+      hot(false),
+      hot_ticks(n < std::thread::hardware_concurrency()) {
     if (n <= 0) {
         n = 1;
         logger::warn("Setting thread pool worker to 1\n");
     }
 
-    auto total_cpus = std::thread::hardware_concurrency();
-    auto ratio = total_cpus / n;
+    auto cpus = placeWorkers(n, placement);
 
-    // TODO: learn how to use hwloc instead of this crap
-    
-    // step = 1: cpu 0,1,2,3...
-    // step = 2: cpu 0,2,4,6... (good for hyperthreaded processor?)
-    // step = 4: cpu 0,4,8,12... 
-    // etc
-
-    auto step = 1;
-    while ((step << 1) <= ratio) step = step << 1;
+    for (uint32_t i = 0; i <= n; ++i) queues.push_back(new TaskDeque());
 
     for (uint32_t i = 0; i < n; ++i) {
-        workers.emplace_back(std::bind(&ThreadPool::thread_proc, this, i * step));
+        workers.emplace_back(std::bind(&ThreadPool::thread_proc, this, i, cpus[i]));
     }
 }
 
 ThreadPool::~ThreadPool() {
     // set stop-condition
-    std::unique_lock<std::mutex> latch(queue_mutex);
+    std::unique_lock<std::mutex> latch(park_mutex);
     stop = true;
     cv_task.notify_all();
     latch.unlock();
@@ -42,52 +253,149 @@ ThreadPool::~ThreadPool() {
     // all threads terminate, then we're done.
     for (auto& t : workers)
         t.join();
+
+    for (auto q : queues) delete q;
+}
+
+// Own deque first (LIFO, still cache hot), then steal from everyone else
+PoolTask* ThreadPool::take(unsigned int self) {
+    PoolTask* task = queues[self]->pop();
+    if (task) return task;
+
+    auto n = queues.size();
+    for (unsigned int i = 1; i < n; i++) {
+        task = queues[(self + i) % n]->steal();
+        if (task) return task;
+    }
+    return nullptr;
 }
 
-void ThreadPool::thread_proc(uint32_t cpu) {
+bool ThreadPool::runOne(unsigned int self) {
+    PoolTask* task = take(self);
+    if (!task) return false;
+
+    (*task)();
+    delete task;
+    ++processed;
+
+    // seq_cst, pairs with ++waiters before parking
+    if (pending.fetch_sub(1) == 1) notifyFinished();
+    return true;
+}
+
+// Helps out until done() or the spin budget runs out, which never happens
+// while hot. Returns done().
+template <typename Done>
+bool ThreadPool::spin(unsigned int self, const Done& done, bool help) {
+    using namespace std::chrono;
+
+    if (!hot && !spin_us) return done();
+    const auto deadline = steady_clock::now() + microseconds(spin_us.load());
+
+    for (uint32_t i = 1;; i++) {
+        if (done()) return true;
+        if (help && runOne(self)) continue;
+
+        if (i & 63) {
+            cpu_relax();
+        } else {
+            if (!hot && steady_clock::now() >= deadline) return done();
+            // Don't starve anyone when there are more threads than cpus
+            std::this_thread::yield();
+        }
+    }
+}
+
+void ThreadPool::thread_proc(uint32_t index, int32_t cpu) {
+    if (cpu >= 0) {
 #ifdef WIN32
-    SetThreadAffinityMask(GetCurrentThread(), (1 << cpu));
+        SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
 #else
-// TODO
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            logger::warn("Failed to bind worker %u to cpu %i\n", index, cpu);
 #endif
+    }
 
-    while (true) {
-        std::unique_lock<std::mutex> latch(queue_mutex);
-        cv_task.wait(latch, [this]() { return stop || !tasks.empty(); });
-        if (!tasks.empty()) {
-            // got work. set busy.
-            ++busy;
+    current = this;
+    current_slot = index;
 
-            // pull from queue
-            auto fn = tasks.front();
-            tasks.pop_front();
+    while (true) {
+        // Read the epoch before looking for work, any enqueue after this
+        // point bumps it and keeps us from parking
+        auto e = epoch.load(memory_order_acquire);
+        if (runOne(index)) continue;
 
-            // release lock. run async
-            latch.unlock();
+        if (spin(index, [&] { return stop || epoch.load() != e; }) && !stop)
+            continue;
 
-            // run function outside context
-            fn();
-            ++processed;
+        std::unique_lock<std::mutex> latch(park_mutex);
+        if (stop && !pending) break;
 
-            latch.lock();
-            --busy;
-            cv_finished.notify_one();
-        } else if (stop) break;
+        ++sleepers;
+        cv_task.wait(latch, [&] { return stop || hot || epoch.load() != e; });
+        --sleepers;
     }
 }
 
 void ThreadPool::enqueue(std::function<void(void)> f) {
-    if (workers.size()) {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        tasks.emplace_back(std::forward<std::function<void(void)>>(f));
-        cv_task.notify_one();
-    } else f();
+    if (!workers.size()) return f();
+
+    auto task = new PoolTask(std::move(f));
+    ++pending;
+
+    if (!queues[slot()]->push(task)) {
+        // Deque is full, run it here
+        pending--;
+        (*task)();
+        delete task;
+        ++processed;
+        return;
+    }
+
+    // seq_cst, pairs with ++sleepers before parking
+    epoch.fetch_add(1);
+    if (sleepers.load()) {
+        std::lock_guard<std::mutex> lock(park_mutex);
+        cv_task.notify_all();
+    }
 }
 
-// waits until the queue is empty.
+void ThreadPool::wait(std::atomic<size_t>& remaining) {
+    const auto self = slot();
+    auto done = [&] { return !remaining.load(); };
+
+    const bool help = helps();
+
+    while (!done()) {
+        if (help && runOne(self)) continue;
+        if (spin(self, done, help)) return;
+
+        std::unique_lock<std::mutex> latch(park_mutex);
+        ++waiters;
+        cv_finished.wait(latch, done);
+        --waiters;
+    }
+}
+
+// waits until every task is done.
 void ThreadPool::sync() {
-    if (workers.size()) {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        cv_finished.wait(lock, [this]() { return tasks.empty() && (busy == 0); });
+    if (!workers.size()) return;
+
+    const auto self = slot();
+    auto done = [&] { return !pending.load(); };
+
+    const bool help = helps();
+
+    while (!done()) {
+        if (help && runOne(self)) continue;
+        if (spin(self, done, help)) return;
+
+        std::unique_lock<std::mutex> latch(park_mutex);
+        ++waiters;
+        cv_finished.wait(latch, done);
+        --waiters;
     }
-}
\ No newline at end of file
+}
@@ -1,33 +1,184 @@
 #pragma once
 
 #include <iostream>
-#include <deque>
 #include <vector>
 #include <functional>
 #include <thread>
 #include <condition_variable>
 #include <mutex>
 #include <atomic>
+#include <algorithm>
+#include <string>
 
+typedef std::function<void(void)> PoolTask;
+
+// Chase-Lev deque: owner pushes & pops at the bottom, thieves steal from the top
+class TaskDeque {
+    static constexpr int64_t CAPACITY = 4096;
+    static constexpr int64_t MASK = CAPACITY - 1;
+
+    alignas(64) std::atomic<int64_t> top;
+    alignas(64) std::atomic<int64_t> bottom;
+    alignas(64) std::atomic<PoolTask*> buffer[CAPACITY];
+
+public:
+    TaskDeque() : top(0), bottom(0) {};
+
+    // Owner only, returns false if full
+    bool push(PoolTask* task);
+    // Owner only
+    PoolTask* pop();
+    // Any thread
+    PoolTask* steal();
+
+    bool empty() {
+        return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+    }
+};
+
+// Where workers get pinned to
+enum class Placement {
+    NONE,    // Let the OS schedule them
+    SPREAD,  // Every step-th logical cpu, step = cpus / workers
+    CORES,   // One worker per physical core, SMT siblings last
+    NUMA     // Like CORES but fill the caller's NUMA node first
+};
+
+Placement parsePlacement(const std::string& name);
+const char* placementName(Placement placement);
+
+// Work stealing pool: every worker owns a deque, tasks enqueued by any other
+// thread go to one extra deque owned by that (single) external thread.
 class ThreadPool {
 public:
-    ThreadPool(unsigned int n);
+    ThreadPool(unsigned int n, Placement placement = Placement::CORES);
 
     void enqueue(std::function<void(void)> f);
+    // Waits (and helps) until every task is done. Not callable from a worker.
     void sync();
     inline unsigned int size() { return workers.size(); };
     ~ThreadPool();
 
     unsigned int getProcessed() const { return processed; }
+    Placement getPlacement() const { return placement; }
+
+    // Idle threads spin for spinUs before parking. hotTicks lets setHot keep
+    // idle workers from parking at all, so phase boundaries within a tick
+    // don't pay for futex wake ups. Only on by default if there's a cpu left
+    // for the calling thread, spinning on an oversubscribed machine is a loss.
+    void setSpin(uint32_t spinUs, bool hotTicks) {
+        spin_us = spinUs;
+        hot_ticks = hotTicks;
+    }
+    uint32_t getSpin() const { return spin_us; }
+    bool getHotTicks() const { return hot_ticks; }
+
+    // Whether the external thread runs tasks while it waits on them. Off,
+    // every task runs on a worker, so with a single worker the order (and
+    // the thread local RNG stream) of every loop body is always the same.
+    void setCallerHelps(bool value) { caller_helps = value; }
+
+    void setHot(bool value) {
+        hot = value && hot_ticks;
+        if (hot && sleepers.load()) {
+            std::lock_guard<std::mutex> lock(park_mutex);
+            cv_task.notify_all();
+        }
+    }
+
+    // Index of the calling thread: [0, size()) for workers, size() otherwise
+    inline unsigned int slot() { return current == this ? current_slot : size(); }
+    // Number of distinct slot() values, for per thread accumulators
+    inline unsigned int slots() { return size() + 1; }
+
+    // Calls body(i) for every i in [0, count), indices are handed out in
+    // chunks of grain through an atomic counter. The caller runs alongside
+    // first (if any), then takes part (see setCallerHelps) and returns once
+    // all of them are done.
+    template <typename Body>
+    void parallel_for(size_t count, const Body& body, size_t grain = 1,
+                      const PoolTask& alongside = nullptr) {
+        if (!count) {
+            if (alongside) alongside();
+            return;
+        }
+        grain = std::max<size_t>(grain, 1);
+
+        std::atomic<size_t> next = 0;
+        auto run = [&] {
+            size_t begin;
+            while ((begin = next.fetch_add(grain, std::memory_order_relaxed)) < count) {
+                const size_t end = std::min(begin + grain, count);
+                for (size_t i = begin; i < end; i++) body(i);
+            }
+        };
+
+        const size_t chunks = (count + grain - 1) / grain;
+        // Caller takes a share as well, unless it doesn't help
+        const bool help = helps();
+        std::atomic<size_t> remaining =
+            help ? std::min<size_t>(chunks, slots()) - 1 : std::min<size_t>(chunks, size());
+        const size_t tasks = remaining;
+
+        for (size_t i = 0; i < tasks; i++) {
+            enqueue([&] {
+                run();
+                if (remaining.fetch_sub(1) == 1)
+                    notifyFinished();
+            });
+        }
+
+        if (alongside) alongside();
+        if (help) run();
+        wait(remaining);
+    }
+
+    template <typename Item, typename Body>
+    void parallel_for_each(std::vector<Item>& items, const Body& body,
+                           size_t grain = 1, const PoolTask& alongside = nullptr) {
+        parallel_for(items.size(), [&](size_t i) { body(items[i]); }, grain,
+                     alongside);
+    }
 
 private:
+    Placement placement;
     std::vector<std::thread> workers;
-    std::deque<std::function<void(void)>> tasks;
-    std::mutex queue_mutex;
+    // One per worker plus the external one at the back
+    std::vector<TaskDeque*> queues;
+
+    std::mutex park_mutex;
     std::condition_variable cv_task;
     std::condition_variable cv_finished;
-    unsigned int busy;
+
+    std::atomic_uint pending;
     std::atomic_uint processed;
-    bool stop;
-    void thread_proc(uint32_t index);
-};
\ No newline at end of file
+    std::atomic_uint sleepers;
+    std::atomic_uint waiters;
+    std::atomic<uint64_t> epoch;
+    std::atomic_bool stop;
+
+    std::atomic_uint32_t spin_us;
+    std::atomic_bool hot;
+    bool hot_ticks;
+    bool caller_helps = true;
+
+    static inline thread_local ThreadPool* current = nullptr;
+    static inline thread_local unsigned int current_slot = 0;
+
+    void thread_proc(uint32_t index, int32_t cpu);
+
+    PoolTask* take(unsigned int self);
+    bool runOne(unsigned int self);
+    template <typename Done>
+    bool spin(unsigned int self, const Done& done, bool help = true);
+    void wait(std::atomic<size_t>& remaining);
+
+    // Workers always help, a nested loop could wait on nobody otherwise
+    inline bool helps() { return caller_helps || current == this; }
+
+    inline void notifyFinished() {
+        if (!waiters.load()) return;
+        std::lock_guard<std::mutex> lock(park_mutex);
+        cv_finished.notify_all();
+    }
+};
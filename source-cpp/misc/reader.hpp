@@ -1,5 +1,7 @@
 #pragma once
 
+#include <memory.h>
+
 #include <vector>
 #include <string_view>
 
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string_view>
+
+using std::atomic;
+using std::string_view;
+
+// Frames handed from the engine to the renderer through shared memory
+// (a SharedArrayBuffer both addons can see), so nothing gets copied or
+// allocated per frame. Layout: Header, frame sizes, then the slots. Frame
+// seq lives in slot seq % slots and a slot is only written again once the
+// frame in it is read. One producer and one consumer, frames are read in
+// order.
+class FrameRing {
+    struct Header {
+        // Last frame published and last frame read
+        atomic<uint32_t> written;
+        atomic<uint32_t> read;
+        uint32_t slots;
+        uint32_t slotSize;
+    };
+
+    static constexpr size_t ALIGN = 64;
+
+    Header* header = nullptr;
+    uint32_t* sizes = nullptr;
+    char* data = nullptr;
+
+    static inline size_t align(size_t n) { return (n + ALIGN - 1) & ~(ALIGN - 1); }
+
+public:
+    FrameRing() {}
+
+    // Lays the ring out over mem. init is for the side that owns the memory
+    // (the engine), the other side only reads the header it wrote.
+    FrameRing(void* mem, size_t bytes, uint32_t slots, bool init) {
+        header = static_cast<Header*>(mem);
+        if (!init) slots = header->slots;
+        if (!slots) return;
+
+        sizes = reinterpret_cast<uint32_t*>(static_cast<char*>(mem) + align(sizeof(Header)));
+        data = static_cast<char*>(mem) + align(sizeof(Header)) + align(slots * sizeof(uint32_t));
+
+        if (!init) return;
+
+        const size_t head = data - static_cast<char*>(mem);
+        header->written = 0;
+        header->read = 0;
+        header->slots = slots;
+        header->slotSize = bytes > head ? ((bytes - head) / slots) & ~(ALIGN - 1) : 0;
+    }
+
+    inline bool valid() { return data && header->slotSize; }
+
+    // Slot to write the next frame into, nullptr if the renderer is a whole
+    // ring behind or the frame might not fit (bound is the max frame size)
+    inline char* acquire(size_t bound) {
+        if (!valid() || bound > header->slotSize) return nullptr;
+        const uint32_t seq = header->written.load(std::memory_order_relaxed) + 1;
+        if (seq - header->read.load(std::memory_order_acquire) > header->slots) return nullptr;
+        return data + size_t(seq % header->slots) * header->slotSize;
+    }
+
+    // Publishes the frame written into the acquired slot, returns its seq
+    inline uint32_t publish(size_t size) {
+        const uint32_t seq = header->written.load(std::memory_order_relaxed) + 1;
+        sizes[seq % header->slots] = size;
+        header->written.store(seq, std::memory_order_release);
+        return seq;
+    }
+
+    // Frame seq, empty if it isn't published (or the ring isn't set up)
+    inline string_view frame(uint32_t seq) {
+        if (!valid()) return string_view();
+        if (int32_t(header->written.load(std::memory_order_acquire) - seq) < 0) return string_view();
+        const uint32_t slot = seq % header->slots;
+        return string_view(data + size_t(slot) * header->slotSize, sizes[slot]);
+    }
+
+    // Done with frame seq, its slot can be written again
+    inline void release(uint32_t seq) { header->read.store(seq, std::memory_order_release); }
+};
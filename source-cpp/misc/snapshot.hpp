@@ -0,0 +1,326 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <io.h>
+#define SNAPSHOT_WRITE _write
+#define SNAPSHOT_READ _read
+#else
+#include <unistd.h>
+#define SNAPSHOT_WRITE ::write
+#define SNAPSHOT_READ ::read
+#endif
+
+#include "lz.hpp"
+
+using std::string_view;
+using std::vector;
+
+// Engine snapshots. A small raw header (magic, version, flags), then the
+// stream in chunks: raw size, stored size (top bit set if it's compressed)
+// and the chunk. A chunk with raw size 0 ends it, followed by the FNV-1a
+// hash of the raw stream. Chunks only end between whole records, so
+// neither side ever holds more than one chunk of the stream.
+namespace snapshot {
+
+constexpr uint32_t MAGIC = 0x53545943;  // "CYTS"
+constexpr uint16_t VERSION = 1;
+
+constexpr uint16_t FLAG_COMPRESSED = 0x1;
+
+constexpr uint32_t CHUNK_SIZE = 256 * 1024;
+// Largest thing written between two room checks
+constexpr uint32_t RECORD_LIMIT = 4096;
+constexpr uint32_t STORED_COMPRESSED = 0x80000000u;
+
+inline uint64_t fnv1a(uint64_t hash, const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= uint8_t(data[i]);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+constexpr uint64_t FNV_SEED = 0xcbf29ce484222325ull;
+
+// Truncates or creates path for writing, -1 if it can't
+inline int create(const char* path) {
+#ifdef WIN32
+    return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+}
+
+inline void close(int fd) {
+#ifdef WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+inline uint32_t zigzag(int32_t v) { return (uint32_t(v) << 1) ^ uint32_t(v >> 31); }
+inline int32_t unzigzag(uint32_t v) { return int32_t(v >> 1) ^ -int32_t(v & 1); }
+
+// Writes the snapshot to a file descriptor as it goes, or into memory when
+// fd is negative
+class Out {
+    int fd;
+    bool compress;
+    LZ lz;
+
+    vector<char> raw;
+    size_t size = 0;
+    vector<char> packed;
+    uint64_t hash = FNV_SEED;
+
+public:
+    vector<char> memory;
+    size_t written = 0;
+    bool failed = false;
+
+    Out(int fd, bool compress) : fd(fd), compress(compress), raw(CHUNK_SIZE + RECORD_LIMIT) {
+        put(&MAGIC, sizeof(MAGIC));
+        put(&VERSION, sizeof(VERSION));
+        const uint16_t flags = compress ? FLAG_COMPRESSED : 0;
+        put(&flags, sizeof(flags));
+    }
+
+    // Straight to the sink, past the stream
+    void put(const void* data, size_t n) {
+        if (failed) return;
+        written += n;
+        if (fd < 0) {
+            const size_t at = memory.size();
+            memory.resize(at + n);
+            memcpy(memory.data() + at, data, n);
+            return;
+        }
+        for (auto p = static_cast<const char*>(data); n;) {
+            const auto w = SNAPSHOT_WRITE(fd, p, unsigned(std::min<size_t>(n, 1 << 30)));
+            if (w <= 0) {
+                failed = true;
+                return;
+            }
+            p += w;
+            n -= w;
+        }
+    }
+
+    template <typename T>
+    inline void write(T v) {
+        memcpy(raw.data() + size, &v, sizeof(T));
+        size += sizeof(T);
+    }
+
+    inline void write(const void* data, size_t n) {
+        memcpy(raw.data() + size, data, n);
+        size += n;
+    }
+
+    inline void varint(uint64_t v) {
+        while (v >= 0x80) {
+            raw[size++] = char(v | 0x80);
+            v >>= 7;
+        }
+        raw[size++] = char(v);
+    }
+
+    // Call between records
+    inline void room() {
+        if (size >= CHUNK_SIZE) flush();
+    }
+
+    // Data that can be longer than RECORD_LIMIT
+    void bytes(string_view data) {
+        varint(data.size());
+        while (data.size()) {
+            room();
+            const size_t n = std::min<size_t>(data.size(), RECORD_LIMIT);
+            write(data.data(), n);
+            data.remove_prefix(n);
+        }
+    }
+
+    void flush() {
+        if (!size) return;
+        hash = fnv1a(hash, raw.data(), size);
+
+        uint32_t stored = size;
+        const char* data = raw.data();
+        if (compress) {
+            packed.resize(LZ::bound(size));
+            const size_t n = lz.compress(raw.data(), size, packed.data());
+            if (n < size) {
+                stored = n | STORED_COMPRESSED;
+                data = packed.data();
+            }
+        }
+
+        const uint32_t rawSize = size;
+        put(&rawSize, sizeof(rawSize));
+        put(&stored, sizeof(stored));
+        put(data, stored & ~STORED_COMPRESSED);
+        size = 0;
+    }
+
+    void end() {
+        flush();
+        const uint32_t zero = 0;
+        put(&zero, sizeof(zero));
+        put(&zero, sizeof(zero));
+        put(&hash, sizeof(hash));
+    }
+};
+
+// Reads a snapshot from a file descriptor, or from memory when fd is
+// negative. Any read past what's there or broken chunk sets error.
+class In {
+    int fd;
+    string_view memory;
+    size_t offset = 0;
+
+    vector<char> raw;
+    vector<char> packed;
+    size_t size = 0;
+    size_t pos = 0;
+    uint64_t hash = FNV_SEED;
+    bool done = false;
+
+    bool& error;
+
+    bool take(void* out, size_t n) {
+        if (error) return false;
+        if (fd < 0) {
+            if (memory.size() - offset < n) return error = true, false;
+            memcpy(out, memory.data() + offset, n);
+            offset += n;
+            return true;
+        }
+        for (auto p = static_cast<char*>(out); n;) {
+            const auto r = SNAPSHOT_READ(fd, p, unsigned(std::min<size_t>(n, 1 << 30)));
+            if (r <= 0) return error = true, false;
+            p += r;
+            n -= r;
+        }
+        return true;
+    }
+
+    // Loads the next chunk once the current one is used up
+    bool next() {
+        if (pos < size) return true;
+        if (done || error) return error = true, false;
+
+        uint32_t rawSize = 0, stored = 0;
+        take(&rawSize, sizeof(rawSize));
+        take(&stored, sizeof(stored));
+        if (error) return false;
+
+        if (!rawSize) {
+            uint64_t expected = 0;
+            take(&expected, sizeof(expected));
+            done = true;
+            if (expected != hash) error = true;
+            return false;
+        }
+
+        const uint32_t n = stored & ~STORED_COMPRESSED;
+        if (rawSize > CHUNK_SIZE + RECORD_LIMIT || n > LZ::bound(rawSize))
+            return error = true, false;
+
+        raw.resize(rawSize);
+        if (stored & STORED_COMPRESSED) {
+            packed.resize(n);
+            if (!take(packed.data(), n)) return false;
+            if (!LZ::decompress(packed.data(), n, raw.data(), rawSize))
+                return error = true, false;
+        } else {
+            if (n != rawSize) return error = true, false;
+            if (!take(raw.data(), n)) return false;
+        }
+
+        hash = fnv1a(hash, raw.data(), rawSize);
+        size = rawSize;
+        pos = 0;
+        return true;
+    }
+
+public:
+    uint16_t version = 0;
+    uint16_t flags = 0;
+
+    In(int fd, string_view memory, bool& error) : fd(fd), memory(memory), error(error) {
+        error = false;
+        uint32_t magic = 0;
+        take(&magic, sizeof(magic));
+        take(&version, sizeof(version));
+        take(&flags, sizeof(flags));
+        if (magic != MAGIC || version != VERSION) error = true;
+    }
+
+    // Only for memory, if it starts like a snapshot at all
+    static bool is(string_view memory) {
+        uint32_t magic = 0;
+        if (memory.size() >= sizeof(magic)) memcpy(&magic, memory.data(), sizeof(magic));
+        return magic == MAGIC;
+    }
+
+    template <typename T>
+    inline T read() {
+        T v = 0;
+        read(&v, sizeof(T));
+        return v;
+    }
+
+    inline void read(void* out, size_t n) {
+        if (!next()) return;
+        if (size - pos < n) {
+            error = true;
+            return;
+        }
+        memcpy(out, raw.data() + pos, n);
+        pos += n;
+    }
+
+    inline uint64_t varint() {
+        uint64_t v = 0;
+        for (uint32_t shift = 0; shift < 64; shift += 7) {
+            if (pos >= size && !next()) return 0;
+            const uint8_t b = raw[pos++];
+            v |= uint64_t(b & 0x7F) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        error = true;
+        return 0;
+    }
+
+    void bytes(vector<char>& out) {
+        const size_t n = varint();
+        out.clear();
+        while (!error && out.size() < n) {
+            if (!next()) return;
+            const size_t k = std::min(n - out.size(), size - pos);
+            out.insert(out.end(), raw.data() + pos, raw.data() + pos + k);
+            pos += k;
+        }
+    }
+
+    // Has to be called after the last record, checks the hash
+    bool end() {
+        if (error) return false;
+        if (pos < size) return !(error = true);
+        next();
+        return done && !error;
+    }
+};
+
+}  // namespace snapshot
@@ -7,20 +7,26 @@
 
 using std::string_view;
 
-static inline std::unique_ptr<char[]> char_pool(nullptr);
+// One arena per thread, so handles on different threads can serialize at
+// the same time. finalize copies the result out.
+static inline thread_local std::unique_ptr<char[]> char_pool(nullptr);
 
 class Writer {
+    char* base;
     char* ptr;
 
    public:
     Writer() {
         if (!char_pool.get()) char_pool.reset(new char[32 * 1024 * 1024]);
-        ptr = char_pool.get();
+        base = ptr = char_pool.get();
 
         // printf("Thread ID = %i\n", std::this_thread::get_id());
         // printf("pool = 0x%p, &pool = 0x%p\n", char_pool.get(), &char_pool);
     };
 
+    // Writes straight into target, which has to be big enough
+    Writer(char* target) : base(target), ptr(target){};
+
     template <typename I>
     I& ref(I init = 0) {
         I& r = *((I*)ptr);
@@ -56,15 +62,17 @@ class Writer {
         // printf("Thread ID = %i\n", std::this_thread::get_id());
         // printf("pool = 0x%p, &pool = 0x%p\n", char_pool.get(), &char_pool);
 
-        size_t s = ptr - char_pool.get();
+        size_t s = ptr - base;
         auto out = static_cast<char*>(malloc(s));
-        memcpy(out, char_pool.get(), s);
-        ptr = char_pool.get();
+        memcpy(out, base, s);
+        ptr = base;
 
         return string_view(out, s);
     }
 
+    size_t size() { return ptr - base; }
+
     string_view buffer() {
-        return string_view(char_pool.get(), ptr - char_pool.get());
+        return string_view(base, ptr - base);
     }
 };
\ No newline at end of file
@@ -39,6 +39,11 @@ struct OPT {
 
     int32_t GRID_PL_SIZE = 512;
     int32_t GRID_EV_SIZE = 512;
+    // Mirror pellet coordinates per grid bucket (SoA) for the eat pass
+    bool GRID_PL_SOA = true;
+    // Keep those mirrors in float and run the eat kernel with twice the
+    // lanes, precise enough for maps up to ~32000 wide
+    bool FLOAT_CORD_PREC = false;
 
     uint8_t QUADTREE_MAX_LEVEL = 16;
     uint8_t QUADTREE_MAX_ITEMS = 16;
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "cell.hpp"
+
+using std::atomic;
+using std::vector;
+
+// Free list of cell ids. Every thread allocates from and frees into its own
+// cache, caches trade whole batches of ids with a shared lock free stack, so
+// the shared state is touched once every BATCH calls instead of every call.
+// Id 0 is never handed out, eatenByID = 0 means not eaten.
+class CellAllocator {
+public:
+    static constexpr cell_id_t NONE = ~cell_id_t(0);
+
+private:
+    static constexpr uint32_t BATCH = 64;
+
+    struct alignas(64) Cache {
+        uint32_t count = 0;
+        // Above every id this cache handed out
+        cell_id_t top = 0;
+        // Ids handed out minus ids taken back, through this cache
+        int64_t used = 0;
+        cell_id_t ids[2 * BATCH];
+    };
+
+    uint32_t limit = 0;
+    // Above every id that was taken at the last reset
+    cell_id_t base = 0;
+    // Ids that were taken at the last reset
+    uint32_t taken = 0;
+    // Ids of a batch are chained through next, batches on the stack are
+    // chained through nextBatch of their first id
+    cell_id_t* next = nullptr;
+    atomic<cell_id_t>* nextBatch = nullptr;
+    // First id of the top batch, upper 32 bits count pushes against ABA
+    alignas(64) atomic<uint64_t> head;
+
+    vector<Cache> caches;
+
+    inline void push(cell_id_t* ids, uint32_t n) {
+        for (uint32_t k = 0; k + 1 < n; k++) next[ids[k]] = ids[k + 1];
+        next[ids[n - 1]] = NONE;
+
+        uint64_t h = head.load(std::memory_order_relaxed);
+        uint64_t top;
+        do {
+            nextBatch[ids[0]].store(cell_id_t(h), std::memory_order_relaxed);
+            top = (((h >> 32) + 1) << 32) | ids[0];
+        } while (!head.compare_exchange_weak(h, top, std::memory_order_release,
+                                             std::memory_order_relaxed));
+    }
+
+    // Moves the top batch into cache, false if the stack is empty
+    inline bool pop(Cache& cache) {
+        uint64_t h = head.load(std::memory_order_acquire);
+        cell_id_t first;
+        while (true) {
+            first = cell_id_t(h);
+            if (first == NONE) return false;
+            uint64_t top = (((h >> 32) + 1) << 32) |
+                           nextBatch[first].load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(h, top, std::memory_order_acquire,
+                                           std::memory_order_acquire))
+                break;
+        }
+
+        for (cell_id_t id = first; id != NONE; id = next[id])
+            cache.ids[cache.count++] = id;
+        return true;
+    }
+
+public:
+    CellAllocator() : head(NONE){};
+
+    ~CellAllocator() {
+        delete[] next;
+        delete[] nextBatch;
+    }
+
+    void init(uint32_t n) {
+        limit = n;
+        next = new cell_id_t[n];
+        nextBatch = new atomic<cell_id_t>[n];
+        head = NONE;
+    }
+
+    // Caches for alloc/release, one per thread that calls them. Not thread safe
+    inline void reserveCaches(uint32_t n) {
+        if (caches.size() < n) caches.resize(n);
+    }
+
+    // Every id of pool without EXIST_BIT becomes free. Not thread safe
+    void reset(Cell* pool) {
+        head = NONE;
+        base = 0;
+        taken = 0;
+        for (auto& cache : caches) cache.count = cache.top = cache.used = 0;
+
+        cell_id_t ids[BATCH];
+        uint32_t n = 0;
+        // Backwards so low ids are on top
+        for (cell_id_t id = limit - 1; id > 0; id--) {
+            if (pool[id].flag.load(std::memory_order_relaxed) & EXIST_BIT) {
+                if (!base) base = id + 1;
+                taken++;
+                continue;
+            }
+            ids[n++] = id;
+            if (n == BATCH) {
+                push(ids, n);
+                n = 0;
+            }
+        }
+        if (n) push(ids, n);
+    }
+
+    // Free id or NONE if there's none left. Thread safe if every thread
+    // passes its own slot
+    inline cell_id_t alloc(uint32_t slot) {
+        auto& cache = caches[slot];
+        if (!cache.count && !pop(cache)) return NONE;
+        const cell_id_t id = cache.ids[--cache.count];
+        if (id >= cache.top) cache.top = id + 1;
+        cache.used++;
+        return id;
+    }
+
+    inline void release(cell_id_t id, uint32_t slot) {
+        auto& cache = caches[slot];
+        if (cache.count == 2 * BATCH) {
+            cache.count -= BATCH;
+            push(cache.ids + cache.count, BATCH);
+        }
+        cache.ids[cache.count++] = id;
+        cache.used--;
+    }
+
+    // Ids in use, freed cells included until they are released. Not thread
+    // safe
+    uint32_t used() {
+        int64_t n = taken;
+        for (auto& cache : caches) n += cache.used;
+        return uint32_t(n);
+    }
+
+    // Free ids that can sit in the caches out of reach of other threads,
+    // and id 0
+    inline uint32_t held() {
+        return uint32_t(caches.size()) * 2 * BATCH + 1;
+    }
+
+    // Every id at or above this one has been free since the last reset.
+    // Low ids go first, so it stays close to the most cells there were at
+    // once. Not thread safe
+    cell_id_t highWater() {
+        cell_id_t top = base;
+        for (auto& cache : caches) top = std::max(top, cache.top);
+        return top;
+    }
+
+    // Hands the ids held by the caches back to the stack so no thread runs
+    // out while another one sits on free ids. Not thread safe
+    void drain() {
+        for (auto& cache : caches) {
+            while (cache.count) {
+                uint32_t n = std::min(cache.count, BATCH);
+                cache.count -= n;
+                push(cache.ids + cache.count, n);
+            }
+        }
+    }
+};
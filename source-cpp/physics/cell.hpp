@@ -1,5 +1,8 @@
 #pragma once
 
+#include <math.h>
+
+#include <algorithm>
 #include <atomic>
 #include <mutex>
 
@@ -221,13 +224,20 @@ struct CellCache {
     int16_t x;
     int16_t y;
     uint16_t r;
-    CellCache() : id(0), type(0), x(0), y(0), r(0){};
+    // Last change of x/y/r sent, the next one is predicted from it
+    int32_t dx;
+    int32_t dy;
+    int32_t dr;
+    CellCache() : id(0), type(0), x(0), y(0), r(0), dx(0), dy(0), dr(0){};
     CellCache(cell_id_t id, Cell*& cell)
         : id(id),
           type(cell->type),
           x(cell->x / 2.f),
           y(cell->y / 2.f),
-          r(cell->r / 2.f) {}
+          r(cell->r / 2.f),
+          dx(0),
+          dy(0),
+          dr(0) {}
 
     CellCacheNoID clientState() {
         return {.type = type, .x = x * 2, .y = y * 2, .r = r * 2};
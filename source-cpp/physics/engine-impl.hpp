@@ -21,7 +21,6 @@ Engine::Engine(Server* server, uint16_t id)
       id(id),
       running(false),
       usage(0.0f),
-      __next_cell_id(1),
       cellCount(0),
       timings({}),
       queries({}),
@@ -34,12 +33,6 @@ TemplateEngine<T>::TemplateEngine(Server* server, uint16_t id)
     : Engine(server, id),
       Grid_PL(Rect(0, 0, DIM, DIM)),
       Grid_EV(Rect(0, 0, DIM, DIM)) {
-    auto bound = std::max(T.MAP_HW, T.MAP_HH);
-    int32_t dim = 1;
-    while (dim < bound) dim = dim << 1;
-
-    this->tree = new LooseQuadTree<0.25f>(
-        IRect(0, 0, dim, dim), T.QUADTREE_MAX_LEVEL, T.QUADTREE_MAX_ITEMS);
     this->dualEnabled = T.DUAL_ENABLED;
     this->defaultCanSpawn = T.PLAYER_CAN_SPAWN;
     this->desiredBots = T.BOTS;
@@ -54,6 +47,19 @@ TemplateEngine<T>::TemplateEngine(Server* server, uint16_t id)
 
     memset(pool, 0, poolSize());
     memset(boosts, 0, boostSize());
+
+    auto bound = std::max(T.MAP_HW, T.MAP_HH);
+    int32_t dim = 1;
+    while (dim < bound) dim = dim << 1;
+
+    this->tree = new LooseQuadTree<0.25f>(IRect(0, 0, dim, dim),
+                                          T.QUADTREE_MAX_LEVEL,
+                                          T.QUADTREE_MAX_ITEMS, pool,
+                                          T.CELL_LIMIT);
+
+    allocator.init(T.CELL_LIMIT);
+    allocator.reserveCaches(server->threadPool->slots());
+    allocator.reset(pool);
 }
 
 Engine::~Engine() {
@@ -127,6 +133,11 @@ void Engine::tick(float dt) {
 
     uint64_t t0 = hrtime(), t1, t2, t3, t4, t5;
 
+    // Workers keep spinning between the phases of this tick
+    server->threadPool->setHot(true);
+    tree->reserveLanes(server->threadPool->slots());
+    allocator.reserveCaches(server->threadPool->slots());
+
     spawnPellets();
     spawnViruses();
     updatePerks();
@@ -148,6 +159,8 @@ void Engine::tick(float dt) {
 
     resolve(dt);
     timings.resolve_physics = time_func(t4, t5);
+
+    server->threadPool->setHot(false);
 }
 
 bool Engine::stop() {
@@ -164,12 +177,12 @@ void TemplateEngine<T>::restart(bool clearMemory) {
     }
 
     __start = __now;
-    __next_cell_id = 0;
     cellCount = 0;
 
     tree->clear();
     Grid_EV.clear();
     Grid_PL.clear();
+    allocator.reset(pool);
     deadCells.clear();
     removedCells.clear();
     killArray.clear();
@@ -218,14 +231,14 @@ void TemplateEngine<T>::kill(Control* control, bool replace) {
 
             n.type = DEAD_TYPE;
             tree->swap(c, &n);
-            memset(c, 0, sizeof(Cell));
+            freeCell(c);
             deadCells.push_back(&n);
             cellCount--;  // Correct the cell count
         }
     } else {
         for (auto c : control->cells) {
             tree->remove(c);
-            memset(c, 0, sizeof(Cell));
+            freeCell(c);
         }
         cellCount -= control->cells.size();
     }
@@ -479,6 +492,75 @@ bool TemplateEngine<T>::spawnPlayerControl(Control*& c) {
     return point.safe;
 }
 
+template <OPT const& T>
+void TemplateEngine<T>::populate(uint32_t botCount, uint32_t cellsPerBot) {
+    cellsPerBot = std::clamp(cellsPerBot, 1u, uint32_t(T.PLAYER_MAX_CELLS));
+
+    // Whatever they start with, bots split up to PLAYER_MAX_CELLS cells
+    // each. That has to fit in three quarters of the pool, ejected cells
+    // are held to what's left, see handleIO.
+    const uint32_t budget =
+        uint32_t(T.CELL_LIMIT - T.PELLET_COUNT - T.VIRUS_COUNT -
+                 T.MAX_CYT_CELLS - T.MAX_EXP_CELLS) -
+        allocator.held();
+    const uint32_t maxBots =
+        std::max(budget / 4 * 3 / uint32_t(T.PLAYER_MAX_CELLS), 1u);
+    if (botCount > maxBots) {
+        logger::warn("%u bots can split past the cell pool, using %u bots\n",
+                     botCount, maxBots);
+        botCount = maxBots;
+    }
+    this->boundEjects = true;
+
+    while (Grid_PL.size() < T.PELLET_COUNT) spawnPellets();
+    for (uint32_t i = 0; i < T.VIRUS_COUNT; i++) spawnViruses();
+
+    this->desiredBots = botCount;
+
+    // Cells of a bot are scattered in a disc just big enough to hold them
+    const cell_cord_prec size =
+        std::max(T.PLAYER_MIN_SPLIT_SIZE, T.BOT_SPAWN_SIZE / sqrt(cellsPerBot));
+    const cell_cord_prec spread = size * sqrt(cellsPerBot) * 2;
+
+    std::uniform_real_distribution<cell_cord_prec> unit(0, 1);
+
+    while (bots.size() < botCount) {
+        auto c = addBot()->control;
+        auto [cx, cy] = randomPoint(spread, -map.hw + spread, map.hw - spread,
+                                    -map.hh + spread, map.hh - spread);
+
+        for (uint32_t i = 0; i < cellsPerBot; i++) {
+            const cell_cord_prec angle = rngAngle();
+            const cell_cord_prec d = spread * sqrt(unit(generator));
+
+            auto& cell = newCell();
+            cell.x = cx + d * sinf(angle);
+            cell.y = cy + d * cosf(angle);
+            cell.r = size;
+            cell.type = c->id;
+            cell.age = T.PLAYER_NO_COLLI_DELAY;
+
+            auto cid = cell_id(cell);
+            boosts[cid] = {0, 0, 0};
+
+            bounceCell(cell);
+            cell.updateAABB();
+
+            tree->insert(&cell);
+            c->cells.push_back(&cell);
+        }
+
+        c->alive = true;
+        c->afterSpawn();
+        c->calculateViewport();
+        c->__mouseX = c->viewport.x;
+        c->__mouseY = c->viewport.y;
+
+        // Split as we go, splitting one huge root node is quadratic
+        tree->restructure();
+    }
+}
+
 bool Engine::freeHandle(GameHandle* handle) {
     for (auto h : handles) {
         if (h->spectate == handle) {
@@ -566,238 +648,237 @@ void TemplateEngine<T>::handleIO(float dt) {
         queue.push_back(c);
     }
 
-    mutex work_m;
-    auto queue_size = queue.size();
+    auto pool = server->threadPool;
+    // Accumulate ejected cells per thread
+    vector<vector<Cell*>> local_ejected(pool->slots());
+    for (auto& local : local_ejected)
+        local.reserve(T.PLAYER_MAX_CELLS * queue.size() / pool->slots());
+
+    // Ejected cells that can still be added this tick, if they are bound
+    atomic<int64_t> ejectRoom = 0;
+    if (boundEjects) {
+        auto missing = [](size_t want, size_t have) {
+            return int64_t(want > have ? want - have : 0);
+        };
+        int64_t room = int64_t(T.CELL_LIMIT) - allocator.held() - allocator.used();
+        for (auto [_, c] : controls)
+            room -= missing(T.PLAYER_MAX_CELLS, c->cells.size());
+        room -= missing(T.PELLET_COUNT, Grid_PL.size());
+        room -= missing(T.VIRUS_COUNT, viruses.size());
+        room -= missing(T.MAX_CYT_CELLS, cyts.size());
+        room -= missing(T.MAX_EXP_CELLS, exps.size());
+        ejectRoom = room;
+    }
 
     // Player cells updates
-    for (uint32_t _ = 0; _ < server->threadPool->size(); _++) {
-        server->threadPool->enqueue([&] {
-            // Accumulate ejected cells locally
-            vector<Cell*> local_ejected;
-            // Estimate how much memory is needed
-            local_ejected.reserve(T.PLAYER_MAX_CELLS * queue_size /
-                                  server->threadPool->size());
+    pool->parallel_for_each(queue, [&](Control* c) {
+        auto& local = local_ejected[pool->slot()];
 
-            while (true) {
-                Control* c = nullptr;
+        c->calculateViewport();
 
-                {
-                    std::scoped_lock lock(work_m);
+        cell_cord_prec minSplitSize = 0.f;
+        cell_cord_prec splitRadiusThresh = 0.f;
+        if constexpr (T.NORMALIZE_THRESH_MASS > 0.f) {
+            const cell_cord_prec multi =
+                std::max(sqrt(c->score / T.NORMALIZE_THRESH_MASS),
+                         cell_cord_prec(1));
+            minSplitSize = multi * T.PLAYER_MIN_SPLIT_SIZE;
+            splitRadiusThresh = sqrtf(T.NORMALIZE_THRESH_MASS * 100);
+        } else {
+            minSplitSize = T.PLAYER_MIN_SPLIT_SIZE;
+        }
 
-                    if (!queue.size())
-                        break;
-                    else {
-                        c = queue.back();
-                        queue.pop_back();
+        constexpr cell_cord_prec boost = T.PLAYER_SPLIT_BOOST;
+
+        // Split
+        uint8_t expireTick = 11;
+        if (c->score > T.PLAYER_SPLIT_CAP_T1)
+            expireTick = 9;
+        else if (c->score > T.PLAYER_SPLIT_CAP_T2)
+            expireTick = 7;
+
+        auto maxCells = c->overwrites.cells;
+        if (maxCells <= 0) maxCells = T.PLAYER_MAX_CELLS;
+
+        uint8_t splits = c->splits;
+        c->splits = 0;
+        if (splits) c->splitAttempts.push_back(SplitAttempt(splits, 0));
+
+        // Split attempts
+        for (auto& s : c->splitAttempts) {
+            s.attempt--;
+            s.tick++;
+
+            auto copy = c->cells;
+
+            for (auto cell : copy) {
+                if constexpr (T.ULTRA_MERGE) cell->age = 0;
+                if (c->cells.size() >= maxCells) break;
+                if (cell->r < minSplitSize) continue;
+                cell_cord_prec dx = c->__mouseX - cell->x;
+                cell_cord_prec dy = c->__mouseY - cell->y;
+                cell_cord_prec d = sqrt(dx * dx + dy * dy);
+                if (d < 1)
+                    dx = 1, dy = 0, d = 1;
+                else
+                    dx /= d, dy /= d;
+
+                if constexpr (T.NORMALIZE_THRESH_MASS > 0.) {
+                    const cell_cord_prec multi2 = std::max(
+                        cell->r / splitRadiusThresh, cell_cord_prec(1));
+                    auto b =
+                        std::min(multi2 * boost, T.PLAYER_MAX_BOOST);
+                    auto n = splitFromCell(cell, cell->r * M_SQRT1_2,
+                                           {dx, dy, b});
+                    c->cells.push_back(n);
+                } else {
+                    if constexpr (T.EX_FAST_BOOST_R > 0.) {
+                        auto scaledBoost =
+                            cell->r > T.EX_FAST_BOOST_R
+                                ? (sqrtf(cell->r / T.EX_FAST_BOOST_R) *
+                                   boost)
+                                : boost;
+                        auto n =
+                            splitFromCell(cell, cell->r * M_SQRT1_2,
+                                          {dx, dy, scaledBoost});
+                        c->cells.push_back(n);
+                    } else {
+                        auto n = splitFromCell(
+                            cell, cell->r * M_SQRT1_2, {dx, dy, boost});
+                        c->cells.push_back(n);
                     }
                 }
 
-                c->calculateViewport();
-
-                cell_cord_prec minSplitSize = 0.f;
-                cell_cord_prec splitRadiusThresh = 0.f;
-                if constexpr (T.NORMALIZE_THRESH_MASS > 0.f) {
-                    const cell_cord_prec multi =
-                        std::max(sqrt(c->score / T.NORMALIZE_THRESH_MASS),
-                                 cell_cord_prec(1));
-                    minSplitSize = multi * T.PLAYER_MIN_SPLIT_SIZE;
-                    splitRadiusThresh = sqrtf(T.NORMALIZE_THRESH_MASS * 100);
-                } else {
-                    minSplitSize = T.PLAYER_MIN_SPLIT_SIZE;
+                if (s.attempt <= 0 && T.PLAYER_SPLIT_ADD_AGE) {
+                    cell->age += T.PLAYER_SPLIT_ADD_AGE;
                 }
+            }
 
-                constexpr cell_cord_prec boost = T.PLAYER_SPLIT_BOOST;
+            c->lastSplit = __now;
+            c->lastEject = __now;
+        }
 
-                // Split
-                uint8_t expireTick = 11;
-                if (c->score > T.PLAYER_SPLIT_CAP_T1)
-                    expireTick = 9;
-                else if (c->score > T.PLAYER_SPLIT_CAP_T2)
-                    expireTick = 7;
+        c->splitAttempts.erase(
+            std::remove_if(
+                c->splitAttempts.begin(), c->splitAttempts.end(),
+                [&](SplitAttempt& s) {
+                    return s.attempt <= 0 || s.tick >= expireTick;
+                }),
+            c->splitAttempts.end());
+
+        uint16_t ejectedCount = 0;
+        float maxEjectPerTick = dt / T.EJECT_DELAY;
+        // Eject
+        auto ejects = c->ejects;
+        c->ejects = 0;
+
+        auto macro = c->ejectMacro;
+        constexpr uint64_t noEjectPopDelayNano =
+            T.PLAYER_NO_EJECT_POP_DEALY * MS_TO_NANO;
+
+        auto factor =
+            1.f / powf(2.718281828459045f, c->cells.size() / 1000.f);
+
+        cell_cord_prec overwriteEjectMulti = c->overwrites.eject;
+        cell_cord_prec ejectLossSqr =
+            T.EJECT_LOSS * T.EJECT_LOSS * (factor * factor);
+        cell_cord_prec ejectSizeMin = T.PLAYER_MIN_EJECT_SIZE * factor;
+
+        const cell_cord_prec ejectSize =
+            overwriteEjectMulti * T.EJECT_SIZE * factor;
+        const cell_cord_prec ejectBoost =
+            c->overwrites.boost * T.EJECT_BOOST;
+        bool ejectPerk =
+            c->handle ? (c->handle->perms & EJECT_PERKS) : false;
+
+        uint16_t etype = c->id | EJECT_BIT;
+        std::uniform_int_distribution<int> rngBool(0, 1);
+
+        // Eject
+        if (T.PLAYER_NO_EJECT_POP_DEALY > 0 &&
+            __now > c->lastPopped + noEjectPopDelayNano) {
+            while (c->lastEject <= __now + dt * MS_TO_NANO &&
+                   (ejects > 0 || macro) && maxEjectPerTick--) {
+                if (ejects) ejects--;
+                ejectedCount++;
 
-                auto maxCells = c->overwrites.cells;
-                if (maxCells <= 0) maxCells = T.PLAYER_MAX_CELLS;
-
-                uint8_t splits = c->splits;
-                c->splits = 0;
-                if (splits) c->splitAttempts.push_back(SplitAttempt(splits, 0));
-
-                // Split attempts
-                for (auto& s : c->splitAttempts) {
-                    s.attempt--;
-                    s.tick++;
-
-                    auto copy = c->cells;
-
-                    for (auto cell : copy) {
-                        if constexpr (T.ULTRA_MERGE) cell->age = 0;
-                        if (c->cells.size() >= maxCells) break;
-                        if (cell->r < minSplitSize) continue;
-                        cell_cord_prec dx = c->__mouseX - cell->x;
-                        cell_cord_prec dy = c->__mouseY - cell->y;
-                        cell_cord_prec d = sqrt(dx * dx + dy * dy);
-                        if (d < 1)
-                            dx = 1, dy = 0, d = 1;
-                        else
-                            dx /= d, dy /= d;
-
-                        if constexpr (T.NORMALIZE_THRESH_MASS > 0.) {
-                            const cell_cord_prec multi2 = std::max(
-                                cell->r / splitRadiusThresh, cell_cord_prec(1));
-                            auto b =
-                                std::min(multi2 * boost, T.PLAYER_MAX_BOOST);
-                            auto n = splitFromCell(cell, cell->r * M_SQRT1_2,
-                                                   {dx, dy, b});
-                            c->cells.push_back(n);
-                        } else {
-                            if constexpr (T.EX_FAST_BOOST_R > 0.) {
-                                auto scaledBoost =
-                                    cell->r > T.EX_FAST_BOOST_R
-                                        ? (sqrtf(cell->r / T.EX_FAST_BOOST_R) *
-                                           boost)
-                                        : boost;
-                                auto n =
-                                    splitFromCell(cell, cell->r * M_SQRT1_2,
-                                                  {dx, dy, scaledBoost});
-                                c->cells.push_back(n);
-                            } else {
-                                auto n = splitFromCell(
-                                    cell, cell->r * M_SQRT1_2, {dx, dy, boost});
-                                c->cells.push_back(n);
-                            }
-                        }
+                uint16_t etype = c->id | EJECT_BIT;
+                for (auto cell : c->cells) {
+                    const cell_cord_prec r = cell->r;
+                    if (r < ejectSizeMin ||
+                        cell->age < T.PLAYER_NO_EJECT_DELAY)
+                        continue;
 
-                        if (s.attempt <= 0 && T.PLAYER_SPLIT_ADD_AGE) {
-                            cell->age += T.PLAYER_SPLIT_ADD_AGE;
-                        }
+                    cell_cord_prec dx = c->__mouseX - cell->x;
+                    cell_cord_prec dy = c->__mouseY - cell->y;
+                    cell_cord_prec d = sqrt(dx * dx + dy * dy);
+                    if (d < 1)
+                        dx = 1, dy = 0, d = 1;
+                    else
+                        dx /= d, dy /= d;
+
+                    const cell_cord_prec sx = cell->x + dx * r;
+                    const cell_cord_prec sy = cell->y + dy * r;
+
+                    if constexpr (T.EJECT_DISPERSION > 0.f) {
+                        std::uniform_real_distribution<cell_cord_prec>
+                            randomEject(-T.EJECT_DISPERSION,
+                                        T.EJECT_DISPERSION);
+                        const cell_cord_prec angle =
+                            atan2f(dx, dy) + randomEject(generator);
+                        dx = sinf(angle);
+                        dy = cosf(angle);
                     }
 
-                    c->lastSplit = __now;
-                    c->lastEject = __now;
-                }
-
-                c->splitAttempts.erase(
-                    std::remove_if(
-                        c->splitAttempts.begin(), c->splitAttempts.end(),
-                        [&](SplitAttempt& s) {
-                            return s.attempt <= 0 || s.tick >= expireTick;
-                        }),
-                    c->splitAttempts.end());
-
-                uint16_t ejectedCount = 0;
-                float maxEjectPerTick = dt / T.EJECT_DELAY;
-                // Eject
-                auto ejects = c->ejects;
-                c->ejects = 0;
-
-                auto macro = c->ejectMacro;
-                constexpr uint64_t noEjectPopDelayNano =
-                    T.PLAYER_NO_EJECT_POP_DEALY * MS_TO_NANO;
-
-                auto factor =
-                    1.f / powf(2.718281828459045f, c->cells.size() / 1000.f);
-
-                cell_cord_prec overwriteEjectMulti = c->overwrites.eject;
-                cell_cord_prec ejectLossSqr =
-                    T.EJECT_LOSS * T.EJECT_LOSS * (factor * factor);
-                cell_cord_prec ejectSizeMin = T.PLAYER_MIN_EJECT_SIZE * factor;
-
-                const cell_cord_prec ejectSize =
-                    overwriteEjectMulti * T.EJECT_SIZE * factor;
-                const cell_cord_prec ejectBoost =
-                    c->overwrites.boost * T.EJECT_BOOST;
-                bool ejectPerk =
-                    c->handle ? (c->handle->perms & EJECT_PERKS) : false;
-
-                uint16_t etype = c->id | EJECT_BIT;
-                std::uniform_int_distribution<int> rngBool(0, 1);
-
-                // Eject
-                if (T.PLAYER_NO_EJECT_POP_DEALY > 0 &&
-                    __now > c->lastPopped + noEjectPopDelayNano) {
-                    while (c->lastEject <= __now + dt * MS_TO_NANO &&
-                           (ejects > 0 || macro) && maxEjectPerTick--) {
-                        if (ejects) ejects--;
-                        ejectedCount++;
-
-                        uint16_t etype = c->id | EJECT_BIT;
-                        for (auto cell : c->cells) {
-                            const cell_cord_prec r = cell->r;
-                            if (r < ejectSizeMin ||
-                                cell->age < T.PLAYER_NO_EJECT_DELAY)
-                                continue;
-
-                            cell_cord_prec dx = c->__mouseX - cell->x;
-                            cell_cord_prec dy = c->__mouseY - cell->y;
-                            cell_cord_prec d = sqrt(dx * dx + dy * dy);
-                            if (d < 1)
-                                dx = 1, dy = 0, d = 1;
-                            else
-                                dx /= d, dy /= d;
-
-                            const cell_cord_prec sx = cell->x + dx * r;
-                            const cell_cord_prec sy = cell->y + dy * r;
-
-                            if constexpr (T.EJECT_DISPERSION > 0.f) {
-                                std::uniform_real_distribution<cell_cord_prec>
-                                    randomEject(-T.EJECT_DISPERSION,
-                                                T.EJECT_DISPERSION);
-                                const cell_cord_prec angle =
-                                    atan2f(dx, dy) + randomEject(generator);
-                                dx = sinf(angle);
-                                dy = cosf(angle);
-                            }
-
-                            auto& n = newCell();
+                    if (boundEjects &&
+                        ejectRoom.fetch_sub(1, std::memory_order_relaxed) <= 0)
+                        break;
 
-                            n.x = sx;
-                            n.y = sy;
-                            n.r = ejectSize;
-                            n.type = etype;
+                    auto& n = newCell();
 
-                            auto cid = cell_id(n);
-                            boosts[cid] = {dx, dy, ejectBoost};
+                    n.x = sx;
+                    n.y = sy;
+                    n.r = ejectSize;
+                    n.type = etype;
 
-                            local_ejected.push_back(&n);
-                            Grid_EV.insert(n);
+                    auto cid = cell_id(n);
+                    boosts[cid] = {dx, dy, ejectBoost};
 
-                            cell->r = sqrtf(r * r - ejectLossSqr);
-                            cell->flag |= UPDATE_BIT;
-                        }
+                    local.push_back(&n);
+                    Grid_EV.insert(n);
 
-                        uint64_t newT =
-                            __now + T.EJECT_DELAY * MS_TO_NANO * ejectedCount;
+                    cell->r = sqrtf(r * r - ejectLossSqr);
+                    cell->flag |= UPDATE_BIT;
+                }
 
-                        // WTF: floating point error makes solotrick actually OP
-                        // but breaks after 7 days uint64_t oldT = __now +
-                        // T.EJECT_DELAY * MS_TO_NANO_F * ejectedCount;
+                uint64_t newT =
+                    __now + T.EJECT_DELAY * MS_TO_NANO * ejectedCount;
 
-                        // if (newT != oldT) logger::debug("Diff: %i ms\n",
-                        // ((long) newT - (long) oldT)); c->lastEject = newT +
-                        // jitter(generator);
-                        c->lastEject = newT;
-                        // c->lastEject = oldT;
-                    }
-                }
+                // WTF: floating point error makes solotrick actually OP
+                // but breaks after 7 days uint64_t oldT = __now +
+                // T.EJECT_DELAY * MS_TO_NANO_F * ejectedCount;
 
-                std::scoped_lock lock(m);
-                // Spawn
-                if (c->canSpawn()) {
-                    auto dt = ((__now - std::max(c->lastSpawned, c->lastDead)) /
-                               1000 / 1000) /
-                              1000.f;
-                    if (dt > T.PLAYER_SPAWN_DELAY) delaySpawn(c);
-                }
+                // if (newT != oldT) logger::debug("Diff: %i ms\n",
+                // ((long) newT - (long) oldT)); c->lastEject = newT +
+                // jitter(generator);
+                c->lastEject = newT;
+                // c->lastEject = oldT;
             }
+        }
 
-            if (!local_ejected.size()) return;
-            // Append vector
-            std::scoped_lock lock(m);
-            ejected.insert(ejected.end(), local_ejected.begin(),
-                           local_ejected.end());
-        });
-    }
-    server->threadPool->sync();
+        std::scoped_lock lock(m);
+        // Spawn
+        if (c->canSpawn()) {
+            auto dt = ((__now - std::max(c->lastSpawned, c->lastDead)) /
+                       1000 / 1000) /
+                      1000.f;
+            if (dt > T.PLAYER_SPAWN_DELAY) delaySpawn(c);
+        }
+    });
+
+    // Append vectors
+    for (auto& local : local_ejected)
+        ejected.insert(ejected.end(), local.begin(), local.end());
 
     timings.io.phase0 = time_func(t0, t1);
 
@@ -807,44 +888,26 @@ void TemplateEngine<T>::handleIO(float dt) {
 
     timings.io.phase1 = time_func(t1, t2);
 
-    mutex qm;
-
-    auto hcopy = handles;
+    vector<GameHandle*> all;
     vector<GameHandle*> seq;
+    all.reserve(handles.size());
     seq.reserve(players.load());
 
-    // Filter out player to be sequentially executed
-    auto iter = hcopy.begin();
-    while (iter != hcopy.end()) {
-        if (!(*iter)->isBot()) {
-            seq.push_back(*iter);
-            iter = hcopy.erase(iter);
-        } else
-            iter++;
+    // Players first, their views take the longest to build
+    for (auto h : handles) {
+        if (!h->isBot()) {
+            all.push_back(h);
+            seq.push_back(h);
+        }
     }
-
-    for (uint32_t i = 0; i < server->threadPool->size(); i++) {
-        // Basically all bots after we filter it
-        server->threadPool->enqueue([&] {
-            while (true) {
-                GameHandle* h = nullptr;
-                qm.lock();
-                if (!hcopy.size()) {
-                    qm.unlock();
-                    break;
-                } else {
-                    h = hcopy.back();
-                    hcopy.pop_back();
-                    qm.unlock();
-                }
-                h->onTick();
-            }
-        });
+    for (auto h : handles) {
+        if (h->isBot()) all.push_back(h);
     }
 
+    pool->parallel_for_each(all, [](GameHandle* h) { h->onTick(); }, 1);
+
     // Single thread because we might call into JS
-    for (auto& h : seq) h->onTick();
-    server->threadPool->sync();
+    for (auto& h : seq) h->flush();
 
     timings.io.phase2 = time_func(t2, t3);
 }
@@ -861,24 +924,20 @@ void TemplateEngine<T>::updatePerks() {
 
 template <OPT const& T>
 void TemplateEngine<T>::removeCells() {
-    const uint32_t step = server->threadPool->size();
-
-    for (uint32_t i = 0; i < step; i++) {
-        server->threadPool->enqueue([&, i] {
-            for (uint32_t j = i; j < removedCells.size(); j += step) {
-                auto cell = removedCells[j];
-                if (cell->type == VIRUS_TYPE || cell->type & EJECT_BIT) {
-                    Grid_EV.remove(*cell);
-                } else if (cell->type == PELLET_TYPE) {
-                    Grid_PL.remove(*cell);
-                }
-                if (IS_NOT_PLAYER(cell->type)) cellCount--;
-                memset(cell, 0, sizeof(Cell));
+    server->threadPool->parallel_for_each(
+        removedCells,
+        [&](Cell* cell) {
+            if (cell->type == VIRUS_TYPE || cell->type & EJECT_BIT) {
+                Grid_EV.remove(*cell);
+            } else if (cell->type == PELLET_TYPE) {
+                Grid_PL.remove(*cell);
             }
-        });
-    }
-    server->threadPool->sync();
+            if (IS_NOT_PLAYER(cell->type)) cellCount--;
+            freeCell(cell);
+        },
+        64);
     removedCells.clear();
+    allocator.drain();
 }
 
 template <OPT const& T>
@@ -888,6 +947,7 @@ void TemplateEngine<T>::updateCells(float dt) {
     removeCells();
 
     const uint32_t step = server->threadPool->size();
+    const uint32_t lane = server->threadPool->slot();
     // Constant boost rate
     for (auto cell : exps) {
         cell->age += dt;
@@ -898,7 +958,7 @@ void TemplateEngine<T>::updateCells(float dt) {
             boosts[cid].d = T.EJECT_BOOST;
 
             cell->updateAABB();
-            tree->update(cell);
+            tree->update(cell, lane);
 
             if (cell->age > T.PERK_DYNAMIC_MAX_AGE) cell->flag |= REMOVE_BIT;
         }
@@ -913,12 +973,17 @@ void TemplateEngine<T>::updateCells(float dt) {
             boosts[cid].d = T.EJECT_BOOST;
 
             cell->updateAABB();
-            tree->update(cell);
+            tree->update(cell, lane);
 
             if (cell->age > T.PERK_DYNAMIC_MAX_AGE) cell->flag |= REMOVE_BIT;
         }
     }
 
+    // Grid moves are staged per thread and applied together below, in bands
+    // of bucket columns
+    const uint32_t parts = step <= 1 ? 1 : std::min<uint32_t>(step * 4, T.GRID_EV_SIZE);
+    Grid_EV.reserveLanes(server->threadPool->slots(), parts);
+
     // Update ejected cells
     if (step <= 1 || ejected.size() < 1000) {
         for (auto cell : ejected) {
@@ -931,32 +996,27 @@ void TemplateEngine<T>::updateCells(float dt) {
 
             if (boostCell(*cell, dt)) {
                 bounceCell(*cell);
-                Grid_EV.update(*cell);
-                constexpr size_t s = sizeof(Grid_EV);
+                Grid_EV.stage(*cell, lane);
             }
         }
         // Multithread
     } else {
-        for (int i = 0; i < step; i++) {
-            server->threadPool->enqueue([this, i, step, &dt] {
-                for (int j = i; j < ejected.size(); j += step) {
-                    auto& cell = ejected[j];
-                    cell->age += dt;
-                    cell->flag &= CLEAR_BITS;
-
-                    if constexpr (T.EJECT_MAX_AGE > 0) {
-                        if (cell->age > T.EJECT_MAX_AGE)
-                            cell->flag |= REMOVE_BIT;
-                    }
+        server->threadPool->parallel_for_each(
+            ejected,
+            [&](Cell* cell) {
+                cell->age += dt;
+                cell->flag &= CLEAR_BITS;
+
+                if constexpr (T.EJECT_MAX_AGE > 0) {
+                    if (cell->age > T.EJECT_MAX_AGE) cell->flag |= REMOVE_BIT;
+                }
 
-                    if (boostCell(*cell, dt)) {
-                        bounceCell(*cell);
-                        Grid_EV.update(*cell);
-                    }
+                if (boostCell(*cell, dt)) {
+                    bounceCell(*cell);
+                    Grid_EV.stage(*cell, server->threadPool->slot());
                 }
-            });
-        }
-        server->threadPool->sync();
+            },
+            256);
     }
 
     // Update dead cells
@@ -966,7 +1026,7 @@ void TemplateEngine<T>::updateCells(float dt) {
         if (boostCell(*cell, dt)) {
             bounceCell(*cell);
             cell->updateAABB();
-            tree->update(cell);
+            tree->update(cell, lane);
         }
     }
 
@@ -977,27 +1037,32 @@ void TemplateEngine<T>::updateCells(float dt) {
             cell->flag &= CLEAR_BITS;
             if (boostCell(*cell, dt)) {
                 bounceCell(*cell);
-                Grid_EV.update(*cell);
+                Grid_EV.stage(*cell, lane);
             }
         }
     } else {
-        for (int i = 0; i < step; i++) {
-            server->threadPool->enqueue([this, i, step, &dt] {
-                for (int j = i; j < viruses.size(); j += step) {
-                    auto& cell = viruses[j];
-                    cell->age += dt;
-                    cell->flag &= CLEAR_BITS;
-                    if (boostCell(*cell, dt)) {
-                        bounceCell(*cell);
-                        Grid_EV.update(*cell);
-                    }
+        server->threadPool->parallel_for_each(
+            viruses,
+            [&](Cell* cell) {
+                cell->age += dt;
+                cell->flag &= CLEAR_BITS;
+                if (boostCell(*cell, dt)) {
+                    bounceCell(*cell);
+                    Grid_EV.stage(*cell, server->threadPool->slot());
                 }
-            });
-        }
-        server->threadPool->sync();
+            },
+            256);
+    }
+
+    // Apply the staged grid moves, every thread takes bands of bucket
+    // columns so no two of them touch the same bucket
+    if (step <= 1 || Grid_EV.staged() < 1000) {
+        Grid_EV.flush();
+    } else {
+        server->threadPool->parallel_for(parts, [&](size_t p) { Grid_EV.flush(p); });
+        Grid_EV.clearStaged();
     }
 
-    mutex work_m;
     vector<Control*> copy;
 
     copy.reserve(controls.size());
@@ -1010,170 +1075,163 @@ void TemplateEngine<T>::updateCells(float dt) {
         1.f + playerMass / mapMass * T.GLOBAL_DECAY;
     const cell_cord_prec pMulti = localMulti * globalMulti;
 
-    // Player cells updates
-    for (uint32_t _ = 0; _ < server->threadPool->size(); _++) {
-        if (ignoreInput) break;
-
-        server->threadPool->enqueue([&] {
-            while (true) {
-                Control* c = nullptr;
+    // Removing from the tree isn't thread safe, extra cells are removed after
+    vector<vector<Cell*>> extraCells(server->threadPool->slots());
 
-                {
-                    std::scoped_lock lock(work_m);
-                    if (!copy.size())
-                        break;
-                    else {
-                        c = copy.back();
-                        copy.pop_back();
-                    }
-                }
-
-                if (!c->alive) continue;
-                cell_cord_prec decayMulti = (c->score - dMass) * pMulti;
-
-                // Shrink viewport if camping detected
-                if constexpr (T.ANTI_CAMP_TIME > 0) {
-                    constexpr cell_cord_prec camp =
-                        T.ANTI_CAMP_TIME * 1000 * MS_TO_NANO;
-                    const cell_cord_prec nosplit = __now - c->lastSplit;
-                    if (nosplit > camp && c->score > T.ANTI_CAMP_MASS) {
-                        cell_cord_prec campMulti =
-                            nosplit / MS_TO_NANO_F / 1000;
-                        if (c->handle) {
-                            c->dynamicViewportFactor =
-                                std::max(0., 1. - T.ANTI_CAMP_MULT * campMulti);
-                        }
-                    } else {
-                        c->dynamicViewportFactor = 1.;
+    // Player cells updates
+    if (!ignoreInput) {
+        server->threadPool->parallel_for_each(copy, [&](Control* c) {
+            if (!c->alive) return;
+            const uint32_t lane = server->threadPool->slot();
+            cell_cord_prec decayMulti = (c->score - dMass) * pMulti;
+
+            // Shrink viewport if camping detected
+            if constexpr (T.ANTI_CAMP_TIME > 0) {
+                constexpr cell_cord_prec camp =
+                    T.ANTI_CAMP_TIME * 1000 * MS_TO_NANO;
+                const cell_cord_prec nosplit = __now - c->lastSplit;
+                if (nosplit > camp && c->score > T.ANTI_CAMP_MASS) {
+                    cell_cord_prec campMulti =
+                        nosplit / MS_TO_NANO_F / 1000;
+                    if (c->handle) {
+                        c->dynamicViewportFactor =
+                            std::max(0., 1. - T.ANTI_CAMP_MULT * campMulti);
                     }
+                } else {
+                    c->dynamicViewportFactor = 1.;
                 }
+            }
 
-                uint16_t allFlags = 0;
-                uint8_t locked = c->lineLocked;
-                cell_cord_prec mx = c->__mouseX;
-                cell_cord_prec my = c->__mouseY;
-
-                // Remove extra cells
-                if (c->overwrites.cells > 0 &&
-                    c->cells.size() > c->overwrites.cells) {
-                    for (int i = c->overwrites.cells; i < c->cells.size();
-                         i++) {
-                        auto cell = c->cells[i];
-                        tree->remove(cell);
-                        memset(cell, 0, sizeof(Cell));
-                    }
-                    cellCount -= (c->cells.size() - c->overwrites.cells);
-                    c->cells.resize(c->overwrites.cells);
+            uint16_t allFlags = 0;
+            uint8_t locked = c->lineLocked;
+            cell_cord_prec mx = c->__mouseX;
+            cell_cord_prec my = c->__mouseY;
+
+            // Remove extra cells
+            if (c->overwrites.cells > 0 &&
+                c->cells.size() > c->overwrites.cells) {
+                auto& extra = extraCells[lane];
+                for (int i = c->overwrites.cells; i < c->cells.size();
+                     i++) {
+                    extra.push_back(c->cells[i]);
                 }
+                cellCount -= (c->cells.size() - c->overwrites.cells);
+                c->cells.resize(c->overwrites.cells);
+            }
 
-                vector<Cell*> cellsCopy = c->cells;
+            vector<Cell*> cellsCopy = c->cells;
 
-                const bool invincible =
-                    c->handle ? c->handle->perms & INVINCIBLE : false;
+            const bool invincible =
+                c->handle ? c->handle->perms & INVINCIBLE : false;
 
-                auto decay = c->overwrites.decay;
-                auto speed = c->overwrites.speed;
-                auto minC = c->overwrites.minSize;
-                auto maxC = c->overwrites.maxSize;
-                auto instant = T.ULTRA_MERGE || c->overwrites.instant;
-                auto campDecay = c->score > T.ANTI_CAMP_MASS;
+            auto decay = c->overwrites.decay;
+            auto speed = c->overwrites.speed;
+            auto minC = c->overwrites.minSize;
+            auto maxC = c->overwrites.maxSize;
+            auto instant = T.ULTRA_MERGE || c->overwrites.instant;
+            auto campDecay = c->score > T.ANTI_CAMP_MASS;
 
-                for (auto cell : cellsCopy) {
-                    cell->age += dt;
-                    cell->flag &= CLEAR_BITS;
+            for (auto cell : cellsCopy) {
+                cell->age += dt;
+                cell->flag &= CLEAR_BITS;
 
-                    // Boost and bounce cell
-                    boostCell(*cell, dt);
-                    bounceCell(*cell);
+                // Boost and bounce cell
+                boostCell(*cell, dt);
+                bounceCell(*cell);
 
-                    // Decay
-                    if (cell->r > T.DECAY_MIN) {
-                        cell_cord_prec extraFactor = 1.;
-                        if constexpr (T.ANTI_CAMP_TIME) {
-                            constexpr cell_cord_prec camp =
-                                T.ANTI_CAMP_TIME * 1000;
-                            if (campDecay && cell->age > camp) {
-                                extraFactor = std::min(
-                                    (1. + T.ANTI_CAMP_MULT * 0.001 * cell->age),
-                                    4.);
-                            }
+                // Decay
+                if (cell->r > T.DECAY_MIN) {
+                    cell_cord_prec extraFactor = 1.;
+                    if constexpr (T.ANTI_CAMP_TIME) {
+                        constexpr cell_cord_prec camp =
+                            T.ANTI_CAMP_TIME * 1000;
+                        if (campDecay && cell->age > camp) {
+                            extraFactor = std::min(
+                                (1. + T.ANTI_CAMP_MULT * 0.001 * cell->age),
+                                4.);
                         }
-
-                        cell->r -= extraFactor * decay * decayMulti * cell->r *
-                                   staticDecay * dt * 0.0001f;
                     }
 
-                    cell->r = cell->r > maxC   ? maxC
-                              : cell->r < minC ? minC
-                                               : cell->r;
-
-                    // Calculate collision bit
-                    if (c->overwrites.canColli &&
-                        cell->age > T.PLAYER_NO_COLLI_DELAY)
-                        cell->flag |= COLL_BIT;
-
-                    if (invincible) cell->flag |= NOEAT_BIT;
-
-                    // Calculate autosplit
-                    if constexpr (T.PLAYER_AUTOSPLIT_SIZE > 0) {
-                        if (c->overwrites.canAuto &&
-                            cell->r > T.PLAYER_AUTOSPLIT_SIZE) {
-                            cell_cord_prec angle = rngAngle();
-                            auto n = splitFromCell(cell, cell->r * M_SQRT1_2,
-                                                   {sinf(angle), cosf(angle),
-                                                    T.PLAYER_SPLIT_BOOST});
-                            c->cells.push_back(n);
-                        }
+                    cell->r -= extraFactor * decay * decayMulti * cell->r *
+                               staticDecay * dt * 0.0001f;
+                }
+
+                cell->r = cell->r > maxC   ? maxC
+                          : cell->r < minC ? minC
+                                           : cell->r;
+
+                // Calculate collision bit
+                if (c->overwrites.canColli &&
+                    cell->age > T.PLAYER_NO_COLLI_DELAY)
+                    cell->flag |= COLL_BIT;
+
+                if (invincible) cell->flag |= NOEAT_BIT;
+
+                // Calculate autosplit
+                if constexpr (T.PLAYER_AUTOSPLIT_SIZE > 0) {
+                    if (c->overwrites.canAuto &&
+                        cell->r > T.PLAYER_AUTOSPLIT_SIZE) {
+                        cell_cord_prec angle = rngAngle();
+                        auto n = splitFromCell(cell, cell->r * M_SQRT1_2,
+                                               {sinf(angle), cosf(angle),
+                                                T.PLAYER_SPLIT_BOOST});
+                        c->cells.push_back(n);
                     }
+                }
 
-                    constexpr float noMergeDelay = T.PLAYER_NO_MERGE_DELAY;
-                    float mergeTime;
-                    cell_cord_prec initial = 0.;
-
-                    // Calc merge
-                    if constexpr (T.PLAYER_MERGE_TIME > 0) {
-                        constexpr cell_cord_prec mergeIncrease =
-                            T.PLAYER_MERGE_INCREASE;
-                        initial = 10000. * T.PLAYER_MERGE_TIME;
-                        const cell_cord_prec increase =
-                            100. * cell->r * mergeIncrease;
-
-                        if constexpr (T.PLAYER_MERGE_NEW_VER) {
-                            mergeTime = instant ? (T.PLAYER_NO_COLLI_DELAY +
-                                                   T.ULTRA_MERGE_DELAY)
-                                                : std::max(increase, initial);
-                        } else {
-                            mergeTime = increase + initial;
-                        }
+                constexpr float noMergeDelay = T.PLAYER_NO_MERGE_DELAY;
+                float mergeTime;
+                cell_cord_prec initial = 0.;
+
+                // Calc merge
+                if constexpr (T.PLAYER_MERGE_TIME > 0) {
+                    constexpr cell_cord_prec mergeIncrease =
+                        T.PLAYER_MERGE_INCREASE;
+                    initial = 10000. * T.PLAYER_MERGE_TIME;
+                    const cell_cord_prec increase =
+                        100. * cell->r * mergeIncrease;
+
+                    if constexpr (T.PLAYER_MERGE_NEW_VER) {
+                        mergeTime = instant ? (T.PLAYER_NO_COLLI_DELAY +
+                                               T.ULTRA_MERGE_DELAY)
+                                            : std::max(increase, initial);
                     } else {
-                        mergeTime = noMergeDelay;
+                        mergeTime = increase + initial;
                     }
+                } else {
+                    mergeTime = noMergeDelay;
+                }
 
-                    if (c->overwrites.canMerge &&
-                        (cell->age > mergeTime ||
-                         (T.EX_FAST_MERGE_MASS &&
-                          (cell->r < T.PLAYER_MIN_EJECT_SIZE &&
-                           c->score > T.EX_FAST_MERGE_MASS &&
-                           cell->age > initial)))) {
-                        cell->flag |= MERGE_BIT;
-                    }
+                if (c->overwrites.canMerge &&
+                    (cell->age > mergeTime ||
+                     (T.EX_FAST_MERGE_MASS &&
+                      (cell->r < T.PLAYER_MIN_EJECT_SIZE &&
+                       c->score > T.EX_FAST_MERGE_MASS &&
+                       cell->age > initial)))) {
+                    cell->flag |= MERGE_BIT;
+                }
 
-                    movePlayerCell(*cell, dt, mx, my, locked, allFlags, speed);
+                movePlayerCell(*cell, dt, mx, my, locked, allFlags, speed);
 
-                    cell->updateAABB();
-                    tree->update(cell);
-                }
+                cell->updateAABB();
+                tree->update(cell, lane);
+            }
 
-                // Unlock line if any cell hit wall with normal line
-                if ((locked == 1) && (allFlags & WALL_BIT)) {
-                    // std::cout << "???" << std::endl;
-                    c->unlockLine();
-                }
+            // Unlock line if any cell hit wall with normal line
+            if ((locked == 1) && (allFlags & WALL_BIT)) {
+                // std::cout << "???" << std::endl;
+                c->unlockLine();
             }
         });
     }
 
-    server->threadPool->sync();
+    for (auto& extra : extraCells) {
+        for (auto cell : extra) {
+            tree->remove(cell);
+            freeCell(cell);
+        }
+    }
+
     tree->restructure();
 }
 
@@ -1186,8 +1244,6 @@ void TemplateEngine<T>::resolve(float dt) {
     // 4. Resolve player-eject-virus eat
     // 5. Resolve ejected-eject collision and ejected-virus eat
 
-    mutex qm;
-
     uint64_t t0 = hrtime(), t1, t2, t3, t4, t5, t6, t7, t8;
 
     vector<Control*> temp;
@@ -1197,383 +1253,335 @@ void TemplateEngine<T>::resolve(float dt) {
     std::sort(temp.begin(), temp.end(),
               [](auto c1, auto c2) { return c1->score > c2->score; });
 
-    atomic<uint64_t> total_queries = 0;
-    atomic<uint64_t> effective_queries = 0;
     memset(queries.level_counter, 0, sizeof(queries.level_counter));
     memset(queries.level_efficient, 0, sizeof(queries.level_efficient));
-    mutex counter_m;
-
-    vector<Control*> copy = temp;
-    for (uint32_t _ = 0; _ < server->threadPool->size(); _++) {
-        server->threadPool->enqueue([&] {
-            uint64_t effi = 0;
-            uint64_t total = 0;
-            uint64_t local_level_counter[QUERY_LEVEL] = {};
-            uint64_t local_level_efficient[QUERY_LEVEL] = {};
-
-            while (true) {
-                Control* c = nullptr;
-                qm.lock();
-                if (!copy.size()) {
-                    qm.unlock();
-                    break;
-                } else {
-                    c = copy.back();
-                    copy.pop_back();
-                    qm.unlock();
-                }
 
-                // Sort the cells
-                c->sorted = c->cells;
-                std::sort(c->sorted.begin(), c->sorted.end(),
-                          [](auto a, auto b) {
-                              // if (a->boost.d != b->boost.d)
-                              //     return a->boost.d > b->boost.d;
-                              // else
-                              return a->r - a->age * 0.1 < b->r - b->age * 0.1;
-                          });
-
-                if (!c->overwrites.canMerge && !c->overwrites.canColli)
-                    continue;
-
-                bool instant = T.ULTRA_MERGE || c->overwrites.instant;
-
-                // Player collisions and merge
-                for (auto cell : c->sorted) {
-                    uint16_t flags = cell->flag;
-                    uint16_t type = cell->type;
-                    // Skip resolve bits
-                    if (flags & SKIP_RESOLVE_BITS) continue;
-
-                    tree->query(*cell, true, [&](Cell* other, uint32_t level) {
-                        total++;  // TODO: remove
-                        if (level < QUERY_LEVEL) local_level_counter[level]++;
-
-                        // This flag is only written to from the same thread, no
-                        // need for atomic rw here
-                        uint16_t otherFlags = other->flag;
-
-                        if (otherFlags & SKIP_RESOLVE_BITS) return;
-                        // Double check is good or not??
-                        // if (cell->r < other->r) return;
-
-                        Action action = Action::NONE;
-
-                        if (type == other->type) {
-                            uint16_t flagsAND = flags & otherFlags;
-                            if (flagsAND & MERGE_BIT)
-                                action = Action::MERGE;
-                            else {
-                                if constexpr (T.ULTRA_MERGE) {
-                                    if ((flags | otherFlags) & COLL_BIT)
-                                        action = Action::COL;
-                                } else {
-                                    if (flagsAND & COLL_BIT)
-                                        action = Action::COL;
-                                }
-                            }
+    // Query counters per thread, merged after each phase
+    struct alignas(64) QueryCounter {
+        uint64_t total = 0;
+        uint64_t effi = 0;
+        uint64_t level_counter[QUERY_LEVEL] = {};
+        uint64_t level_efficient[QUERY_LEVEL] = {};
+    };
+
+    auto pool = server->threadPool;
+    vector<QueryCounter> counters(pool->slots());
+
+    auto mergeCounters = [&](uint64_t& total, uint64_t& effi) {
+        total = effi = 0;
+        for (auto& local : counters) {
+            total += local.total;
+            effi += local.effi;
+            for (int i = 0; i < QUERY_LEVEL; i++) {
+                queries.level_counter[i] += local.level_counter[i];
+                queries.level_efficient[i] += local.level_efficient[i];
+            }
+            local = QueryCounter();
+        }
+    };
+
+    pool->parallel_for_each(temp, [&](Control* c) {
+        auto& local = counters[pool->slot()];
+
+        // Sort the cells
+        c->sorted = c->cells;
+        std::sort(c->sorted.begin(), c->sorted.end(),
+                  [](auto a, auto b) {
+                      // if (a->boost.d != b->boost.d)
+                      //     return a->boost.d > b->boost.d;
+                      // else
+                      return a->r - a->age * 0.1 < b->r - b->age * 0.1;
+                  });
+
+        if (!c->overwrites.canMerge && !c->overwrites.canColli)
+            return;
+
+        bool instant = T.ULTRA_MERGE || c->overwrites.instant;
+
+        // Player collisions and merge
+        for (auto cell : c->sorted) {
+            uint16_t flags = cell->flag;
+            uint16_t type = cell->type;
+            // Skip resolve bits
+            if (flags & SKIP_RESOLVE_BITS) continue;
+
+            tree->query(*cell, true, [&](Cell* other, uint32_t level) {
+                local.total++;  // TODO: remove
+                if (level < QUERY_LEVEL) local.level_counter[level]++;
+
+                // This flag is only written to from the same thread, no
+                // need for atomic rw here
+                uint16_t otherFlags = other->flag;
+
+                if (otherFlags & SKIP_RESOLVE_BITS) return;
+                // Double check is good or not??
+                // if (cell->r < other->r) return;
+
+                Action action = Action::NONE;
+
+                if (type == other->type) {
+                    uint16_t flagsAND = flags & otherFlags;
+                    if (flagsAND & MERGE_BIT)
+                        action = Action::MERGE;
+                    else {
+                        if constexpr (T.ULTRA_MERGE) {
+                            if ((flags | otherFlags) & COLL_BIT)
+                                action = Action::COL;
+                        } else {
+                            if (flagsAND & COLL_BIT)
+                                action = Action::COL;
                         }
+                    }
+                }
 
-                        // Do nothing
-                        if (action == Action::NONE) return;
-
-                        cell_cord_prec r2 = other->r;
-                        // Basic condition to eat
-                        if (action == Action::EAT && cell->r < r2 * T.EAT_MULT)
-                            return;
-
-                        cell_cord_prec dx = other->x - cell->x;
-                        cell_cord_prec dy = other->y - cell->y;
-
-                        cell_cord_prec rSum = cell->r + r2;
-                        cell_cord_prec dSqr = dx * dx + dy * dy;
-
-                        if (!dSqr || dSqr >= rSum * rSum) return;
-                        cell_cord_prec d = sqrt(dSqr);
+                // Do nothing
+                if (action == Action::NONE) return;
 
-                        effi++;  // Indeed intersection
-                        if (level < QUERY_LEVEL) local_level_efficient[level]++;
+                cell_cord_prec r2 = other->r;
+                // Basic condition to eat
+                if (action == Action::EAT && cell->r < r2 * T.EAT_MULT)
+                    return;
 
-                        if (action == Action::COL) {
-                            cell_cord_prec m = rSum - d;
+                cell_cord_prec dx = other->x - cell->x;
+                cell_cord_prec dy = other->y - cell->y;
 
-                            dx /= d;
-                            dy /= d;
+                cell_cord_prec rSum = cell->r + r2;
+                cell_cord_prec dSqr = dx * dx + dy * dy;
 
-                            // if (d + cell->r < other->r) cell->flag |=
-                            // INSIDE_BIT; if (d + r2 < cell->r) other->flag |=
-                            // INSIDE_BIT;
+                if (!dSqr || dSqr >= rSum * rSum) return;
+                cell_cord_prec d = sqrt(dSqr);
 
-                            cell->flag |= UPDATE_BIT;
-                            other->flag |= UPDATE_BIT;
+                local.effi++;  // Indeed intersection
+                if (level < QUERY_LEVEL) local.level_efficient[level]++;
 
-                            cell_cord_prec a = cell->r * cell->r;
-                            cell_cord_prec b = r2 * r2;
-                            cell_cord_prec sum = a + b;
+                if (action == Action::COL) {
+                    cell_cord_prec m = rSum - d;
 
-                            cell_cord_prec aM = b / sum;
+                    dx /= d;
+                    dy /= d;
 
-                            cell_cord_prec m1 =
-                                (m < cell->r ? m : cell->r) * aM;
-                            cell->x -= dx * m1;
-                            cell->y -= dy * m1;
+                    // if (d + cell->r < other->r) cell->flag |=
+                    // INSIDE_BIT; if (d + r2 < cell->r) other->flag |=
+                    // INSIDE_BIT;
 
-                            if constexpr (T.COLLI_RATIO > 1) {
-                                if (cell->r / other->r > T.COLLI_RATIO ||
-                                    other->r / cell->r > T.COLLI_RATIO)
-                                    return;
-                            }
+                    cell->flag |= UPDATE_BIT;
+                    other->flag |= UPDATE_BIT;
 
-                            cell_cord_prec bM = a / sum;
-
-                            cell_cord_prec m2 = (m < r2 ? m : r2) * bM;
-                            other->x += dx * m2;
-                            other->y += dy * m2;
-
-                            // constexpr cell_cord_prec MIN_RELAX =
-                            // T.PLAYER_MIN_EJECT_SIZE * 3.0f; if (instant ||
-                            // cell->r > T.RELAXATION_RATIO_THRESH * r2 || r2 <
-                            // MIN_RELAX) {
-                            //     cell_cord_prec m1 = (m < cell->r ? m :
-                            //     cell->r) * aM; cell->x -= dx * m1; cell->y -=
-                            //     dy * m1;
-
-                            //     constexpr bool boostCutoff =
-                            //     (T.NEW_BOOST_ALGO ? 0.f : 1.f); const
-                            //     cell_cord_prec modifier = cell->boost.d >
-                            //     boostCutoff ? 1.5f : 1.f;
-
-                            //     cell_cord_prec m2 = (m < r2 ? m : r2) * bM *
-                            //     modifier; other->x += dx * m2; other->y += dy
-                            //     * m2;
-                            // } else {
-                            //     cell_cord_prec m1 = (m < cell->r ? m :
-                            //     cell->r) * aM * T.M1_RELAXATION; cell->x -=
-                            //     dx * m1; cell->y -= dy * m1;
-
-                            //     cell_cord_prec m2 = (m < r2 ? m : r2) * bM *
-                            //     T.M2_RELAXATION; other->x += dx * m2;
-                            //     other->y += dy * m2;
-                            // }
+                    cell_cord_prec a = cell->r * cell->r;
+                    cell_cord_prec b = r2 * r2;
+                    cell_cord_prec sum = a + b;
 
-                        } else {
-                            if (d >= cell->r - r2 / T.EAT_OVERLAP) return;
+                    cell_cord_prec aM = b / sum;
 
-                            cell->r = sqrt(cell->r * cell->r + r2 * r2);
-                            other->eatenByID = cell_id(cell);
+                    cell_cord_prec m1 =
+                        (m < cell->r ? m : cell->r) * aM;
+                    cell->x -= dx * m1;
+                    cell->y -= dy * m1;
 
-                            cell->flag = flags | UPDATE_BIT;
-                            other->flag = otherFlags | REMOVE_BIT;
-                        }
-                    });
-                }
-            }
+                    if constexpr (T.COLLI_RATIO > 1) {
+                        if (cell->r / other->r > T.COLLI_RATIO ||
+                            other->r / cell->r > T.COLLI_RATIO)
+                            return;
+                    }
 
-            total_queries += total;
-            effective_queries += effi;
+                    cell_cord_prec bM = a / sum;
+
+                    cell_cord_prec m2 = (m < r2 ? m : r2) * bM;
+                    other->x += dx * m2;
+                    other->y += dy * m2;
+
+                    // constexpr cell_cord_prec MIN_RELAX =
+                    // T.PLAYER_MIN_EJECT_SIZE * 3.0f; if (instant ||
+                    // cell->r > T.RELAXATION_RATIO_THRESH * r2 || r2 <
+                    // MIN_RELAX) {
+                    //     cell_cord_prec m1 = (m < cell->r ? m :
+                    //     cell->r) * aM; cell->x -= dx * m1; cell->y -=
+                    //     dy * m1;
+
+                    //     constexpr bool boostCutoff =
+                    //     (T.NEW_BOOST_ALGO ? 0.f : 1.f); const
+                    //     cell_cord_prec modifier = cell->boost.d >
+                    //     boostCutoff ? 1.5f : 1.f;
+
+                    //     cell_cord_prec m2 = (m < r2 ? m : r2) * bM *
+                    //     modifier; other->x += dx * m2; other->y += dy
+                    //     * m2;
+                    // } else {
+                    //     cell_cord_prec m1 = (m < cell->r ? m :
+                    //     cell->r) * aM * T.M1_RELAXATION; cell->x -=
+                    //     dx * m1; cell->y -= dy * m1;
+
+                    //     cell_cord_prec m2 = (m < r2 ? m : r2) * bM *
+                    //     T.M2_RELAXATION; other->x += dx * m2;
+                    //     other->y += dy * m2;
+                    // }
 
-            counter_m.lock();
-            for (int i = 0; i < QUERY_LEVEL; i++) {
-                queries.level_counter[i] += local_level_counter[i];
-                queries.level_efficient[i] += local_level_efficient[i];
-            }
-            counter_m.unlock();
-        });
-    }
-    server->threadPool->sync();
-
-    copy = temp;
-    for (uint32_t _ = 0; _ < server->threadPool->size(); _++) {
-        server->threadPool->enqueue([&] {
-            while (true) {
-                Control* c = nullptr;
-                qm.lock();
-                if (!copy.size()) {
-                    qm.unlock();
-                    break;
                 } else {
-                    c = copy.back();
-                    copy.pop_back();
-                    qm.unlock();
-                }
+                    if (d >= cell->r - r2 / T.EAT_OVERLAP) return;
 
-                for (auto cell : c->sorted) {
-                    uint16_t flags = cell->flag;
-                    // Skip resolve bits
-                    if (flags & SKIP_RESOLVE_BITS) continue;
-                    if (flags & UPDATE_BIT) {
-                        cell->updateAABB();
-                        tree->update(cell);
-                    }
+                    cell->r = sqrt(cell->r * cell->r + r2 * r2);
+                    other->eatenByID = cell_id(cell);
+
+                    cell->flag = flags | UPDATE_BIT;
+                    other->flag = otherFlags | REMOVE_BIT;
                 }
+            });
+        }
+    });
+
+    pool->parallel_for_each(temp, [&](Control* c) {
+        const uint32_t lane = pool->slot();
+        for (auto cell : c->sorted) {
+            uint16_t flags = cell->flag;
+            // Skip resolve bits
+            if (flags & SKIP_RESOLVE_BITS) continue;
+            if (flags & UPDATE_BIT) {
+                cell->updateAABB();
+                tree->update(cell, lane);
             }
-        });
-    }
-
-    server->threadPool->sync();
+        }
+    });
+    tree->flush();
 
     timings.physics.phase0 = time_func(t0, t1);
-    queries.phase0_total = total_queries.exchange(0);
-    queries.phase0_effi = effective_queries.exchange(0);
-
-    copy = temp;
-    for (uint32_t i = 0; i < server->threadPool->size(); i++) {
-        server->threadPool->enqueue([&] {
-            uint64_t effi = 0;
-            uint64_t total = 0;
-
-            while (true) {
-                Control* c = nullptr;
-                qm.lock();
-                if (!copy.size()) {
-                    qm.unlock();
-                    break;
-                } else {
-                    c = copy.back();
-                    copy.pop_back();
-                    qm.unlock();
-                }
-
-                // Sort again based on radius
-                c->sorted = c->cells;
-                std::sort(c->sorted.begin(), c->sorted.end(),
-                          [](auto a, auto b) {
-                              // if (a->boost.d != b->boost.d)
-                              //     return a->boost.d > b->boost.d;
-                              // else
-                              return a->r - a->age * 0.1 > b->r - b->age * 0.1;
-                          });
-
-                // uint16_t dualType = 0;
-                // if (c->handle && c->handle->dual && c->handle->dual->control)
-                // dualType = c->handle->dual->control->id;
-                if (!c->handle) continue;
-                if (c->handle->perms & NO_EAT) continue;
-
-                if (c->handle->canEatPerk()) {
-                    // Player eat (WITH perk implemented)
-                    for (auto cell : c->sorted) {
-                        uint16_t type = cell->type;
-
-                        // Skip resolve bits
-                        if (cell->flag & SKIP_RESOLVE_BITS) continue;
-
-                        tree->query(*cell, true, [&](Cell* other, uint32_t) {
-                            total++;
-
-                            uint16_t otherFlags =
-                                other->flag.load(std::memory_order_relaxed);
-
-                            if (otherFlags & SKIP_RESOLVE_BITS) return;
-                            if (cell->r < other->r) return;
-
-                            if (type == other->type) return;
-                            if (!(cell->flag & NOEAT_BIT) &&
-                                (otherFlags & NOEAT_BIT))
-                                return;
-
-                            cell_cord_prec r2 = other->r;
-                            // Basic condition to eat
-                            if (cell->r < r2 * T.EAT_MULT) return;
-
-                            cell_cord_prec dx = other->x - cell->x;
-                            cell_cord_prec dy = other->y - cell->y;
-
-                            cell_cord_prec rSum = cell->r + r2;
-                            cell_cord_prec dSqr = dx * dx + dy * dy;
-
-                            if (!dSqr || dSqr >= rSum * rSum) return;
-
-                            effi++;  // Indeed intersection
-                            cell_cord_prec d = sqrt(dSqr);
-
-                            if (d >= cell->r - r2 / T.EAT_OVERLAP) return;
-                            if (cell->flag & SKIP_RESOLVE_BITS) return;
-                            if (!other->flag.compare_exchange_weak(
-                                    otherFlags,
-                                    uint16_t(otherFlags | REMOVE_BIT),
-                                    std::memory_order_release,
-                                    std::memory_order_relaxed))
-                                return;
-
-                            other->eatenByID = cell_id(cell);
-
-                            if (other->type == EXP_TYPE) {
-                                c->handle->perks.exps += uint16_t(other->data);
-                            } else if (other->type == CYT_TYPE) {
-                                c->handle->perks.cyts += uint16_t(other->data);
-                            } else {
-                                cell->r = sqrt(cell->r * cell->r + r2 * r2);
-                                cell->flag |= UPDATE_BIT;
-                            }
-                        });
+    mergeCounters(queries.phase0_total, queries.phase0_effi);
+
+    pool->parallel_for_each(temp, [&](Control* c) {
+        auto& local = counters[pool->slot()];
+
+        // Sort again based on radius
+        c->sorted = c->cells;
+        std::sort(c->sorted.begin(), c->sorted.end(),
+                  [](auto a, auto b) {
+                      // if (a->boost.d != b->boost.d)
+                      //     return a->boost.d > b->boost.d;
+                      // else
+                      return a->r - a->age * 0.1 > b->r - b->age * 0.1;
+                  });
+
+        // uint16_t dualType = 0;
+        // if (c->handle && c->handle->dual && c->handle->dual->control)
+        // dualType = c->handle->dual->control->id;
+        if (!c->handle) return;
+        if (c->handle->perms & NO_EAT) return;
+
+        if (c->handle->canEatPerk()) {
+            // Player eat (WITH perk implemented)
+            for (auto cell : c->sorted) {
+                uint16_t type = cell->type;
+
+                // Skip resolve bits
+                if (cell->flag & SKIP_RESOLVE_BITS) continue;
+
+                tree->query(*cell, true, [&](Cell* other, uint32_t) {
+                    local.total++;
+
+                    uint16_t otherFlags =
+                        other->flag.load(std::memory_order_relaxed);
+
+                    if (otherFlags & SKIP_RESOLVE_BITS) return;
+                    if (cell->r < other->r) return;
+
+                    if (type == other->type) return;
+                    if (!(cell->flag & NOEAT_BIT) &&
+                        (otherFlags & NOEAT_BIT))
+                        return;
+
+                    cell_cord_prec r2 = other->r;
+                    // Basic condition to eat
+                    if (cell->r < r2 * T.EAT_MULT) return;
+
+                    cell_cord_prec dx = other->x - cell->x;
+                    cell_cord_prec dy = other->y - cell->y;
+
+                    cell_cord_prec rSum = cell->r + r2;
+                    cell_cord_prec dSqr = dx * dx + dy * dy;
+
+                    if (!dSqr || dSqr >= rSum * rSum) return;
+
+                    local.effi++;  // Indeed intersection
+                    cell_cord_prec d = sqrt(dSqr);
+
+                    if (d >= cell->r - r2 / T.EAT_OVERLAP) return;
+                    if (cell->flag & SKIP_RESOLVE_BITS) return;
+                    if (!other->flag.compare_exchange_weak(
+                            otherFlags,
+                            uint16_t(otherFlags | REMOVE_BIT),
+                            std::memory_order_release,
+                            std::memory_order_relaxed))
+                        return;
+
+                    other->eatenByID = cell_id(cell);
+
+                    if (other->type == EXP_TYPE) {
+                        c->handle->perks.exps += uint16_t(other->data);
+                    } else if (other->type == CYT_TYPE) {
+                        c->handle->perks.cyts += uint16_t(other->data);
+                    } else {
+                        cell->r = sqrt(cell->r * cell->r + r2 * r2);
+                        cell->flag |= UPDATE_BIT;
                     }
-                } else {
-                    // Player eat (WITHOUT perk implemented)
-                    for (auto cell : c->sorted) {
-                        uint16_t type = cell->type;
+                });
+            }
+        } else {
+            // Player eat (WITHOUT perk implemented)
+            for (auto cell : c->sorted) {
+                uint16_t type = cell->type;
 
-                        // Skip resolve bits
-                        if (cell->flag & SKIP_RESOLVE_BITS) continue;
+                // Skip resolve bits
+                if (cell->flag & SKIP_RESOLVE_BITS) continue;
 
-                        tree->query(*cell, true, [&](Cell* other, uint32_t) {
-                            total++;
+                tree->query(*cell, true, [&](Cell* other, uint32_t) {
+                    local.total++;
 
-                            uint16_t otherFlags =
-                                other->flag.load(std::memory_order_relaxed);
+                    uint16_t otherFlags =
+                        other->flag.load(std::memory_order_relaxed);
 
-                            if (otherFlags & SKIP_RESOLVE_BITS) return;
-                            if (cell->r < other->r) return;
+                    if (otherFlags & SKIP_RESOLVE_BITS) return;
+                    if (cell->r < other->r) return;
 
-                            if (type == other->type ||
-                                other->type == EXP_TYPE ||
-                                other->type == CYT_TYPE)
-                                return;
-                            if (!(cell->flag & NOEAT_BIT) &&
-                                (otherFlags & NOEAT_BIT))
-                                return;
+                    if (type == other->type ||
+                        other->type == EXP_TYPE ||
+                        other->type == CYT_TYPE)
+                        return;
+                    if (!(cell->flag & NOEAT_BIT) &&
+                        (otherFlags & NOEAT_BIT))
+                        return;
 
-                            cell_cord_prec r2 = other->r;
-                            // Basic condition to eat
-                            if (cell->r < r2 * T.EAT_MULT) return;
+                    cell_cord_prec r2 = other->r;
+                    // Basic condition to eat
+                    if (cell->r < r2 * T.EAT_MULT) return;
 
-                            cell_cord_prec dx = other->x - cell->x;
-                            cell_cord_prec dy = other->y - cell->y;
+                    cell_cord_prec dx = other->x - cell->x;
+                    cell_cord_prec dy = other->y - cell->y;
 
-                            cell_cord_prec rSum = cell->r + r2;
-                            cell_cord_prec dSqr = dx * dx + dy * dy;
+                    cell_cord_prec rSum = cell->r + r2;
+                    cell_cord_prec dSqr = dx * dx + dy * dy;
 
-                            if (!dSqr || dSqr >= rSum * rSum) return;
+                    if (!dSqr || dSqr >= rSum * rSum) return;
 
-                            effi++;
-                            cell_cord_prec d = sqrt(dSqr);
+                    local.effi++;
+                    cell_cord_prec d = sqrt(dSqr);
 
-                            if (d >= cell->r - r2 / T.EAT_OVERLAP) return;
-                            if (cell->flag & SKIP_RESOLVE_BITS) return;
-                            if (!other->flag.compare_exchange_weak(
-                                    otherFlags,
-                                    uint16_t(otherFlags | REMOVE_BIT),
-                                    std::memory_order_release,
-                                    std::memory_order_relaxed))
-                                return;
+                    if (d >= cell->r - r2 / T.EAT_OVERLAP) return;
+                    if (cell->flag & SKIP_RESOLVE_BITS) return;
+                    if (!other->flag.compare_exchange_weak(
+                            otherFlags,
+                            uint16_t(otherFlags | REMOVE_BIT),
+                            std::memory_order_release,
+                            std::memory_order_relaxed))
+                        return;
 
-                            other->eatenByID = cell_id(cell);
+                    other->eatenByID = cell_id(cell);
 
-                            cell->r = sqrt(cell->r * cell->r + r2 * r2);
-                            cell->flag |= UPDATE_BIT;
-                        });
-                    }
-                }
+                    cell->r = sqrt(cell->r * cell->r + r2 * r2);
+                    cell->flag |= UPDATE_BIT;
+                });
             }
-
-            total_queries += total;
-            effective_queries += effi;
-        });
-    }
-    server->threadPool->sync();
+        }
+    });
     timings.physics.phase1 = time_func(t1, t2);
-    queries.phase1_total = total_queries.exchange(0);
-    queries.phase1_effi = effective_queries.exchange(0);
+    mergeCounters(queries.phase1_total, queries.phase1_effi);
 
     // Dead cell collision resolve
     for (auto cell : deadCells) {
@@ -1639,267 +1647,239 @@ void TemplateEngine<T>::resolve(float dt) {
     timings.physics.phase2 = time_func(t2, t3);
 
     // Player cell to ejected cells and virus
-    copy = temp;
-    for (uint32_t i = 0; i < server->threadPool->size(); i++) {
-        server->threadPool->enqueue([&] {
-            while (true) {
-                Control* c = nullptr;
-                qm.lock();
-                if (!copy.size()) {
-                    qm.unlock();
-                    break;
-                } else {
-                    c = copy.back();
-                    copy.pop_back();
-                    qm.unlock();
-                }
+    pool->parallel_for_each(temp, [&](Control* c) {
+        if (!c->handle) return;
+        bool skipOthers = c->handle->perms & NO_EAT;
+
+        c->sorted = c->cells;
+        std::sort(c->sorted.begin(), c->sorted.end(),
+                  [](auto a, auto b) {
+                      // if (a->boost.d != b->boost.d)
+                      //     return a->boost.d > b->boost.d;
+                      // else
+                      return a->age < b->age;
+                  });
+
+        for (auto cell : c->sorted) {
+            uint16_t flags = cell->flag;
+            uint16_t type = cell->type;
+            // Skip resolve bits
+            if (flags & SKIP_RESOLVE_BITS) continue;
 
-                if (!c->handle) return;
-                bool skipOthers = c->handle->perms & NO_EAT;
-
-                c->sorted = c->cells;
-                std::sort(c->sorted.begin(), c->sorted.end(),
-                          [](auto a, auto b) {
-                              // if (a->boost.d != b->boost.d)
-                              //     return a->boost.d > b->boost.d;
-                              // else
-                              return a->age < b->age;
-                          });
-
-                for (auto cell : c->sorted) {
-                    uint16_t flags = cell->flag;
-                    uint16_t type = cell->type;
-                    // Skip resolve bits
-                    if (flags & SKIP_RESOLVE_BITS) continue;
-
-                    bool escape = false;
-
-                    auto cid = cell_id(cell);
-                    auto& cell_boost = boosts[cid];
-
-                    Grid_EV.query(
-                        cell->shared.aabb,
-                        [&](Cell* other) {
-                            if (skipOthers &&
-                                type != (other->type & PELLET_TYPE))
-                                return;
-                            auto otherFlags =
-                                other->flag.load(std::memory_order_relaxed);
-                            if (otherFlags & REMOVE_BIT) return;
-                            cell_cord_prec r2 = other->r;
-                            cell_cord_prec dx = other->x - cell->x;
-                            cell_cord_prec dy = other->y - cell->y;
-                            cell_cord_prec d = sqrt(dx * dx + dy * dy);
-                            if ((cell->r > r2 * T.EAT_MULT) &&
-                                (d < cell->r - r2 / T.EAT_OVERLAP)) {
-                                cell->r = sqrt(cell->r * cell->r + r2 * r2);
-
-                                if (!other->flag.compare_exchange_weak(
-                                        otherFlags,
-                                        uint16_t(otherFlags | REMOVE_BIT),
-                                        std::memory_order_release,
-                                        std::memory_order_relaxed)) {
-                                    escape = true;
-                                    return;
-                                }
+            bool escape = false;
+
+            auto cid = cell_id(cell);
+            auto& cell_boost = boosts[cid];
+
+            Grid_EV.query(
+                cell->shared.aabb,
+                [&](Cell* other) {
+                    if (skipOthers &&
+                        type != (other->type & PELLET_TYPE))
+                        return;
+                    auto otherFlags =
+                        other->flag.load(std::memory_order_relaxed);
+                    if (otherFlags & REMOVE_BIT) return;
+                    cell_cord_prec r2 = other->r;
+                    cell_cord_prec dx = other->x - cell->x;
+                    cell_cord_prec dy = other->y - cell->y;
+                    cell_cord_prec d = sqrt(dx * dx + dy * dy);
+                    if ((cell->r > r2 * T.EAT_MULT) &&
+                        (d < cell->r - r2 / T.EAT_OVERLAP)) {
+                        cell->r = sqrt(cell->r * cell->r + r2 * r2);
+
+                        if (!other->flag.compare_exchange_weak(
+                                otherFlags,
+                                uint16_t(otherFlags | REMOVE_BIT),
+                                std::memory_order_release,
+                                std::memory_order_relaxed)) {
+                            escape = true;
+                            return;
+                        }
+
+                        if (other->type == VIRUS_TYPE) {
+                            constexpr uint16_t t = UPDATE_BIT | POP_BIT;
+                            cell->flag |= t;
+                            escape = true;
+                        } else {
+                            auto oid = cell_id(other);
+                            auto other_boost = boosts[oid];
+
+                            // Boost player cell
+                            if constexpr (T.NEW_BOOST_ALGO) {
+                                if (cell_boost.d <=
+                                    T.PLAYER_MAX_BOOST) {
+                                    cell_boost.x *= cell_boost.d;
+                                    cell_boost.y *= cell_boost.d;
+
+                                    auto& x0 = cell_boost.x;
+                                    auto& y0 = cell_boost.y;
 
-                                if (other->type == VIRUS_TYPE) {
-                                    constexpr uint16_t t = UPDATE_BIT | POP_BIT;
-                                    cell->flag |= t;
-                                    escape = true;
-                                } else {
-                                    auto oid = cell_id(other);
-                                    auto other_boost = boosts[oid];
-
-                                    // Boost player cell
-                                    if constexpr (T.NEW_BOOST_ALGO) {
-                                        if (cell_boost.d <=
-                                            T.PLAYER_MAX_BOOST) {
-                                            cell_boost.x *= cell_boost.d;
-                                            cell_boost.y *= cell_boost.d;
-
-                                            auto& x0 = cell_boost.x;
-                                            auto& y0 = cell_boost.y;
-
-                                            auto& x1 = other_boost.x;
-                                            auto& y1 = other_boost.y;
-
-                                            auto dot = x1 * x0 + y1 * y0;
-                                            auto mag_sq = x0 * x0 + y0 * y0;
-                                            auto proj = dot / mag_sq;
-
-                                            x0 *= (1 + proj * T.BOOST_AMOUNT);
-                                            y0 *= (1 + proj * T.BOOST_AMOUNT);
-
-                                            // cell_boost.x +=
-                                            //     other_boost.x *
-                                            //     T.BOOST_AMOUNT;
-                                            // cell_boost.y +=
-                                            //     other_boost.y *
-                                            //     T.BOOST_AMOUNT;
-
-                                            cell_boost.normalize();
-                                        }
-                                    } else {
-                                        cell_cord_prec ratio =
-                                            other->r / (cell->r + 100.f);
-                                        cell_boost.d +=
-                                            ratio * 0.025f * other_boost.d;
-                                        if (cell_boost.d >= T.PLAYER_MAX_BOOST)
-                                            cell_boost.d = T.PLAYER_MAX_BOOST;
-
-                                        cell_cord_prec bx =
-                                            cell_boost.x +
-                                            ratio * 0.02f * other_boost.x;
-                                        cell_cord_prec by =
-                                            cell_boost.y +
-                                            ratio * 0.02f * other_boost.y;
-                                        cell_cord_prec norm =
-                                            1.f / sqrtf(bx * bx + by * by);
-                                        cell_boost.x = bx * norm;
-                                        cell_boost.y = by * norm;
-                                    }
-
-                                    cell->flag |= UPDATE_BIT;
-                                    other->eatenByID = cell_id(cell);
+                                    auto& x1 = other_boost.x;
+                                    auto& y1 = other_boost.y;
+
+                                    auto dot = x1 * x0 + y1 * y0;
+                                    auto mag_sq = x0 * x0 + y0 * y0;
+                                    auto proj = dot / mag_sq;
+
+                                    x0 *= (1 + proj * T.BOOST_AMOUNT);
+                                    y0 *= (1 + proj * T.BOOST_AMOUNT);
+
+                                    // cell_boost.x +=
+                                    //     other_boost.x *
+                                    //     T.BOOST_AMOUNT;
+                                    // cell_boost.y +=
+                                    //     other_boost.y *
+                                    //     T.BOOST_AMOUNT;
+
+                                    cell_boost.normalize();
                                 }
+                            } else {
+                                cell_cord_prec ratio =
+                                    other->r / (cell->r + 100.f);
+                                cell_boost.d +=
+                                    ratio * 0.025f * other_boost.d;
+                                if (cell_boost.d >= T.PLAYER_MAX_BOOST)
+                                    cell_boost.d = T.PLAYER_MAX_BOOST;
+
+                                cell_cord_prec bx =
+                                    cell_boost.x +
+                                    ratio * 0.02f * other_boost.x;
+                                cell_cord_prec by =
+                                    cell_boost.y +
+                                    ratio * 0.02f * other_boost.y;
+                                cell_cord_prec norm =
+                                    1.f / sqrtf(bx * bx + by * by);
+                                cell_boost.x = bx * norm;
+                                cell_boost.y = by * norm;
                             }
-                        },
-                        escape);
-                }
-            }
-        });
-    }
-    server->threadPool->sync();
+
+                            cell->flag |= UPDATE_BIT;
+                            other->eatenByID = cell_id(cell);
+                        }
+                    }
+                },
+                escape);
+        }
+    });
     timings.physics.phase3 = time_func(t3, t4);
 
     mutex removing;
 
     // Player-Pellets
-    copy = temp;
-    for (uint32_t _ = 0; _ < server->threadPool->size(); _++) {
-        server->threadPool->enqueue([&] {
-            while (true) {
-                Control* c = nullptr;
-                qm.lock();
-                if (!copy.size()) {
-                    qm.unlock();
-                    break;
-                } else {
-                    c = copy.back();
-                    copy.pop_back();
-                    qm.unlock();
-                }
-                if (!c->overwrites.canEatPellet) continue;
-
-                for (auto cell : c->sorted) {
-                    uint16_t flags = cell->flag;
-                    // Skip resolve bits
-                    if (flags & SKIP_RESOLVE_BITS) continue;
-                    cell_cord_prec x = cell->x;
-                    cell_cord_prec y = cell->y;
-                    cell_cord_prec r = cell->r;
-                    bool escape = false;
-                    Grid_PL.query(
-                        cell->shared.aabb,
-                        [&](Cell* pellet) {
-                            if (pellet->flag & REMOVE_BIT) return;
-                            cell_cord_prec r2 = pellet->r;
-                            cell_cord_prec dx = pellet->x - x;
-                            cell_cord_prec dy = pellet->y - y;
-                            cell_cord_prec d = sqrt(dx * dx + dy * dy);
-                            if ((r > r2 * T.EAT_MULT) &&
-                                (d < r - r2 / T.EAT_OVERLAP)) {
-                                r = sqrtf(r * r + r2 * r2);
-                                pellet->eatenByID = cell_id(cell);
-
-                                cell->flag |= UPDATE_BIT;
-                                pellet->flag |= REMOVE_BIT;
-
-                                removing.lock();
-                                removedCells.push_back(pellet);
-                                removing.unlock();
-                            }
-                        },
-                        escape);
-                    cell->r = r;
-                }
+    pool->parallel_for_each(temp, [&](Control* c) {
+        if (!c->overwrites.canEatPellet) return;
+
+        for (auto cell : c->sorted) {
+            uint16_t flags = cell->flag;
+            // Skip resolve bits
+            if (flags & SKIP_RESOLVE_BITS) continue;
+            cell_cord_prec x = cell->x;
+            cell_cord_prec y = cell->y;
+            cell_cord_prec r = cell->r;
+            bool escape = false;
+
+            auto eat = [&](Cell* pellet) {
+                // Another thread could be eating the same pellet
+                if (pellet->flag.fetch_or(REMOVE_BIT) & REMOVE_BIT) return;
+
+                cell_cord_prec r2 = pellet->r;
+                r = sqrtf(r * r + r2 * r2);
+                pellet->eatenByID = cell_id(cell);
+
+                cell->flag |= UPDATE_BIT;
+
+                removing.lock();
+                removedCells.push_back(pellet);
+                removing.unlock();
+            };
+
+            if constexpr (T.GRID_PL_SOA) {
+                // r only grows between batches, a pellet that got in reach
+                // halfway through a batch is eaten next tick
+                Grid_PL.queryBatch(
+                    cell->shared.aabb,
+                    [&](const cord_prec* px, const cord_prec* py,
+                        const cord_prec* pr, uint32_t n) {
+                        return simd::eatMask<cord_prec>(
+                            px, py, pr, n, x, y, r, T.EAT_MULT, T.EAT_OVERLAP);
+                    },
+                    eat, escape);
+            } else {
+                Grid_PL.query(
+                    cell->shared.aabb,
+                    [&](cell_cord_prec px, cell_cord_prec py, cell_cord_prec r2) {
+                        cell_cord_prec dx = px - x;
+                        cell_cord_prec dy = py - y;
+                        // d < r - r2 / EAT_OVERLAP, rhs is positive if r is
+                        // big enough to eat
+                        cell_cord_prec reach = r - r2 / T.EAT_OVERLAP;
+                        return (r > r2 * T.EAT_MULT) &&
+                               (dx * dx + dy * dy < reach * reach);
+                    },
+                    eat, escape);
             }
-        });
-    }
-    server->threadPool->sync();
+            cell->r = r;
+        }
+    });
     timings.physics.phase4 = time_func(t4, t5);
 
     // Remove player cells & update
-    copy = temp;
-    for (uint32_t i = 0; i < server->threadPool->size(); i++) {
-        server->threadPool->enqueue([&] {
-            uint32_t removeCount = 0;
-            while (true) {
-                Control* c = nullptr;
-                qm.lock();
-                if (!copy.size()) {
-                    qm.unlock();
-                    break;
-                } else {
-                    c = copy.back();
-                    copy.pop_back();
-                    qm.unlock();
-                }
-                for (auto cell : c->sorted) {
-                    uint16_t f = cell->flag;
-                    if (f & REMOVE_BIT) {
-                        removeCount++;
-                        continue;
-                    } else if (f & POP_BIT) {
-                        const bool noPop =
-                            (c->handle && c->handle->perms & NO_POP) ||
-                            c->overwrites.cells == 1;
-                        auto maxCells = c->overwrites.cells;
-                        if (maxCells <= 0) maxCells = T.PLAYER_MAX_CELLS;
-
-                        if (!noPop) {
-                            distributeMass<T>(maxCells - c->cells.size(),
-                                              cell->r * cell->r * 0.01f,
-                                              [&](cell_cord_prec mass) {
-                                                  cell_cord_prec angle =
-                                                      rngAngle();
-                                                  auto n = splitFromCell(
-                                                      cell, sqrtf(mass * 100),
-                                                      {sinf(angle), cosf(angle),
-                                                       T.PLAYER_SPLIT_BOOST});
-                                                  c->cells.push_back(n);
-                                              });
-                            c->lastPopped = __now;
-                        }
-                    }
-                    if (cell->flag & LOCK_BIT) {
-                        cell_cord_prec x0 = cell->x;
-                        cell_cord_prec y0 = cell->y;
-                        cell_cord_prec aL = c->linearEquation[0];
-                        cell_cord_prec bL = c->linearEquation[1];
-                        cell_cord_prec cL = c->linearEquation[2];
-                        cell->x = (bL * (bL * x0 - aL * y0) - aL * cL) *
-                                  c->abSqrSumInvL;
-                        cell->y = (aL * (-bL * x0 + aL * y0) - bL * cL) *
-                                  c->abSqrSumInvL;
-                    }
-                    tree->update(cell);
+    pool->parallel_for_each(temp, [&](Control* c) {
+        const uint32_t lane = pool->slot();
+        uint32_t removeCount = 0;
+        for (auto cell : c->sorted) {
+            uint16_t f = cell->flag;
+            if (f & REMOVE_BIT) {
+                removeCount++;
+                continue;
+            } else if (f & POP_BIT) {
+                const bool noPop =
+                    (c->handle && c->handle->perms & NO_POP) ||
+                    c->overwrites.cells == 1;
+                auto maxCells = c->overwrites.cells;
+                if (maxCells <= 0) maxCells = T.PLAYER_MAX_CELLS;
+
+                if (!noPop) {
+                    distributeMass<T>(maxCells - c->cells.size(),
+                                      cell->r * cell->r * 0.01f,
+                                      [&](cell_cord_prec mass) {
+                                          cell_cord_prec angle =
+                                              rngAngle();
+                                          auto n = splitFromCell(
+                                              cell, sqrtf(mass * 100),
+                                              {sinf(angle), cosf(angle),
+                                               T.PLAYER_SPLIT_BOOST});
+                                          c->cells.push_back(n);
+                                      });
+                    c->lastPopped = __now;
                 }
             }
-            cellCount -= removeCount;
-        });
-    }
-    server->threadPool->sync();
+            if (cell->flag & LOCK_BIT) {
+                cell_cord_prec x0 = cell->x;
+                cell_cord_prec y0 = cell->y;
+                cell_cord_prec aL = c->linearEquation[0];
+                cell_cord_prec bL = c->linearEquation[1];
+                cell_cord_prec cL = c->linearEquation[2];
+                cell->x = (bL * (bL * x0 - aL * y0) - aL * cL) *
+                          c->abSqrSumInvL;
+                cell->y = (aL * (-bL * x0 + aL * y0) - bL * cL) *
+                          c->abSqrSumInvL;
+            }
+            tree->update(cell, lane);
+        }
+        if (removeCount) cellCount -= removeCount;
+    });
 
     for (auto& cell : deadCells) {
         if (cell->flag & REMOVE_BIT) {
             // tree->remove(cell);
             cellCount--;
         } else if (cell->flag & UPDATE_BIT) {
-            tree->update(cell);
+            tree->update(cell, pool->slot());
         }
     }
+    tree->flush();
 
     // Linear filter to remove cells from list
     for (auto c : temp) {
@@ -2339,31 +2319,14 @@ BoolPoint TemplateEngine<T>::getSafeSpawnFromInflu(cell_cord_prec size,
 
 template <OPT const& T>
 Cell& TemplateEngine<T>::newCell() {
-    cell_id_t id;
-    uint32_t attempts = 0;
-
-    while (true) {
-        id = __next_cell_id.load();
-        while (pool[id].flag.load() & EXIST_BIT) {
-            id++;
-            if (id >= T.CELL_LIMIT) id = 0;
-        }
-
-        uint16_t none = 0;
-        uint16_t exist = 1;
-
-        if (pool[id].flag.compare_exchange_weak(none, exist,
-                                                std::memory_order_release,
-                                                std::memory_order_relaxed)) {
-            __next_cell_id.store(id);
-            break;
-        }
+    cell_id_t id = allocator.alloc(server->threadPool->slot());
 
-        if (++attempts > T.CELL_LIMIT) {
-            abort();
-        }
+    if (id == CellAllocator::NONE) {
+        logger::error("Cell pool is full (%u cells)\n", T.CELL_LIMIT);
+        abort();
     }
 
+    pool[id].flag.store(EXIST_BIT, std::memory_order_release);
     cellCount++;
 
     Cell& cell = pool[id];
@@ -2373,6 +2336,13 @@ Cell& TemplateEngine<T>::newCell() {
     return cell;
 }
 
+template <OPT const& T>
+void TemplateEngine<T>::freeCell(Cell* cell) {
+    auto id = cell_id(cell);
+    memset(cell, 0, sizeof(Cell));
+    allocator.release(id, server->threadPool->slot());
+}
+
 template <OPT const& T>
 Cell* TemplateEngine<T>::splitFromCell(Cell* cell, cell_cord_prec size,
                                        Boost boost) {
@@ -2402,6 +2372,10 @@ template <OPT const& T>
 void TemplateEngine<T>::syncState() {
     restart(false);
 
+    // Sort the cells out first, the grids and the tree are filled after
+    vector<Cell*> gridCells;
+    vector<Cell*> treeCells;
+
     for (int i = 0; i < T.CELL_LIMIT; i++) {
         Cell& cell = pool[i];
 
@@ -2415,22 +2389,22 @@ void TemplateEngine<T>::syncState() {
 
         if (cell.type == CYT_TYPE) {
             cyts.push_back(&cell);
-            tree->insert(&cell);
+            treeCells.push_back(&cell);
         } else if (cell.type == EXP_TYPE) {
             exps.push_back(&cell);
-            tree->insert(&cell);
+            treeCells.push_back(&cell);
         } else if (cell.type == DEAD_TYPE) {
             deadCells.push_back(&cell);
             cell.updateAABB();
-            tree->insert(&cell);
+            treeCells.push_back(&cell);
         } else if (cell.type == VIRUS_TYPE) {
             viruses.push_back(&cell);
-            Grid_EV.insert(cell);
+            gridCells.push_back(&cell);
         } else if (cell.type & EJECT_BIT) {
             ejected.push_back(&cell);
-            Grid_EV.insert(cell);
+            gridCells.push_back(&cell);
         } else if (cell.type == PELLET_TYPE) {
-            Grid_PL.insert(cell);
+            gridCells.push_back(&cell);
         } else {
             // Player cell
             auto iter = controls.find(cell.type);
@@ -2441,10 +2415,29 @@ void TemplateEngine<T>::syncState() {
                 iter->second->cells.push_back(&cell);
             }
             cell.updateAABB();
-            tree->insert(&cell);
+            treeCells.push_back(&cell);
         }
     }
 
+    // Grid inserts lock their buckets, the tree is built on this thread
+    // meanwhile
+    server->threadPool->parallel_for(
+        gridCells.size(),
+        [&](size_t i) {
+            Cell& cell = *gridCells[i];
+            if (cell.type == PELLET_TYPE)
+                Grid_PL.insert(cell);
+            else
+                Grid_EV.insert(cell);
+        },
+        256,
+        [&] {
+            for (auto cell : treeCells) tree->insert(cell);
+        });
+
+    // Funky cells were cleared after restart freed every id
+    allocator.reset(pool);
+
     for (auto [_, c] : controls) {
         c->calculateViewport();
     }
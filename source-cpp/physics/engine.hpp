@@ -7,9 +7,6 @@
 #include <unordered_set>
 #include <vector>
 
-#define NOMINMAX
-#include <uv.h>
-
 using std::function;
 using std::list;
 using std::pair;
@@ -21,6 +18,7 @@ using std::vector;
 #include <mutex>
 
 #include "../modes/options.hpp"
+#include "allocator.hpp"
 #include "cell.hpp"
 #include "grid.hpp"
 #include "quadtree.hpp"
@@ -117,7 +115,7 @@ struct Engine {
 
     LooseQuadTree<0.25f>* tree;
 
-    atomic<uint32_t> __next_cell_id;
+    CellAllocator allocator;
     atomic<uint32_t> cellCount;
 
     // All kinds of cells
@@ -132,11 +130,15 @@ struct Engine {
     vector<pair<Control*, bool>> killArray;
     unordered_set<Control*> spawnSet;
 
-    GameHandle* biggest;
+    GameHandle* biggest = nullptr;
     list<GameHandle*> handles;
 
     size_t desiredBots = 0;
     bool alwaysSpawnBot = false;
+    // Set by populate: ejected cells only get what's left of the pool once
+    // every bot could split to PLAYER_MAX_CELLS and pellets, viruses and
+    // perks are back to full
+    bool boundEjects = false;
     list<Bot*> bots;
     unordered_map<uint16_t, Control*> controls;
     vector<Control*> aliveControls;
@@ -176,6 +178,9 @@ struct Engine {
     virtual void spawnPlayers(){};
     virtual void virus(cell_cord_prec x, cell_cord_prec y){};
 
+    // Fill the world with bots that already have cells, for benchmarking
+    virtual void populate(uint32_t botCount, uint32_t cellsPerBot){};
+
     virtual void handleIO(float dt){};
     virtual void removeCells(){};
     virtual void updateCells(float dt){};
@@ -237,6 +242,14 @@ struct Engine {
     virtual void queryGridEV(AABB& aabb,
                              const std::function<void(Cell*)> func){};
 
+    // Incremental pellet query, see Grid::mark and Grid::queryChanged
+    virtual uint32_t markGridPL() { return 0; };
+    virtual GridRange queryGridPLChanged(AABB& aabb, GridRange& last,
+                                         uint32_t since,
+                                         const std::function<void(Cell*)> func) {
+        return {0, -1, 0, -1};
+    };
+
     template <typename QueryFunc>
     inline void queryTree(AABB& aabb, const QueryFunc& func) {
         tree->query(aabb, func);
@@ -254,8 +267,12 @@ struct TemplateEngine : Engine {
         return randomAngle(generator);
     }
 
+    // Precision of the pellet grid mirrors, cells themselves are always
+    // cell_cord_prec since they're shared with the untemplated game code
+    typedef std::conditional_t<T.FLOAT_CORD_PREC, float, cell_cord_prec> cord_prec;
+
     // Templated data structures
-    Grid<T.GRID_PL_SIZE> Grid_PL;
+    Grid<T.GRID_PL_SIZE, T.GRID_PL_SOA, cord_prec> Grid_PL;
     Grid<T.GRID_EV_SIZE> Grid_EV;
 
     Rect map = Rect(0, 0, T.MAP_HW, T.MAP_HH);
@@ -270,6 +287,8 @@ struct TemplateEngine : Engine {
     };
 
     Cell& newCell();
+    // Clears the cell and gives its id back, thread safe
+    void freeCell(Cell* cell);
 
     const char* mode() { return T.MODE; };
     const float getTimeScale() { return T.TIME_SCALE; };
@@ -314,6 +333,8 @@ struct TemplateEngine : Engine {
     virtual bool spawnBotControl(Control*& c);
     virtual bool spawnPlayerControl(Control*& c);
 
+    virtual void populate(uint32_t botCount, uint32_t cellsPerBot);
+
     void kill(Control* control, bool replace);
 
     inline Point randomPoint(cell_cord_prec size,
@@ -349,6 +370,14 @@ struct TemplateEngine : Engine {
         Grid_EV.query(aabb, func, escape);
     }
 
+    virtual uint32_t markGridPL() override { return Grid_PL.mark(); }
+
+    virtual GridRange queryGridPLChanged(
+        AABB& aabb, GridRange& last, uint32_t since,
+        const std::function<void(Cell*)> func) override {
+        return Grid_PL.queryChanged(aabb, last, since, func);
+    }
+
     void gc() {
         Grid_PL.gc();
         Grid_EV.gc();
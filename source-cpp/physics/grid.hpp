@@ -7,24 +7,166 @@
 #include <vector>
 #include <algorithm>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <type_traits>
 
 #include "cell.hpp"
+#include "simd.hpp"
 #include "../misc/logger.hpp"
 
 using std::vector;
 using std::mutex;
+using std::atomic;
+using std::atomic_flag;
 
 #define int32_floor(arg) int32_t(floor(arg))
 
-template<int32_t Dim>
+// Plain bucket, just the cells
+struct CellBucket {
+    vector<Cell*> items;
+
+    inline uint32_t size() { return items.size(); }
+    inline Cell** cells() { return items.data(); }
+
+    inline void push(Cell* cell) { items.push_back(cell); }
+
+    // Swap remove
+    inline void erase(Cell* cell) {
+        auto iter = std::find(items.begin(), items.end(), cell);
+        if (iter == items.end()) return;
+        *iter = items.back();
+        items.pop_back();
+    }
+
+    inline void refresh(Cell* cell) {}
+
+    inline void clear() {
+        items.clear();
+        items.shrink_to_fit();
+    }
+
+    inline void gc() { items.shrink_to_fit(); }
+};
+
+// Bucket that also keeps x/y/r of its cells in contiguous arrays, so the
+// narrow phase streams them instead of touching a cache line per cell. All
+// arrays share one block: [cells][x][y][r], each capacity long. P is the
+// precision of the copies.
+template <typename P>
+struct SoABucket {
+    static constexpr size_t STRIDE = sizeof(Cell*) + 3 * sizeof(P);
+
+    uint8_t* block = nullptr;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+
+    ~SoABucket() { free(block); }
+
+    inline uint32_t size() { return count; }
+    inline Cell** cells() { return (Cell**) block; }
+    inline P* x() { return (P*) (block + capacity * sizeof(Cell*)); }
+    inline P* y() { return x() + capacity; }
+    inline P* r() { return y() + capacity; }
+
+    void reserve(uint32_t n) {
+        auto next = (uint8_t*) (n ? malloc(n * STRIDE) : nullptr);
+        if (count) {
+            auto nx = (P*) (next + n * sizeof(Cell*));
+            memcpy(next, cells(), count * sizeof(Cell*));
+            memcpy(nx, x(), count * sizeof(P));
+            memcpy(nx + n, y(), count * sizeof(P));
+            memcpy(nx + 2 * n, r(), count * sizeof(P));
+        }
+        free(block);
+        block = next;
+        capacity = n;
+    }
+
+    inline void push(Cell* cell) {
+        if (count == capacity) reserve(capacity ? capacity * 2 : 4);
+        cells()[count] = cell;
+        x()[count] = cell->x;
+        y()[count] = cell->y;
+        r()[count] = cell->r;
+        count++;
+    }
+
+    inline int32_t indexOf(Cell* cell) {
+        auto c = cells();
+        for (uint32_t i = 0; i < count; i++)
+            if (c[i] == cell) return i;
+        return -1;
+    }
+
+    inline void erase(Cell* cell) {
+        auto i = indexOf(cell);
+        if (i < 0) return;
+
+        // Swap remove
+        count--;
+        cells()[i] = cells()[count];
+        x()[i] = x()[count];
+        y()[i] = y()[count];
+        r()[i] = r()[count];
+    }
+
+    inline void refresh(Cell* cell) {
+        auto i = indexOf(cell);
+        if (i < 0) return;
+        x()[i] = cell->x;
+        y()[i] = cell->y;
+        r()[i] = cell->r;
+    }
+
+    inline void clear() {
+        count = 0;
+        reserve(0);
+    }
+
+    inline void gc() { reserve(count); }
+};
+
+// SoA: buckets mirror x/y/r of their cells in P (see SoABucket). Only valid if
+// x/y/r of the cells never change without going through update.
+template<int32_t Dim, bool SoA = false, typename P = cell_cord_prec>
 class Grid {
 
+    typedef std::conditional_t<SoA, SoABucket<P>, CellBucket> Bucket;
+
     AABB aabb;
     float xBinSize, yBinSize;
 
     // Massive memory block
-    vector<Cell*> buckets[Dim][Dim];
-    mutex m[Dim][Dim];
+    Bucket buckets[Dim][Dim];
+    // Taken while the bucket is modified, queries don't need it. One byte
+    // instead of a 40 byte std::mutex per bucket
+    atomic_flag locks[Dim][Dim];
+    // Value of clock when the cells of the bucket last changed
+    uint32_t stamps[Dim][Dim] = {};
+    // Advanced by mark, never reset
+    atomic<uint32_t> clock;
+
+    struct Move {
+        Cell* cell;
+        GridRange from;
+        GridRange to;
+    };
+
+    // Moves staged by stage, one lane per thread and in it one list per band
+    // of bucket columns the move touches, see flush
+    vector<vector<vector<Move>>> lanes;
+    uint32_t bands = 1;
+
+    inline void lock(int32_t i, int32_t j) {
+        while (locks[i][j].test_and_set(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+
+    inline void unlock(int32_t i, int32_t j) { locks[i][j].clear(std::memory_order_release); }
+
+    inline void touch(int32_t i, int32_t j) { stamps[i][j] = clock.load(std::memory_order_relaxed); }
 
     template<typename T>
     GridRange fromAABB(TAABB<T>& box) {
@@ -38,9 +180,33 @@ class Grid {
         return rg;
     }
 
+    inline GridRange rangeOf(Cell& cell) {
+        GridRange rg;
+
+        rg.l = std::max(int32_floor(((cell.x - cell.r) - aabb.l) / xBinSize), 0);
+        rg.r = std::min(int32_floor(((cell.x + cell.r) - aabb.l) / xBinSize), Dim - 1);
+        rg.t = std::max(int32_floor((aabb.t - (cell.y + cell.r)) / yBinSize), 0);
+        rg.b = std::min(int32_floor((aabb.t - (cell.y - cell.r)) / yBinSize), Dim - 1);
+
+        return rg;
+    }
+
+    // Band of bucket column i, the inverse of the bounds in flush
+    inline uint32_t bandOf(int32_t i) {
+        i = std::clamp(i, 0, Dim - 1);
+        return uint32_t((int64_t(i + 1) * bands - 1) / Dim);
+    }
+
+    // Into every band the old or the new range of the move reaches
+    inline void push(vector<vector<Move>>& lane, const Move& m) {
+        const uint32_t first = bandOf(std::min(m.from.l, m.to.l));
+        const uint32_t last = bandOf(std::max(m.from.r, m.to.r));
+        for (uint32_t band = first; band <= last; band++) lane[band].push_back(m);
+    }
+
 public:
     atomic<int32_t> count;
-    Grid(Rect rect) : count(0), aabb(rect.toAABB()) {
+    Grid(Rect rect) : count(0), aabb(rect.toAABB()), clock(1) {
         xBinSize = rect.hw * 2 / Dim;
         yBinSize = rect.hh * 2 / Dim;
     };
@@ -49,17 +215,14 @@ public:
 
     inline void insert(Cell& cell) {
         GridRange& itemRange = cell.shared.range;
+        itemRange = rangeOf(cell);
 
-        itemRange.l = std::max(int32_floor(((cell.x - cell.r) - aabb.l) / xBinSize), 0);
-        itemRange.r = std::min(int32_floor(((cell.x + cell.r) - aabb.l) / xBinSize), Dim - 1);
-        itemRange.t = std::max(int32_floor((aabb.t - (cell.y + cell.r)) / yBinSize), 0);
-        itemRange.b = std::min(int32_floor((aabb.t - (cell.y - cell.r)) / yBinSize), Dim - 1);
-        
         for (int32_t i = itemRange.l; i <= itemRange.r; i++) {
             for (int32_t j = itemRange.t; j <= itemRange.b; j++) {
-                m[i][j].lock();
-                buckets[i][j].push_back(&cell);
-                m[i][j].unlock();
+                lock(i, j);
+                buckets[i][j].push(&cell);
+                touch(i, j);
+                unlock(i, j);
             }
         }
 
@@ -71,11 +234,10 @@ public:
 
         for (int32_t i = itemRange.l; i <= itemRange.r; i++) {
             for (int32_t j = itemRange.t; j <= itemRange.b; j++) {
-                auto& bucket = buckets[i][j];
-                m[i][j].lock();
-                auto iter = std::find(bucket.begin(), bucket.end(), &cell);
-                if (iter != bucket.end()) bucket.erase(iter);
-                m[i][j].unlock();
+                lock(i, j);
+                buckets[i][j].erase(&cell);
+                touch(i, j);
+                unlock(i, j);
             }
         }
         
@@ -84,18 +246,21 @@ public:
 
     inline bool update(Cell& cell) {
         GridRange& oldRange = cell.shared.range;
-        GridRange newRange;
-        
-        newRange.l = std::max(int32_floor(((cell.x - cell.r) - aabb.l) / xBinSize), 0);
-        newRange.r = std::min(int32_floor(((cell.x + cell.r) - aabb.l) / xBinSize), Dim - 1);
-        newRange.t = std::max(int32_floor((aabb.t - (cell.y + cell.r)) / yBinSize), 0);
-        newRange.b = std::min(int32_floor((aabb.t - (cell.y - cell.r)) / yBinSize), Dim - 1);
+        GridRange newRange = rangeOf(cell);
 
         // Same bucket, no need to update
-        if (newRange.l == oldRange.l &&
-            newRange.r == oldRange.r &&
-            newRange.t == oldRange.t &&
-            newRange.b == oldRange.b) return false;
+        if (newRange == oldRange) {
+            if constexpr (SoA) {
+                for (int32_t i = oldRange.l; i <= oldRange.r; i++) {
+                    for (int32_t j = oldRange.t; j <= oldRange.b; j++) {
+                        lock(i, j);
+                        buckets[i][j].refresh(&cell);
+                        unlock(i, j);
+                    }
+                }
+            }
+            return false;
+        }
 
         remove(cell);
         insert(cell);
@@ -103,6 +268,90 @@ public:
         return true;
     }
 
+    // Lanes for stage, one per thread that calls it, and the number of parts
+    // the next flush is split in. Not thread safe, nothing can be staged
+    inline void reserveLanes(uint32_t n, uint32_t parts = 1) {
+        bands = std::clamp<uint32_t>(parts, 1, Dim);
+        if (lanes.size() < n) lanes.resize(n);
+        for (auto& lane : lanes) lane.resize(bands);
+    }
+
+    // Moves in more than one band are counted in each
+    inline size_t staged() {
+        size_t n = 0;
+        for (auto& lane : lanes)
+            for (auto& band : lane) n += band.size();
+        return n;
+    }
+
+    // Batched update: thread safe and lock free, the move only goes into the
+    // lane of the calling thread. The cell's range changes now but it stays
+    // in its old buckets until flush. Returns false if the buckets are the same
+    inline bool stage(Cell& cell, uint32_t lane) {
+        GridRange& oldRange = cell.shared.range;
+        GridRange newRange = rangeOf(cell);
+
+        if (newRange == oldRange) {
+            // Mirrors still need the new coordinates
+            if constexpr (SoA) push(lanes[lane], {&cell, oldRange, newRange});
+            return false;
+        }
+
+        push(lanes[lane], {&cell, oldRange, newRange});
+        oldRange = newRange;
+        return true;
+    }
+
+    // Applies the staged moves to bucket columns [part * Dim / bands,
+    // (part + 1) * Dim / bands), part < the parts given to reserveLanes.
+    // Different parts never share a bucket so they can run on different
+    // threads without locking. Lanes are left as is, call clearStaged once
+    // every part is done.
+    inline void flush(uint32_t part) {
+        const int32_t lo = int32_t(int64_t(part) * Dim / bands);
+        const int32_t hi = int32_t(int64_t(part + 1) * Dim / bands) - 1;
+
+        for (auto& lane : lanes) {
+            for (auto& m : lane[part]) {
+                if (m.from == m.to) {
+                    if constexpr (SoA) {
+                        for (int32_t i = std::max(m.to.l, lo); i <= std::min(m.to.r, hi); i++) {
+                            for (int32_t j = m.to.t; j <= m.to.b; j++) {
+                                buckets[i][j].refresh(m.cell);
+                            }
+                        }
+                    }
+                    continue;
+                }
+
+                for (int32_t i = std::max(m.from.l, lo); i <= std::min(m.from.r, hi); i++) {
+                    for (int32_t j = m.from.t; j <= m.from.b; j++) {
+                        buckets[i][j].erase(m.cell);
+                        touch(i, j);
+                    }
+                }
+
+                for (int32_t i = std::max(m.to.l, lo); i <= std::min(m.to.r, hi); i++) {
+                    for (int32_t j = m.to.t; j <= m.to.b; j++) {
+                        buckets[i][j].push(m.cell);
+                        touch(i, j);
+                    }
+                }
+            }
+        }
+    }
+
+    inline void clearStaged() {
+        for (auto& lane : lanes)
+            for (auto& band : lane) band.clear();
+    }
+
+    // Applies every staged move on the calling thread. Not thread safe
+    inline void flush() {
+        for (uint32_t part = 0; part < bands; part++) flush(part);
+        clearStaged();
+    }
+
 /*
     void removeCells(unsigned int sectorX = 0, unsigned int sectorY = 0, unsigned int block = 1) {
         unsigned int x0 = sectorX * Dim / block;
@@ -132,8 +381,11 @@ public:
 
         for (int32_t i = itemRange.l; i <= itemRange.r; i++) {
             for (int32_t j = itemRange.t; j <= itemRange.b; j++) {
-                for (auto other : buckets[i][j]) 
+                auto& bucket = buckets[i][j];
+                for (uint32_t k = 0; k < bucket.size(); k++) {
+                    auto other = bucket.cells()[k];
                     if (&cell != other && cb(other)) return;
+                }
             }
         }
     }
@@ -144,14 +396,91 @@ public:
     
         for (int32_t i = rg.l; i <= rg.r; i++) {
             for (int32_t j = rg.t; j <= rg.b; j++) {
-                for (auto other : buckets[i][j]) {
-                    cb(other);
+                auto& bucket = buckets[i][j];
+                for (uint32_t k = 0; k < bucket.size(); k++) {
+                    cb(bucket.cells()[k]);
+                    if (escape) return;
+                }
+            }
+        }
+    }
+
+    // Narrow phase query: test(x, y, r) runs on every candidate (on the
+    // mirrored arrays if SoA) and cb only on the ones that passed
+    template <typename T, typename TestFunc, typename QueryFunc>
+    inline void query(TAABB<T>& box, const TestFunc& test, const QueryFunc& cb, bool& escape) {
+        GridRange rg = fromAABB(box);
+
+        for (int32_t i = rg.l; i <= rg.r; i++) {
+            for (int32_t j = rg.t; j <= rg.b; j++) {
+                auto& bucket = buckets[i][j];
+                const uint32_t n = bucket.size();
+                auto cells = bucket.cells();
+
+                for (uint32_t k = 0; k < n; k++) {
+                    if constexpr (SoA) {
+                        if (!test(bucket.x()[k], bucket.y()[k], bucket.r()[k])) continue;
+                    } else {
+                        if (!test(cells[k]->x, cells[k]->y, cells[k]->r)) continue;
+                    }
+                    cb(cells[k]);
                     if (escape) return;
                 }
             }
         }
     }
 
+    // Batched narrow phase query (SoA only): kernel(x, y, r, n) tests up to
+    // simd::BATCH candidates of a bucket at once and returns a mask of the
+    // ones that passed, cb runs on those
+    template <typename T, typename KernelFunc, typename QueryFunc>
+    inline void queryBatch(TAABB<T>& box, const KernelFunc& kernel, const QueryFunc& cb, bool& escape) {
+        static_assert(SoA, "queryBatch needs the mirrored coordinates");
+        GridRange rg = fromAABB(box);
+
+        for (int32_t i = rg.l; i <= rg.r; i++) {
+            for (int32_t j = rg.t; j <= rg.b; j++) {
+                auto& bucket = buckets[i][j];
+                const uint32_t n = bucket.size();
+                auto cells = bucket.cells();
+
+                for (uint32_t k = 0; k < n; k += simd::BATCH) {
+                    uint32_t mask = kernel(bucket.x() + k, bucket.y() + k, bucket.r() + k,
+                        std::min(n - k, simd::BATCH));
+
+                    while (mask) {
+                        cb(cells[k + simd::ctz(mask)]);
+                        if (escape) return;
+                        mask &= mask - 1;
+                    }
+                }
+            }
+        }
+    }
+
+    // Buckets changed after this call get a later stamp than the value
+    // returned, pass it to queryChanged as since
+    inline uint32_t mark() { return clock.fetch_add(1, std::memory_order_relaxed); }
+
+    // Incremental version of query: cb only runs on the cells of buckets in
+    // box that are outside of last or changed after since (see mark). Cells
+    // of the other buckets are the same as when last was queried. Returns the
+    // range of box for the next call, an empty last (l > r) gives every cell.
+    template <typename T, typename QueryFunc>
+    inline GridRange queryChanged(TAABB<T>& box, GridRange& last, uint32_t since, const QueryFunc& cb) {
+        GridRange rg = fromAABB(box);
+
+        for (int32_t i = rg.l; i <= rg.r; i++) {
+            for (int32_t j = rg.t; j <= rg.b; j++) {
+                if (last.include(i, j) && int32_t(stamps[i][j] - since) <= 0) continue;
+                auto& bucket = buckets[i][j];
+                for (uint32_t k = 0; k < bucket.size(); k++) cb(bucket.cells()[k]);
+            }
+        }
+
+        return rg;
+    }
+
 /*
     template <typename DiffFunc1, typename DiffFunc2>
     void diff(AABB& box1, AABB& box2, const DiffFunc1& func1, const DiffFunc2& func2) {
@@ -237,16 +566,17 @@ public:
         for (uint32_t i = 0; i < Dim; i++) {
             for (uint32_t j = 0; j < Dim; j++) {
                 buckets[i][j].clear();
-                buckets[i][j].shrink_to_fit();
+                touch(i, j);
             }
         }
+        clearStaged();
         count = 0;
     }
 
     void gc() {
         for (uint32_t i = 0; i < Dim; i++) {
             for (uint32_t j = 0; j < Dim; j++) {
-                buckets[i][j].shrink_to_fit();
+                buckets[i][j].gc();
             }
         }
     }
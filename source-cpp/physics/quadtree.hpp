@@ -4,11 +4,14 @@
 #include "algorithm"
 #include "cell.hpp"
 
+#include <memory.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
 
 using std::vector;
 using std::mutex;
+using std::atomic_flag;
 
 constexpr int32_t QUAD_NP = -1;
 constexpr int32_t QUAD_TL = 0;
@@ -335,30 +338,16 @@ private:
     uint32_t maxLevel;
     uint32_t maxItems;
 
-    struct LooseQuadNode {
-        LooseQuadTree<E>& tree;
-
-        LooseQuadNode* root; // 8 bytes
-        LooseQuadNode* branches; // 8 bytes
+    // Nodes live in chunks that never move and are handed out 4 at a time
+    // (one quad), children are referred to by the index of the first one
+    struct alignas(64) LooseQuadNode {
+        uint32_t parent; // 4 bytes
+        uint32_t branches; // 4 bytes, 0 if this is a leaf
         uint32_t level; // 4 bytes
-        IRect rect; // 16 bytes
-        vector<Cell*> items; // 24 bytes
-        mutex m;
-        
-        LooseQuadNode(LooseQuadTree<E>& tree, IRect rect, LooseQuadNode* root = nullptr):
-            tree(tree), rect(rect), root(root), branches(nullptr) {
-            level = root ? root->level + 1 : 0;
-            items.reserve(tree.maxItems);
-        };
-
-        ~LooseQuadNode() {
-            clear();
-        }
-        
-        void clear() {
-            if (branches) delete[] branches;
-            branches = nullptr;
-        }
+        IRect rect = IRect(0, 0, 0, 0); // 16 bytes
+        vector<Cell*> items; // 24 bytes, keeps its capacity when recycled
+        // Only taken by insert, moves are staged and applied by flush
+        atomic_flag lock;
 
         // Get quadrant this cell (rect) belongs to. NOTE: different from regular quadtree
         const int32_t getQuadrant(Cell* cell) {
@@ -378,71 +367,184 @@ private:
             auto outter = (rect * E).toAABB();
             return inner.contains(cell->x, cell->y) && outter.contains(cell->shared.aabb);
         }
+    };
 
-        void restructure() {
-            // .erase + std::remove_if should compile to the same thing?
-            uint32_t w_id = 0;
-            for (uint32_t k = 0; k < items.size(); k++) {
-                if (!(items[k]->flag & REMOVE_BIT)) {
-                    if (w_id != k) items[w_id] = items[k];
-                    w_id++;
-                }
-            }
-            items.resize(w_id);
+    static_assert(sizeof(LooseQuadNode) == 64, "LooseQuadNode must be 64 bytes");
 
-            split();
-            if (branches) {
-                branches[0].restructure();
-                branches[1].restructure();
-                branches[2].restructure();
-                branches[3].restructure();
-            }
-            merge();
+    static constexpr uint32_t CHUNK_BITS = 10;
+    static constexpr uint32_t CHUNK_SIZE = 1 << CHUNK_BITS;
+    static constexpr uint32_t CHUNK_MASK = CHUNK_SIZE - 1;
+
+    vector<LooseQuadNode*> chunks;
+    uint32_t nodeCount = 0;
+    // First node of every released quad
+    vector<uint32_t> freeQuads;
+
+    inline LooseQuadNode& at(uint32_t index) {
+        return chunks[index >> CHUNK_BITS][index & CHUNK_MASK];
+    }
+
+    inline LooseQuadNode* children(LooseQuadNode* node) {
+        return &at(node->branches);
+    }
+
+    // Only allocates when the tree outgrows every tick before it
+    uint32_t allocQuad() {
+        if (!freeQuads.empty()) {
+            auto first = freeQuads.back();
+            freeQuads.pop_back();
+            return first;
         }
 
-        void split() {
-            if (branches || 
-                items.size() < tree.maxItems ||
-                level >= tree.maxLevel) return;
-            
-            const int32_t qw = rect.hw >> 1;
-            const int32_t qh = rect.hh >> 1;
-
-            branches = new LooseQuadNode[4] {
-                LooseQuadNode(tree, IRect { rect.x - qw, rect.y + qh, qw, qh }, this),
-                LooseQuadNode(tree, IRect { rect.x + qw, rect.y + qh, qw, qh }, this),
-                LooseQuadNode(tree, IRect { rect.x - qw, rect.y - qh, qw, qh }, this),
-                LooseQuadNode(tree, IRect { rect.x + qw, rect.y - qh, qw, qh }, this)
-            };
+        if (!(nodeCount & CHUNK_MASK)) {
+            chunks.push_back(new LooseQuadNode[CHUNK_SIZE]);
+            for (uint32_t i = 0; i < CHUNK_SIZE; i++)
+                chunks.back()[i].items.reserve(maxItems);
+        }
 
-            auto iter = items.begin();
-            while (iter != items.end()) {
-                auto q = getQuadrant(*iter);
-                if (q < 0) iter++;
-                else {
-                    branches[q].items.push_back(*iter);
-                    (*iter)->__root = &branches[q];
-                    iter = items.erase(iter);
-                }
+        auto first = nodeCount;
+        nodeCount += 4;
+        return first;
+    }
+
+    // Recycle every node under this one
+    void release(LooseQuadNode* node) {
+        if (!node->branches) return;
+
+        auto kids = children(node);
+        for (uint32_t q = 0; q < 4; q++) {
+            release(&kids[q]);
+            kids[q].items.clear();
+        }
+
+        freeQuads.push_back(node->branches);
+        node->branches = 0;
+    }
+
+    void restructure(uint32_t index) {
+        auto node = &at(index);
+        auto& items = node->items;
+
+        uint32_t w_id = 0;
+        for (uint32_t k = 0; k < items.size(); k++) {
+            if (!(items[k]->flag & REMOVE_BIT)) {
+                if (w_id != k) items[w_id] = items[k];
+                slots[id(items[w_id])] = w_id;
+                w_id++;
             }
         }
+        items.resize(w_id);
+
+        split(index);
+        if (node->branches) {
+            const auto first = node->branches;
+            restructure(first);
+            restructure(first + 1);
+            restructure(first + 2);
+            restructure(first + 3);
+        }
+        merge(node);
+    }
 
-        void merge() {
-            if (!branches) return;
-            if (branches[0].branches || branches[0].items.size() ||
-                branches[1].branches || branches[1].items.size() ||
-                branches[2].branches || branches[2].items.size() ||
-                branches[3].branches || branches[3].items.size()) return;
-            clear();
+    void split(uint32_t index) {
+        auto node = &at(index);
+        if (node->branches ||
+            node->items.size() < maxItems ||
+            node->level >= maxLevel) return;
+
+        // Chunks don't move, node stays valid
+        node->branches = allocQuad();
+
+        const auto& rect = node->rect;
+        const int32_t qw = rect.hw >> 1;
+        const int32_t qh = rect.hh >> 1;
+
+        auto kids = children(node);
+        kids[QUAD_TL].rect = IRect { rect.x - qw, rect.y + qh, qw, qh };
+        kids[QUAD_TR].rect = IRect { rect.x + qw, rect.y + qh, qw, qh };
+        kids[QUAD_BL].rect = IRect { rect.x - qw, rect.y - qh, qw, qh };
+        kids[QUAD_BR].rect = IRect { rect.x + qw, rect.y - qh, qw, qh };
+
+        for (uint32_t q = 0; q < 4; q++) {
+            kids[q].parent = index;
+            kids[q].branches = 0;
+            kids[q].level = node->level + 1;
         }
+
+        auto& items = node->items;
+        uint32_t w_id = 0;
+        for (uint32_t k = 0; k < items.size(); k++) {
+            auto cell = items[k];
+            auto q = node->getQuadrant(cell);
+            if (q < 0) {
+                items[w_id] = cell;
+                slots[id(cell)] = w_id++;
+            } else {
+                attach(&kids[q], cell);
+                cell->__root = &kids[q];
+            }
+        }
+        items.resize(w_id);
+    }
+
+    void merge(LooseQuadNode* node) {
+        if (!node->branches) return;
+        auto kids = children(node);
+        if (kids[0].branches || kids[0].items.size() ||
+            kids[1].branches || kids[1].items.size() ||
+            kids[2].branches || kids[2].items.size() ||
+            kids[3].branches || kids[3].items.size()) return;
+        release(node);
+    }
+
+    struct Move {
+        Cell* cell;
+        LooseQuadNode* from;
+        LooseQuadNode* to;
     };
 
-    LooseQuadNode root;
+    LooseQuadNode* root;
     int32_t* minLevelTable;
+
+    // Cells are identified by their offset in the cell pool, slots has the
+    // index of every cell in the items of its node
+    Cell* base;
+    uint32_t* slots;
+    // Moves staged by update, one lane per thread
+    vector<vector<Move>> lanes;
+
+    inline cell_id_t id(Cell* cell) { return cell - base; }
+
+    inline void attach(LooseQuadNode* node, Cell* cell) {
+        slots[id(cell)] = node->items.size();
+        node->items.push_back(cell);
+    }
+
+    // Swap remove
+    inline void detach(LooseQuadNode* node, Cell* cell) {
+        auto& items = node->items;
+        auto i = slots[id(cell)];
+        if (i >= items.size() || items[i] != cell) return;
+
+        auto last = items.back();
+        items[i] = last;
+        slots[id(last)] = i;
+        items.pop_back();
+    }
+
 public:
-    LooseQuadTree(IRect rect, uint32_t maxLevel, uint32_t maxItems):
-        root(*this, rect), maxLevel(maxLevel), maxItems(maxItems) {
+    LooseQuadTree(IRect rect, uint32_t maxLevel, uint32_t maxItems, Cell* base, size_t limit):
+        maxLevel(maxLevel), maxItems(maxItems), base(base) {
         rts.reserve(maxLevel << 2);
+        slots = new uint32_t[limit];
+
+        // Root is node 0, the rest of its quad is unused so that 0 can mean
+        // no branches
+        root = &at(allocQuad());
+        root->parent = 0;
+        root->branches = 0;
+        root->level = 0;
+        root->rect = rect;
 
         minLevelTable = new int32_t[maxLevel];
         memset(minLevelTable, -1, sizeof(int32_t) * maxLevel);
@@ -452,18 +554,25 @@ public:
     };
 
     ~LooseQuadTree() {
-        clear();
         delete[] minLevelTable;
+        delete[] slots;
+        for (auto chunk : chunks) delete[] chunk;
     }
 
     inline void clear() {
-        root.clear();
-        root.items.clear();
+        release(root);
+        root->items.clear();
+        for (auto& lane : lanes) lane.clear();
+    }
+
+    // Lanes for update, one per thread that calls it. Not thread safe
+    inline void reserveLanes(uint32_t n) {
+        if (lanes.size() < n) lanes.resize(n);
     }
 
     inline bool isSafe(AABB& aabb) {
         rts.clear();
-        rts.push_back(&root);
+        rts.push_back(root);
 
         while (!rts.empty()) {
             auto curr = static_cast<LooseQuadNode*>(rts.back());
@@ -472,12 +581,12 @@ public:
             auto& r = curr->rect;
             if (curr->branches) {
                 if (aabb.t > r.y - r.hh * E) {
-                    if (aabb.l < r.x + r.hw * E) rts.push_back(&curr->branches[QUAD_TL]);
-                    if (aabb.r > r.x - r.hw * E) rts.push_back(&curr->branches[QUAD_TR]);
+                    if (aabb.l < r.x + r.hw * E) rts.push_back(&children(curr)[QUAD_TL]);
+                    if (aabb.r > r.x - r.hw * E) rts.push_back(&children(curr)[QUAD_TR]);
                 }
                 if (aabb.b < r.y + r.hh * E) {
-                    if (aabb.l < r.x + r.hw * E) rts.push_back(&curr->branches[QUAD_BL]);
-                    if (aabb.r > r.x - r.hw * E) rts.push_back(&curr->branches[QUAD_BR]);
+                    if (aabb.l < r.x + r.hw * E) rts.push_back(&children(curr)[QUAD_BL]);
+                    if (aabb.r > r.x - r.hw * E) rts.push_back(&children(curr)[QUAD_BR]);
                 }
             }
 
@@ -494,7 +603,7 @@ public:
         auto target = std::min(count, maxLevel);
 
         rts.clear();
-        rts.push_back(&root);
+        rts.push_back(root);
 
         while (!rts.empty()) {
             auto curr = static_cast<LooseQuadNode*>(rts.back());
@@ -502,37 +611,39 @@ public:
 
             out[curr->level] += curr->items.size();
             if ((curr->level < target - 1) && curr->branches) {
-                rts.push_back(&curr->branches[QUAD_TL]);
-                rts.push_back(&curr->branches[QUAD_TR]);
-                rts.push_back(&curr->branches[QUAD_BL]);
-                rts.push_back(&curr->branches[QUAD_BR]);
+                rts.push_back(&children(curr)[QUAD_TL]);
+                rts.push_back(&children(curr)[QUAD_TR]);
+                rts.push_back(&children(curr)[QUAD_BL]);
+                rts.push_back(&children(curr)[QUAD_BR]);
             }
         }
     }
     
     inline void insert(Cell* cell) {
-        auto node = &root;
+        auto node = root;
         while (true) {
             if (!node->branches) break;
             auto q = node->getQuadrant(cell);
             if (q < 0) break;
-            node = &node->branches[q];
+            node = &children(node)[q];
         }
 
         cell->__root = node;
-        node->m.lock();
-        node->items.push_back(cell);
-        node->m.unlock();
+        while (node->lock.test_and_set(std::memory_order_acquire))
+            std::this_thread::yield();
+        attach(node, cell);
+        node->lock.clear(std::memory_order_release);
     }
 
-    // Thread safe
-    inline void update(Cell* cell) {
+    // Thread safe and lock free: the move is only staged in the lane of the
+    // calling thread, the cell stays in its old node until flush
+    inline void update(Cell* cell, uint32_t lane) {
         auto oldNode = static_cast<LooseQuadNode*>(cell->__root);
         auto newNode = oldNode;
 
         while (true) {
-            if (!newNode->root) break;
-            newNode = newNode->root;
+            if (!newNode->level) break;
+            newNode = &at(newNode->parent);
             if (newNode->contains(cell)) break;
         }
 
@@ -540,39 +651,47 @@ public:
             if (!newNode->branches) break;
             auto q = newNode->getQuadrant(cell);
             if (q < 0) break;
-            newNode = &newNode->branches[q];
+            newNode = &children(newNode)[q];
         }
 
         if (oldNode == newNode) return;
 
-        oldNode->m.lock();
-        auto iter = std::find(oldNode->items.begin(), oldNode->items.end(), cell);
-        if (iter != oldNode->items.end()) oldNode->items.erase(iter);
-        oldNode->m.unlock();
-
-        newNode->m.lock();
-        newNode->items.push_back(cell);
-        newNode->m.unlock();
-
+        // __root moves now so a second update before flush starts from here
+        lanes[lane].push_back({cell, oldNode, newNode});
         cell->__root = newNode;
     }
-    
+
+    // Apply the staged moves, needs to run before querying again. Not thread safe
+    inline void flush() {
+        for (auto& lane : lanes) {
+            for (auto& m : lane) {
+                detach(m.from, m.cell);
+                attach(m.to, m.cell);
+            }
+            lane.clear();
+        }
+    }
+
     inline void restructure() {
-        root.restructure();
+        flush();
+        restructure(0);
     }
 
+    // Not thread safe
     inline void swap(Cell* cell1, Cell* cell2) {
         cell2->__root = cell1->__root;
-        auto oldRoot = static_cast<LooseQuadNode*>(cell2->__root);
-        auto iter = std::find(oldRoot->items.begin(), oldRoot->items.end(), cell1);
-        if (iter != oldRoot->items.end()) *iter = cell2;
+        auto node = static_cast<LooseQuadNode*>(cell2->__root);
+        auto i = slots[id(cell1)];
+        if (i < node->items.size() && node->items[i] == cell1) {
+            node->items[i] = cell2;
+            slots[id(cell2)] = i;
+        }
         cell1->__root = nullptr;
     }
-    
+
+    // Not thread safe
     inline void remove(Cell* cell) {
-        auto __root = static_cast<LooseQuadNode*>(cell->__root);
-        auto iter = std::find(__root->items.begin(), __root->items.end(), cell);
-        if (iter != __root->items.end()) __root->items.erase(iter);
+        detach(static_cast<LooseQuadNode*>(cell->__root), cell);
         cell->__root = nullptr;
     }
 
@@ -580,7 +699,7 @@ public:
     template <typename QueryFunc>
     inline void query(Cell& cell, bool useMinLevel, const QueryFunc& cb) {
         rts.clear();
-        rts.push_back(&root);
+        rts.push_back(root);
 
         int minLevel = -1;
         if (useMinLevel) {
@@ -596,12 +715,12 @@ public:
             auto& r = curr->rect;
             if (curr->branches) {
                 if (aabb.t > r.y - r.hh * E) {
-                    if (aabb.l < r.x + r.hw * E) rts.push_back(&curr->branches[QUAD_TL]);
-                    if (aabb.r > r.x - r.hw * E) rts.push_back(&curr->branches[QUAD_TR]);
+                    if (aabb.l < r.x + r.hw * E) rts.push_back(&children(curr)[QUAD_TL]);
+                    if (aabb.r > r.x - r.hw * E) rts.push_back(&children(curr)[QUAD_TR]);
                 }
                 if (aabb.b < r.y + r.hh * E) {
-                    if (aabb.l < r.x + r.hw * E) rts.push_back(&curr->branches[QUAD_BL]);
-                    if (aabb.r > r.x - r.hw * E) rts.push_back(&curr->branches[QUAD_BR]);
+                    if (aabb.l < r.x + r.hw * E) rts.push_back(&children(curr)[QUAD_BL]);
+                    if (aabb.r > r.x - r.hw * E) rts.push_back(&children(curr)[QUAD_BR]);
                 }
             }
 
@@ -619,7 +738,7 @@ public:
     template <typename QueryFunc>
     inline void query(AABB& aabb, const QueryFunc& cb) {
         rts.clear();
-        rts.push_back(&root);
+        rts.push_back(root);
 
         while (!rts.empty()) {
             auto curr = static_cast<LooseQuadNode*>(rts.back());
@@ -636,10 +755,10 @@ public:
                     rts.pop_back();
 
                     if (curr2->branches) {
-                        rts.push_back(&curr2->branches[QUAD_TL]);
-                        rts.push_back(&curr2->branches[QUAD_TR]);
-                        rts.push_back(&curr2->branches[QUAD_BL]);
-                        rts.push_back(&curr2->branches[QUAD_BR]);
+                        rts.push_back(&children(curr2)[QUAD_TL]);
+                        rts.push_back(&children(curr2)[QUAD_TR]);
+                        rts.push_back(&children(curr2)[QUAD_BL]);
+                        rts.push_back(&children(curr2)[QUAD_BR]);
                     }
                     for (auto other : curr2->items) cb(other);
                 }
@@ -648,12 +767,12 @@ public:
                 auto& r = curr->rect;
                 if (curr->branches) {
                     if (aabb.t > r.y - r.hh * E) {
-                        if (aabb.l < r.x + r.hw * E) rts.push_back(&curr->branches[QUAD_TL]);
-                        if (aabb.r > r.x - r.hw * E) rts.push_back(&curr->branches[QUAD_TR]);
+                        if (aabb.l < r.x + r.hw * E) rts.push_back(&children(curr)[QUAD_TL]);
+                        if (aabb.r > r.x - r.hw * E) rts.push_back(&children(curr)[QUAD_TR]);
                     }
                     if (aabb.b < r.y + r.hh * E) {
-                        if (aabb.l < r.x + r.hw * E) rts.push_back(&curr->branches[QUAD_BL]);
-                        if (aabb.r > r.x - r.hw * E) rts.push_back(&curr->branches[QUAD_BR]);
+                        if (aabb.l < r.x + r.hw * E) rts.push_back(&children(curr)[QUAD_BL]);
+                        if (aabb.r > r.x - r.hw * E) rts.push_back(&children(curr)[QUAD_BR]);
                     }
                 }
 
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <stdint.h>
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define SIMD_AVX512
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Batched narrow phase kernels. Candidates come in as x/y/r arrays (see
+// SoABucket in grid.hpp), results are bit masks with bit k set if candidate k
+// passed.
+namespace simd {
+
+// Max candidates per kernel call, fits the widest vector of floats
+constexpr uint32_t BATCH = 16;
+
+inline uint32_t ctz(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Lanes of T for the instruction set we're compiled for, WIDTH = 1 means there
+// is none and only the scalar loop runs
+template <typename T>
+struct Vec {
+    static constexpr uint32_t WIDTH = 1;
+};
+
+#if defined(SIMD_AVX512)
+template <>
+struct Vec<double> {
+    static constexpr uint32_t WIDTH = 8;
+    typedef __m512d V;
+    typedef __mmask8 M;
+    static inline V load(const double* p) { return _mm512_loadu_pd(p); }
+    static inline V set(double v) { return _mm512_set1_pd(v); }
+    static inline V add(V a, V b) { return _mm512_add_pd(a, b); }
+    static inline V sub(V a, V b) { return _mm512_sub_pd(a, b); }
+    static inline V mul(V a, V b) { return _mm512_mul_pd(a, b); }
+    static inline V div(V a, V b) { return _mm512_div_pd(a, b); }
+    static inline M gt(V a, V b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+    static inline M lt(V a, V b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+    static inline M both(M a, M b) { return a & b; }
+    static inline uint32_t bits(M m) { return m; }
+};
+
+template <>
+struct Vec<float> {
+    static constexpr uint32_t WIDTH = 16;
+    typedef __m512 V;
+    typedef __mmask16 M;
+    static inline V load(const float* p) { return _mm512_loadu_ps(p); }
+    static inline V set(float v) { return _mm512_set1_ps(v); }
+    static inline V add(V a, V b) { return _mm512_add_ps(a, b); }
+    static inline V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+    static inline V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+    static inline V div(V a, V b) { return _mm512_div_ps(a, b); }
+    static inline M gt(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+    static inline M lt(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+    static inline M both(M a, M b) { return a & b; }
+    static inline uint32_t bits(M m) { return m; }
+};
+#elif defined(SIMD_AVX)
+template <>
+struct Vec<double> {
+    static constexpr uint32_t WIDTH = 4;
+    typedef __m256d V;
+    typedef __m256d M;
+    static inline V load(const double* p) { return _mm256_loadu_pd(p); }
+    static inline V set(double v) { return _mm256_set1_pd(v); }
+    static inline V add(V a, V b) { return _mm256_add_pd(a, b); }
+    static inline V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+    static inline V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+    static inline V div(V a, V b) { return _mm256_div_pd(a, b); }
+    static inline M gt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+    static inline M lt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    static inline M both(M a, M b) { return _mm256_and_pd(a, b); }
+    static inline uint32_t bits(M m) { return _mm256_movemask_pd(m); }
+};
+
+template <>
+struct Vec<float> {
+    static constexpr uint32_t WIDTH = 8;
+    typedef __m256 V;
+    typedef __m256 M;
+    static inline V load(const float* p) { return _mm256_loadu_ps(p); }
+    static inline V set(float v) { return _mm256_set1_ps(v); }
+    static inline V add(V a, V b) { return _mm256_add_ps(a, b); }
+    static inline V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+    static inline V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+    static inline V div(V a, V b) { return _mm256_div_ps(a, b); }
+    static inline M gt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static inline M lt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static inline M both(M a, M b) { return _mm256_and_ps(a, b); }
+    static inline uint32_t bits(M m) { return _mm256_movemask_ps(m); }
+};
+#elif defined(SIMD_SSE2)
+template <>
+struct Vec<double> {
+    static constexpr uint32_t WIDTH = 2;
+    typedef __m128d V;
+    typedef __m128d M;
+    static inline V load(const double* p) { return _mm_loadu_pd(p); }
+    static inline V set(double v) { return _mm_set1_pd(v); }
+    static inline V add(V a, V b) { return _mm_add_pd(a, b); }
+    static inline V sub(V a, V b) { return _mm_sub_pd(a, b); }
+    static inline V mul(V a, V b) { return _mm_mul_pd(a, b); }
+    static inline V div(V a, V b) { return _mm_div_pd(a, b); }
+    static inline M gt(V a, V b) { return _mm_cmpgt_pd(a, b); }
+    static inline M lt(V a, V b) { return _mm_cmplt_pd(a, b); }
+    static inline M both(M a, M b) { return _mm_and_pd(a, b); }
+    static inline uint32_t bits(M m) { return _mm_movemask_pd(m); }
+};
+
+template <>
+struct Vec<float> {
+    static constexpr uint32_t WIDTH = 4;
+    typedef __m128 V;
+    typedef __m128 M;
+    static inline V load(const float* p) { return _mm_loadu_ps(p); }
+    static inline V set(float v) { return _mm_set1_ps(v); }
+    static inline V add(V a, V b) { return _mm_add_ps(a, b); }
+    static inline V sub(V a, V b) { return _mm_sub_ps(a, b); }
+    static inline V mul(V a, V b) { return _mm_mul_ps(a, b); }
+    static inline V div(V a, V b) { return _mm_div_ps(a, b); }
+    static inline M gt(V a, V b) { return _mm_cmpgt_ps(a, b); }
+    static inline M lt(V a, V b) { return _mm_cmplt_ps(a, b); }
+    static inline M both(M a, M b) { return _mm_and_ps(a, b); }
+    static inline uint32_t bits(M m) { return _mm_movemask_ps(m); }
+};
+#elif defined(SIMD_NEON)
+template <>
+struct Vec<double> {
+    static constexpr uint32_t WIDTH = 2;
+    typedef float64x2_t V;
+    typedef uint64x2_t M;
+    static inline V load(const double* p) { return vld1q_f64(p); }
+    static inline V set(double v) { return vdupq_n_f64(v); }
+    static inline V add(V a, V b) { return vaddq_f64(a, b); }
+    static inline V sub(V a, V b) { return vsubq_f64(a, b); }
+    static inline V mul(V a, V b) { return vmulq_f64(a, b); }
+    static inline V div(V a, V b) { return vdivq_f64(a, b); }
+    static inline M gt(V a, V b) { return vcgtq_f64(a, b); }
+    static inline M lt(V a, V b) { return vcltq_f64(a, b); }
+    static inline M both(M a, M b) { return vandq_u64(a, b); }
+    static inline uint32_t bits(M m) {
+        return (vgetq_lane_u64(m, 0) & 1) | ((vgetq_lane_u64(m, 1) & 1) << 1);
+    }
+};
+
+template <>
+struct Vec<float> {
+    static constexpr uint32_t WIDTH = 4;
+    typedef float32x4_t V;
+    typedef uint32x4_t M;
+    static inline V load(const float* p) { return vld1q_f32(p); }
+    static inline V set(float v) { return vdupq_n_f32(v); }
+    static inline V add(V a, V b) { return vaddq_f32(a, b); }
+    static inline V sub(V a, V b) { return vsubq_f32(a, b); }
+    static inline V mul(V a, V b) { return vmulq_f32(a, b); }
+    static inline V div(V a, V b) { return vdivq_f32(a, b); }
+    static inline M gt(V a, V b) { return vcgtq_f32(a, b); }
+    static inline M lt(V a, V b) { return vcltq_f32(a, b); }
+    static inline M both(M a, M b) { return vandq_u32(a, b); }
+    static inline uint32_t bits(M m) {
+        const uint32_t weights[4] = {1, 2, 4, 8};
+        return vaddvq_u32(vandq_u32(m, vld1q_u32(weights)));
+    }
+};
+#endif
+
+// Candidates a cell at (cx, cy) with radius cr can eat, same condition as the
+// scalar eat checks: cr > r * mult && d < cr - r / overlap. n <= BATCH.
+template <typename T>
+inline uint32_t eatMask(const T* x, const T* y, const T* r, uint32_t n,
+                        T cx, T cy, T cr, T mult, T overlap) {
+    uint32_t mask = 0;
+    uint32_t k = 0;
+
+    if constexpr (Vec<T>::WIDTH > 1) {
+        typedef Vec<T> V;
+        const auto vx = V::set(cx);
+        const auto vy = V::set(cy);
+        const auto vr = V::set(cr);
+        const auto vm = V::set(mult);
+        const auto vo = V::set(overlap);
+
+        for (; k + V::WIDTH <= n; k += V::WIDTH) {
+            auto r2 = V::load(r + k);
+            auto dx = V::sub(V::load(x + k), vx);
+            auto dy = V::sub(V::load(y + k), vy);
+            auto reach = V::sub(vr, V::div(r2, vo));
+
+            auto dSqr = V::add(V::mul(dx, dx), V::mul(dy, dy));
+
+            auto m = V::both(V::gt(vr, V::mul(r2, vm)),
+                             V::lt(dSqr, V::mul(reach, reach)));
+            mask |= V::bits(m) << k;
+        }
+    }
+
+    // Tail (or everything without SIMD)
+    for (; k < n; k++) {
+        T dx = x[k] - cx;
+        T dy = y[k] - cy;
+        T reach = cr - r[k] / overlap;
+        if (cr > r[k] * mult && dx * dx + dy * dy < reach * reach)
+            mask |= 1u << k;
+    }
+
+    return mask;
+}
+
+}  // namespace simd
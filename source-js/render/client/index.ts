@@ -29,6 +29,7 @@ import BASrc from '../img/ba.mp4';
 
 // Shaders
 import SpriteVert from './shaders/sprite_vert.glsl';
+import SpriteInstVert from './shaders/sprite_inst_vert.glsl';
 import SpriteFrag from './shaders/sprite_frag.glsl';
 import SimpleVert from './shaders/simple_vert.glsl';
 import TrollFrag from './shaders/troll_frag.glsl';
@@ -60,9 +61,17 @@ const QUAD_VERT = [-1, -1, +1, -1, -1, +1, +1, -1, -1, +1, +1, +1];
 
 interface RenderModuleAddon {
     postInit(client: Client): void;
-    render(client: Client, lerp: number, dt: number, debug: boolean): number;
+    render(
+        client: Client,
+        lerp: number,
+        dt: number,
+        debug: boolean,
+        instanced?: boolean,
+    ): number;
     renderV(client: Client, lerp: number, dt: number, modifier: number): number;
     parse(client: Client, buf: ArrayBuffer): number;
+    setFrameRing(ring?: SharedArrayBuffer): boolean;
+    parseFrame(client: Client, seq: number): number;
     getCellColor(index: number): [number, number, number];
     clear(): void;
     getPID(x: number, y: number): number;
@@ -281,6 +290,7 @@ export default class Client {
 
     quadVAO: WebGLVertexArrayObjectOES;
     spritesVAO: WebGLVertexArrayObjectOES;
+    instancesVAO: WebGLVertexArrayObjectOES;
 
     readonly fbo: Map<string, WebGLFramebuffer[]> = new Map();
     readonly buffers: Map<string, WebGLBuffer> = new Map();
@@ -355,6 +365,7 @@ export default class Client {
 
     mapProg: WebGLProgram;
     spriteProg: WebGLProgram;
+    instanceProg: WebGLProgram;
     vidProg: WebGLProgram;
     discoProg: WebGLProgram;
     readonly spriteBuffer = new Float32Array(65536 * 128); // 16MB vertex data
@@ -491,6 +502,28 @@ export default class Client {
             save?: string;
             bytes?: number;
             restore?: string;
+            ring?: SharedArrayBuffer;
+            frame?: number;
+        };
+
+        const onFrame = (bytes: number, parse: () => void) => {
+            this.lastPacket = this.lastRAF;
+            this.bytesReceived += bytes;
+
+            const oldMap = this.map.slice(0);
+            parse();
+
+            if (oldMap[0] !== this.map[0] || oldMap[1] !== this.map[1]) {
+                this.updateMapSize(this.map[0], this.map[1]);
+                HUDStore.nerdStats.map.set([this.map[0] * 2, this.map[1] * 2]);
+            }
+            this.postParse();
+            if (document.hidden) {
+                const now = performance.now();
+                const dt = now - this.lastRAF;
+                this.lastRAF = now;
+                RenderModule.render(this, 1, dt, false);
+            }
         };
 
         // Handle "server" message
@@ -500,24 +533,21 @@ export default class Client {
                 const { data } = e;
 
                 if (data instanceof Uint8Array) {
-                    this.lastPacket = this.lastRAF;
-                    this.bytesReceived += data.byteLength;
-
-                    const oldMap = this.map.slice(0);
-                    RenderModule.parse(this, data.buffer);
-
-                    if (oldMap[0] !== this.map[0] || oldMap[1] !== this.map[1]) {
-                        this.updateMapSize(this.map[0], this.map[1]);
-                        HUDStore.nerdStats.map.set([this.map[0] * 2, this.map[1] * 2]);
+                    onFrame(data.byteLength, () => RenderModule.parse(this, data.buffer));
+                } else if (typeof data === 'object') {
+                    // Frames parsed in place from the ring shared with the worker
+                    if (data.ring) {
+                        RenderModule.setFrameRing(data.ring);
+                        return;
                     }
-                    this.postParse();
-                    if (document.hidden) {
-                        const now = performance.now();
-                        const dt = now - this.lastRAF;
-                        this.lastRAF = now;
-                        RenderModule.render(this, 1, dt, false);
+                    if (data.frame !== undefined) {
+                        const seq = data.frame;
+                        let bytes = 0;
+                        onFrame(0, () => (bytes = RenderModule.parseFrame(this, seq)));
+                        this.bytesReceived += bytes;
+                        return;
                     }
-                } else if (typeof data === 'object') {
+
                     const {
                         mode,
                         event,
@@ -722,9 +752,13 @@ export default class Client {
             this.bindVAO(this.spritesVAO);
             gl.drawArrays(this.gl.TRIANGLES, 0, vlen / 4);
         } else {
-            gl.useProgram(this.spriteProg);
+            // One 32 byte record per sprite instead of 6 vertices
+            const instanced = !!this.instanceProg && this.settings.instancing.v;
+            const prog = instanced ? this.instanceProg : this.spriteProg;
+
+            gl.useProgram(prog);
             gl.uniformMatrix4fv(
-                this.getUniform(this.spriteProg, 'p'),
+                this.getUniform(prog, 'p'),
                 false,
                 this.proj as Float32Array,
             );
@@ -734,6 +768,26 @@ export default class Client {
                 this.debug = true;
             }
 
+            if (instanced) {
+                const count = RenderModule.render(this, lerp, dt, this.debug, true);
+                this.debug = false;
+
+                const upload_start = performance.now();
+
+                const sub = new Uint8Array(this.spriteBuffer.buffer, 0, count * 32);
+                gl.bindBuffer(gl.ARRAY_BUFFER, this.buffers.get('i'));
+                gl.bufferSubData(gl.ARRAY_BUFFER, 0, sub);
+                this.gpuBytesUploaded += sub.byteLength;
+
+                const upload_end = performance.now();
+                this.r_timings.upload = upload_end - upload_start;
+                this.r_timings.total += this.r_timings.upload;
+
+                this.bindVAO(this.instancesVAO);
+                this.gl2.drawArraysInstanced(gl.TRIANGLES, 0, 6, count);
+                return;
+            }
+
             const vlen = RenderModule.render(this, lerp, dt, this.debug);
 
             if (this.debug) {
@@ -984,6 +1038,7 @@ export default class Client {
         this.prepDiscoProg(this.gl);
         this.prepVidProg(this.gl);
         this.prepSpriteProg(this.gl);
+        if (this.gl2) this.prepInstanceProg(this.gl2);
 
         this.initTextures();
         this.resize();
@@ -1212,6 +1267,53 @@ export default class Client {
         gl.vertexAttribPointer(loc4, 1, gl.UNSIGNED_BYTE, true, 5, 4);
     }
 
+    // Instanced sprites, WebGL2 only. Records are written into spriteBuffer:
+    // center and half extents (4 floats), uv rect (4 normalized u16), color
+    // (4 normalized u8), rotation (normalized u16), texture unit, padding.
+    private prepInstanceProg(gl: WebGL2RenderingContext) {
+        const prog = (this.instanceProg = makeProg(gl, SpriteInstVert, SpriteFrag));
+        gl.useProgram(prog);
+        this.loadUniform(prog, 'p', 's');
+        gl.uniform1iv(
+            this.getUniform(prog, 's'),
+            new Int32Array(Array.from({ length: 16 }, (_, i) => i)),
+        );
+
+        this.instancesVAO = this.createVAO();
+        this.bindVAO(this.instancesVAO);
+
+        {
+            const buffer = this.allocBuffer('q');
+            gl.bindBuffer(gl.ARRAY_BUFFER, buffer);
+            gl.bufferData(gl.ARRAY_BUFFER, new Float32Array(QUAD_VERT), gl.STATIC_DRAW);
+        }
+
+        const loc0 = gl.getAttribLocation(prog, 'q');
+        gl.enableVertexAttribArray(loc0);
+        gl.vertexAttribPointer(loc0, 2, gl.FLOAT, false, 0, 0);
+
+        {
+            const buffer = this.allocBuffer('i');
+            gl.bindBuffer(gl.ARRAY_BUFFER, buffer);
+            gl.bufferData(gl.ARRAY_BUFFER, this.spriteBuffer.byteLength, gl.DYNAMIC_DRAW);
+        }
+
+        const attribs: [string, number, number, number, boolean][] = [
+            ['b', 4, gl.FLOAT, 0, false],
+            ['u', 4, gl.UNSIGNED_SHORT, 16, true],
+            ['c', 4, gl.UNSIGNED_BYTE, 24, true],
+            ['a', 1, gl.UNSIGNED_SHORT, 28, true],
+            ['t', 1, gl.UNSIGNED_BYTE, 30, true],
+        ];
+
+        for (const [name, size, type, offset, normalized] of attribs) {
+            const loc = gl.getAttribLocation(prog, name);
+            gl.enableVertexAttribArray(loc);
+            gl.vertexAttribPointer(loc, size, type, normalized, 32, offset);
+            gl.vertexAttribDivisor(loc, 1);
+        }
+    }
+
     public playVid() {
         this.vidElem.src = BASrc;
     }
@@ -17,6 +17,8 @@ const s = {
     renderFood: new S('renderFood', true),
     drawDelay: new S('drawDelay', 120),
     resolution: new S('resolution', 1),
+    sortMode: new S('sortMode', 1),
+    instancing: new S('instancing', true),
     nameThresh: new S('nameThresh', 25),
     massThresh: new S('massThresh', 25),
     showHUD: new S('showHUD', true),
@@ -78,6 +80,23 @@ export const SettingCategory: { [key: string]: Setting<number | boolean>[] } = {
                 3: '256x144 PH',
             },
         ),
+        new Setting(
+            s.sortMode,
+            1,
+            {
+                min: 0,
+                max: 1,
+                step: 1,
+                text: 'Cell Sort',
+            },
+            {
+                0: 'Cell Sort: Comparison',
+                1: 'Cell Sort: Radix',
+            },
+        ),
+        new Setting(s.instancing, 0, {
+            text: 'Instanced Rendering',
+        }),
     ],
     Camera: [
         new Setting(s.cameraSpeed, 3, {
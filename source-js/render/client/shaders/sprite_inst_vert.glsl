@@ -0,0 +1,27 @@
+precision highp float;
+
+// Unit quad corner, per vertex
+attribute vec2 q;
+// Per instance: center and half extents, uv rect, color, rotation, unit
+attribute vec4 b;
+attribute vec4 u;
+attribute vec4 c;
+attribute float a;
+attribute float t;
+
+uniform mat4 p;
+
+varying vec2 uv;
+varying vec4 color;
+varying float tex;
+
+void main() {
+    vec2 d = q * b.zw;
+    float r = a * 6.283185307;
+    float s = sin(r);
+    float k = cos(r);
+    gl_Position = p * vec4(b.xy + vec2(d.x * k - d.y * s, d.x * s + d.y * k), 0.0, 1.0);
+    uv = mix(u.xw, u.zy, q * 0.5 + 0.5);
+    color = c;
+    tex = t * 255.0;
+}
\ No newline at end of file
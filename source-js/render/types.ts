@@ -1,6 +1,9 @@
+export type CytosPlacement = 'none' | 'spread' | 'cores' | 'numa';
+
 export interface CytosTimings {
     usage: number;
     threads: number;
+    placement: CytosPlacement;
     spawn_cells: number;
     handle_io: number;
     spawn_handles: number;
@@ -1,28 +1,54 @@
 import { initServerDB, loadServer, saveServer } from './client/state';
-import { CytosInputData, CytosTimings, CytosVersion } from './types';
+import { CytosInputData, CytosPlacement, CytosTimings, CytosVersion } from './types';
 
 const ctx: Worker = self as any; // eslint-disable-line no-restricted-globals
 
 interface SaveResult {
     mode: string;
-    buffer: Uint8Array;
+    bytes: number;
+    // Only when not written to a file descriptor
+    buffer?: Uint8Array;
+}
+
+interface SaveOptions {
+    fd?: number;
+    compress?: boolean;
+}
+
+interface CheckpointResult extends SaveResult {
+    path?: string;
+    // Milliseconds on the tick and in the background
+    capture: number;
+    encode: number;
+}
+
+interface CheckpointOptions {
+    path?: string;
+    compress?: boolean;
+    // Seconds between checkpoints, 0 stops them
+    every?: number;
 }
 
 interface CytosAddon {
     setInput(data: CytosInputData);
 
     setGameMode(mode: string);
-    setThreads(threads: number);
+    setThreads(threads: number, placement?: CytosPlacement);
 
-    onBuffer(cb: (buffer: Buffer) => void);
+    onBuffer(cb: (buffer: Buffer | number) => void);
+    setFrameRing(ring?: SharedArrayBuffer, slots?: number): boolean;
     onInfo(cb: (info: object) => void);
 
     getTimings: () => CytosTimings;
     getVersion: () => CytosVersion;
 
     restart: () => boolean;
-    save: () => SaveResult;
-    restore: (mode: string, buffer: Uint8Array) => boolean;
+    save: (options?: SaveOptions) => SaveResult;
+    restore: (mode: string, source: Uint8Array | number) => boolean;
+    checkpoint: (
+        options?: CheckpointOptions,
+        cb?: (result: CheckpointResult | null) => void,
+    ) => boolean;
 }
 
 let db: IDBDatabase;
@@ -31,7 +57,20 @@ const Cytos: CytosAddon = eval("require('./cytos-addon.node')");
 
 ctx.postMessage({ version: Cytos.getVersion() });
 
-Cytos.onBuffer(buf => ctx.postMessage(buf, [buf.buffer]));
+// Frames go through a ring shared with the renderer when we can have one,
+// then only the frame seq is posted. Full or missing ring falls back to
+// transferring a buffer per frame
+const FRAME_SLOTS = 4;
+const FRAME_SLOT_SIZE = 4 * 1024 * 1024;
+
+if (typeof SharedArrayBuffer !== 'undefined') {
+    const ring = new SharedArrayBuffer(4096 + FRAME_SLOTS * FRAME_SLOT_SIZE);
+    if (Cytos.setFrameRing(ring, FRAME_SLOTS)) ctx.postMessage({ ring });
+}
+
+Cytos.onBuffer(buf =>
+    typeof buf === 'number' ? ctx.postMessage({ frame: buf }) : ctx.postMessage(buf, [buf.buffer]),
+);
 Cytos.onInfo(info => ctx.postMessage(info));
 
 setInterval(() => ctx.postMessage({ timings: Cytos.getTimings() }), 1000);
@@ -44,6 +83,7 @@ type WorkerDataEvent = MessageEvent<{
     restart?: boolean;
     mode?: string;
     threads?: number;
+    placement?: CytosPlacement;
     isBenchmark?: boolean;
     input?: CytosInputData;
 }>;
@@ -51,7 +91,7 @@ type WorkerDataEvent = MessageEvent<{
 const afterSave = async (result: SaveResult) => {
     if (result) {
         await saveServer(db, result.mode, result.buffer);
-        postMessage({ save: result.mode, bytes: result.buffer.byteLength });
+        postMessage({ save: result.mode, bytes: result.bytes });
     }
 };
 
@@ -59,7 +99,7 @@ ctx.addEventListener('message', async (e: WorkerDataEvent) => {
     const { data } = e;
     if (!data || !db) return;
 
-    const { save, restore, restart, mode, threads, input } = data;
+    const { save, restore, restart, mode, threads, placement, input } = data;
 
     if (mode !== undefined) {
         const result = Cytos.save();
@@ -77,10 +117,11 @@ ctx.addEventListener('message', async (e: WorkerDataEvent) => {
 
         await afterSave(result);
     }
-    if (!isNaN(threads)) Cytos.setThreads(threads);
+    if (!isNaN(threads)) Cytos.setThreads(threads, placement);
     if (input) Cytos.setInput(input);
 
-    if (save) afterSave(Cytos.save());
+    // Encoded off the tick, unless one is still running
+    if (save && !Cytos.checkpoint({}, afterSave)) afterSave(Cytos.save());
 
     if (restore) {
         const data = await loadServer(db, restore);